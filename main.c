@@ -1,27 +1,66 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
 
 #include <ncurses.h>
 
-#define BUFFER_SIZE 16 * 1024
 #define MAX_COMMAND_LEN 256
-#define MAX_ERROR_LEN 64
+#define MAX_ERROR_LEN 128
+
+// Max value of uint64 with commas and null char
+#define MAX_RENDERED_INT 27
 
 #define KEY_ESC 27
 #define KEY_RETURN 10
 #define KEY_DELETE 127
+#define KEY_CTRL_R 18
 
 #define STYLE_ERROR 13
 #define STYLE_CURSOR 14
+#define STYLE_MATCH 15
+#define STYLE_DIFF 16
+#define STYLE_SELECTION 17
+#define STYLE_HOLE 18
+
+// Minimap blocks by their most common kind of bytes
+#define STYLE_MAP_ZEROS 19
+#define STYLE_MAP_TEXT 20
+#define STYLE_MAP_BINARY 21
+#define STYLE_MAP_RANDOM 22
 
 #define CHARS_PER_BYTE 3
 
 #define ESCAPE_SEQUENCE_MAX_TIME_MS 50
+#define MAX_ESCAPE_SEQUENCE_LEN 16
+
+// Bracketed paste markers, reported by read_event()
+#define KEY_PASTE_START (KEY_MAX + 1)
+#define KEY_PASTE_END (KEY_MAX + 2)
+
+// Input is applied in batches and the screen redrawn at most this often
+#define MAX_FRAMES_PER_SECOND 60
 
 typedef struct
 {
@@ -35,12 +74,21 @@ typedef struct
 #define right(pane) (pane.left + pane.width)
 #define bottom(pane) (pane.top + pane.height)
 
-#define PANES_LEN 3
+#define PANES_LEN 6
 
 #define PANE_HEX 0
 #define PANE_ASCII 1
 #define PANE_DETAIL 2
 
+// The other file's panes, only used with --diff
+#define PANE_DIFF_HEX 3
+#define PANE_DIFF_ASCII 4
+
+// Only used with :set minimap
+#define PANE_MINIMAP 5
+
+#define MINIMAP_WIDTH 2
+
 pane panes[PANES_LEN];
 
 typedef struct
@@ -49,15 +97,121 @@ typedef struct
     int y;
 } point;
 
-unsigned char* source = NULL;
-int source_len;
+// The buffer is a piece table: a sequence of pieces, each pointing at a run
+// of bytes either in file_data (the file as opened) or in the append-only
+// add buffer that inserted bytes are copied to. The pieces are kept in a
+// treap ordered by position, with each node caching the length of its
+// subtree, so finding the piece holding an offset and inserting or deleting
+// bytes take O(log pieces) whatever the size of the file. Overwriting bytes
+// changes them where they're stored; only inserts and deletes add pieces.
+typedef struct piece
+{
+    unsigned char* data;
+    int64_t len;
+    int64_t total;      // bytes in this subtree
+    unsigned priority;  // heap order, which keeps the tree balanced
+    struct piece* left;
+    struct piece* right;
+} piece;
+
+piece* pieces = NULL;
+int64_t source_len;
+
+// The file as opened. When it's memory-mapped, file_data is a private
+// read-only mapping that only becomes writable (copy-on-write) once the
+// first edit is made.
+unsigned char* file_data = NULL;
+int64_t file_data_len = 0;
+bool source_mapped = false;
+bool source_writable = false;
+
+// Holes in the mapped file (found with SEEK_HOLE / SEEK_DATA), as sorted,
+// disjoint ranges of file_data. They read as zeros and take no space on
+// disk, so searches skip them and saves leave them out. Pages edited inside
+// a hole are cut out of it.
+typedef struct
+{
+    int64_t start;
+    int64_t end;
+} hole;
+
+hole* holes = NULL;
+int64_t holes_len = 0;
+int64_t holes_cap = 0;
+
+// Inserted bytes are appended to the current chunk of the add buffer. Full
+// chunks are never freed or moved since pieces (including ones only kept
+// for undo) point into them.
+#define ADD_CHUNK_SIZE (1 << 20)
+
+unsigned char* add_chunk = NULL;
+int64_t add_chunk_len = 0;
+int64_t add_chunk_cap = 0;
+
+// Held for writing while input is appended to the pieces or holes are cut,
+// which can happen while the match index is being built, and for reading by
+// the builder
+pthread_rwlock_t pieces_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Input still being read: a pipe or terminal is read in as data arrives, and
+// with --follow, so is anything appended to a regular file.
+// Reading happens between frames without ever blocking.
+#define STREAM_POLL_MS 100
+#define STREAM_READ_MIN (64 << 10)
+#define STREAM_READ_MAX (16 << 20)  // per frame, so input isn't held up
+
+int stream_fd = -1;
+bool follow = false;
+
+// Running a script over files with --batch rather than the editor
+bool batch_mode = false;
+
+// With --diff, another file shown next to the buffer for comparison. It's
+// mapped read-only and never edited.
+char* diff_filename = NULL;
+unsigned char* diff_data = NULL;
+int64_t diff_len = 0;
+
+long page_size;
+
+// Identity of the opened file, used to recognize saves back to it.
+dev_t source_dev;
+ino_t source_ino;
+
+// Sorted indices of the pages of file_data that have been edited since the
+// file was opened or last saved.
+int64_t* dirty_pages = NULL;
+int64_t dirty_pages_len = 0;
+int64_t dirty_pages_cap = 0;
+
+// Flush saved data to disk before reporting success (:set fsync/nofsync)
+bool fsync_on_write = true;
+
+// Patch the original file's edited pages in place when it can't be cloned,
+// instead of writing a copy and renaming it over the file. Faster, but a
+// crash mid-save leaves the file partly written (:set inplace/noinplace).
+bool save_in_place = false;
 
 char* original_filename;
 
-int cursor_byte = 0;
+int64_t cursor_byte = 0;
 int cursor_nibble = 0;
 
-int scroll_start = 0;
+int64_t scroll_start = 0;
+
+// Lines kept visible above and below the cursor when scrolling (:set
+// scrolloff=N)
+int scroll_off = 0;
+
+// Show the minimap column (:set minimap/nominimap)
+bool minimap_shown = false;
+
+// Set when the cursor jumps (:offset, n/N), so the view is centered on it
+// if it lands off screen
+bool cursor_jumped = false;
+
+// Set when the pane windows are recreated and everything must be redrawn
+bool panes_invalid = true;
 
 int max_x;
 int max_y;
@@ -66,18 +220,80 @@ char command[MAX_COMMAND_LEN];
 int command_len;
 bool command_entering = false;
 
-// 2 hex digits plus space
-#define MAX_SEARCH_TERM_LEN MAX_COMMAND_LEN / 3
+// Inside a bracketed paste
+bool pasting = false;
+
+// Typed hex digits insert bytes rather than overwriting them
+bool insert_mode = false;
+
+// Visual mode (v) selects the bytes from visual_anchor to the cursor
+bool visual_mode = false;
+int64_t visual_anchor = 0;
+
+// Quoted ASCII can produce up to one byte per command character
+#define MAX_SEARCH_TERM_LEN MAX_COMMAND_LEN
+
+// The search pattern: a byte matches position i when
+// (byte & search_mask[i]) == search_term[i].
 unsigned char search_term[MAX_SEARCH_TERM_LEN];
+unsigned char search_mask[MAX_SEARCH_TERM_LEN];
 int search_term_len;
 
 char error_text[MAX_ERROR_LEN];
 bool error_displayed = false;
+bool error_is_message = false;
 
 void set_error(const char* text)
 {
     error_displayed = true;
-    strncpy(error_text, text, MAX_ERROR_LEN);
+    error_is_message = false;
+    strncpy(error_text, text, MAX_ERROR_LEN - 1);
+    error_text[MAX_ERROR_LEN - 1] = 0;
+}
+
+// Like set_error() but for informational messages (not highlighted).
+void set_message(const char* text)
+{
+    set_error(text);
+    error_is_message = true;
+}
+
+// Turn something like "1234" to "1,234". str must have enough space to add
+// the commas (plus one for null termination): (len - 1) / 3 + 1
+void add_commas(char* str, int len)
+{
+    // Skip dash if negative integer
+    if (str[0] == '-')
+    {
+        str++;
+        len--;
+    }
+
+    int commas = (len - 1) / 3;
+
+    int source = len - 1;
+    int target = source + commas;
+
+    str[target + 1] = 0;
+
+    while (source >= 0)
+    {
+        int digits_processed = len - source - 1;
+
+        if (digits_processed && digits_processed % 3 == 0)
+        {
+            str[target--] = ',';
+        }
+
+        str[target--] = str[source--];
+    }
+}
+
+// Format n with thousands separators
+void format_count(int64_t n, char* output)
+{
+    int len = snprintf(output, MAX_RENDERED_INT, "%" PRId64, n);
+    add_commas(output, len);
 }
 
 void setup_pane(pane* pane)
@@ -88,6 +304,9 @@ void setup_pane(pane* pane)
     }
 
     pane->window = newwin(pane->height, pane->width, pane->top, pane->left);
+
+    // Let the terminal shift lines itself when the view scrolls
+    idlok(pane->window, TRUE);
 }
 
 char nibble_to_hex(unsigned char nibble)
@@ -126,6 +345,39 @@ void byte_to_hex(unsigned char byte, char* hex)
     hex[1] = nibble_to_hex(second_nibble(byte));
 }
 
+// Lookup tables for formatting rows: the two hex digits for each byte and
+// the character the ASCII pane shows for it.
+char hex_digits[256][2];
+char ascii_chars[256];
+
+void init_format_tables()
+{
+    for (int byte = 0; byte < 256; byte++)
+    {
+        byte_to_hex(byte, hex_digits[byte]);
+        ascii_chars[byte] = byte >= ' ' && byte <= '~' ? byte : '.';
+    }
+}
+
+// Write len bytes as "xx xx xx " to output (len * CHARS_PER_BYTE chars)
+void format_hex_row(const unsigned char* bytes, int len, char* output)
+{
+    for (int i = 0; i < len; i++)
+    {
+        memcpy(output, hex_digits[bytes[i]], 2);
+        output[2] = ' ';
+        output += CHARS_PER_BYTE;
+    }
+}
+
+void format_ascii_row(const unsigned char* bytes, int len, char* output)
+{
+    for (int i = 0; i < len; i++)
+    {
+        output[i] = ascii_chars[bytes[i]];
+    }
+}
+
 unsigned char nibbles_to_byte(unsigned char n0, unsigned char n1)
 {
     return n0 << 4 | n1;
@@ -136,39 +388,39 @@ int bytes_per_line()
     return panes[PANE_HEX].width / CHARS_PER_BYTE;
 }
 
-int byte_in_line(int byte_offset)
+int64_t byte_in_line(int64_t byte_offset)
 {
     return byte_offset / bytes_per_line();
 }
 
-int byte_in_column(int byte_offset)
+int byte_in_column(int64_t byte_offset)
 {
     return byte_offset % bytes_per_line() * CHARS_PER_BYTE;
 }
 
-int first_byte_in_line(int line_index)
+int64_t first_byte_in_line(int64_t line_index)
 {
     return line_index * bytes_per_line();
 }
 
-int last_byte_in_line(int line_index)
+int64_t last_byte_in_line(int64_t line_index)
 {
     return first_byte_in_line(line_index + 1) - 1;
 }
 
-int first_visible_byte()
+int64_t first_visible_byte()
 {
     return first_byte_in_line(scroll_start);
 }
 
-int last_visible_line()
+int64_t last_visible_line()
 {
     return scroll_start + panes[PANE_HEX].height - 1;
 }
 
-int last_visible_byte()
+int64_t last_visible_byte()
 {
-    int ret = last_byte_in_line(last_visible_line());
+    int64_t ret = last_byte_in_line(last_visible_line());
 
     return ret < source_len ? ret : source_len - 1;
 }
@@ -177,36 +429,86 @@ void handle_sizing()
 {
     static int last_max_x = -1;
     static int last_max_y = -1;
+    static bool last_minimap_shown = false;
 
     getmaxyx(stdscr, max_y, max_x);
 
-    if (max_y == last_max_y && max_x == last_max_x)
+    if (max_y == last_max_y && max_x == last_max_x &&
+        minimap_shown == last_minimap_shown)
     {
         return;
     }
 
-    // Terminal resized
+    // Terminal resized. Keep the byte at the top of the view at the top.
+    int64_t top = bytes_per_line() > 0 ? first_visible_byte() : 0;
+
     last_max_x = max_x;
     last_max_y = max_y;
+    last_minimap_shown = minimap_shown;
 
     panes[PANE_DETAIL].height = 7;
 
+    // The minimap takes a column on the right, and when comparing, each
+    // file gets half of what's left
+    int width = max_x - 1 - (minimap_shown ? MINIMAP_WIDTH + 1 : 0);
+
+    if (diff_filename)
+    {
+        width /= 2;
+    }
+
     panes[PANE_HEX].left = 1;
     panes[PANE_HEX].top = 0;
-    panes[PANE_HEX].width = (max_x - 1) * 0.75;
+    panes[PANE_HEX].width = width * 0.75;
     panes[PANE_HEX].height = max_y - panes[PANE_DETAIL].height;
     setup_pane(&panes[PANE_HEX]);
 
     panes[PANE_ASCII].left = panes[PANE_HEX].left + panes[PANE_HEX].width;
     panes[PANE_ASCII].top = panes[PANE_HEX].top;
-    panes[PANE_ASCII].width = (max_x - 1) * 0.25;
+    panes[PANE_ASCII].width = width * 0.25;
     panes[PANE_ASCII].height = max_y - panes[PANE_DETAIL].height;
     setup_pane(&panes[PANE_ASCII]);
 
+    if (diff_filename)
+    {
+        panes[PANE_DIFF_HEX].left = panes[PANE_HEX].left + width;
+        panes[PANE_DIFF_HEX].top = panes[PANE_HEX].top;
+        panes[PANE_DIFF_HEX].width = panes[PANE_HEX].width;
+        panes[PANE_DIFF_HEX].height = panes[PANE_HEX].height;
+        setup_pane(&panes[PANE_DIFF_HEX]);
+
+        panes[PANE_DIFF_ASCII].left = panes[PANE_ASCII].left + width;
+        panes[PANE_DIFF_ASCII].top = panes[PANE_ASCII].top;
+        panes[PANE_DIFF_ASCII].width = panes[PANE_ASCII].width;
+        panes[PANE_DIFF_ASCII].height = panes[PANE_ASCII].height;
+        setup_pane(&panes[PANE_DIFF_ASCII]);
+    }
+
+    if (minimap_shown)
+    {
+        panes[PANE_MINIMAP].left = max_x - MINIMAP_WIDTH;
+        panes[PANE_MINIMAP].top = panes[PANE_HEX].top;
+        panes[PANE_MINIMAP].width = MINIMAP_WIDTH;
+        panes[PANE_MINIMAP].height = panes[PANE_HEX].height;
+        setup_pane(&panes[PANE_MINIMAP]);
+    }
+    else if (panes[PANE_MINIMAP].window)
+    {
+        delwin(panes[PANE_MINIMAP].window);
+        panes[PANE_MINIMAP].window = NULL;
+    }
+
     panes[PANE_DETAIL].left = 0;
     panes[PANE_DETAIL].top = max_y - panes[PANE_DETAIL].height;
     panes[PANE_DETAIL].width = max_x;
     setup_pane(&panes[PANE_DETAIL]);
+
+    scroll_start = bytes_per_line() > 0 ? byte_in_line(top) : 0;
+
+    // Resizing leaves all of stdscr touched; push it out now so it isn't
+    // refreshed over the panes later.
+    wnoutrefresh(stdscr);
+    panes_invalid = true;
 }
 
 void handle_start_command(char first_char)
@@ -221,982 +523,11416 @@ void handle_cancel_command()
     command_entering = false;
 }
 
-void quit()
+// Give the kernel a paging hint for the mapped file
+void advise_source(int advice)
 {
-    if (source != NULL)
+    if (!source_mapped)
     {
-        free(source);
+        return;
     }
 
-    endwin();
-    exit(0);
+    madvise(file_data, file_data_len, advice);
 }
 
-void handle_write()
+// Make the mapped file writable. Only pages that are actually edited get
+// copied by the kernel; the rest stay backed by the file.
+bool make_source_writable()
 {
-    char* subcommand = command + 2;
-    int remaining = command_len - 2;
-
-    // Check for quit
-    bool also_quit = false;
-    if (remaining > 0 && subcommand[0] == 'q')
+    if (source_writable)
     {
-        also_quit = true;
-        subcommand++;
-        remaining--;
+        return true;
     }
 
-    // Check for filename in command
-    char* filename = original_filename;
-    if (remaining > 0 && subcommand[0] == ' ')
+    if (mprotect(file_data, file_data_len, PROT_READ | PROT_WRITE) != 0)
     {
-        filename = subcommand + 1;
+        set_error("Unable to make buffer writable");
+        return false;
     }
 
-    // Write buffer to disk
-    FILE* file = fopen(filename, "w");
-
-    if (!file)
-    {
-        set_error("Error opening file: path not found or permissions?");
-        return;
-    }
+    source_writable = true;
+    return true;
+}
 
-    size_t bytes_written = 0;
-    size_t bytes_left = source_len;
+// Position of the first dirty page >= page
+int64_t find_dirty_page(int64_t page)
+{
+    int64_t low = 0;
+    int64_t high = dirty_pages_len;
 
-    while (bytes_left > 0)
+    while (low < high)
     {
-        size_t size = BUFFER_SIZE < bytes_left ? BUFFER_SIZE : bytes_left;
-        size_t written = fwrite(source + bytes_written, 1, size, file);
+        int64_t mid = (low + high) / 2;
 
-        if (written != size)
+        if (dirty_pages[mid] < page)
         {
-            set_error("Encountered error while writing file; may be corrupt.");
-            return;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
         }
-
-        bytes_written += written;
-        bytes_left -= written;
     }
 
-    fclose(file);
+    return low;
+}
 
-    if (also_quit)
+// Mark the page of file_data holding offset as edited
+void mark_dirty(int64_t offset)
+{
+    int64_t page = offset / page_size;
+    int64_t low = find_dirty_page(page);
+
+    if (low < dirty_pages_len && dirty_pages[low] == page)
     {
-        quit();
+        return;
+    }
+
+    if (dirty_pages_len == dirty_pages_cap)
+    {
+        dirty_pages_cap = dirty_pages_cap ? dirty_pages_cap * 2 : 64;
+        dirty_pages = realloc(dirty_pages, dirty_pages_cap * sizeof(int64_t));
     }
+
+    memmove(&dirty_pages[low + 1], &dirty_pages[low],
+            (dirty_pages_len - low) * sizeof(int64_t));
+
+    dirty_pages[low] = page;
+    dirty_pages_len++;
 }
 
-void handle_jump_offset()
+// Position of the first hole ending after offset
+int64_t find_hole(int64_t offset)
 {
-    // Make sure the command is an ASCII integer
-    for (int i = 1; i < command_len; i++)
+    int64_t low = 0;
+    int64_t high = holes_len;
+
+    while (low < high)
     {
-        if (command[i] < '0' || command[i] > '9')
+        int64_t mid = (low + high) / 2;
+
+        if (holes[mid].end <= offset)
         {
-            return;
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
         }
     }
 
-    // Move cursor to requested offset
-    cursor_byte = atoi(command + 1);
-    cursor_nibble = 0;
+    return low;
 }
 
-bool is_hex_digit(char c)
+// How many bytes of the file from start to end aren't in holes
+int64_t data_bytes(int64_t start, int64_t end)
 {
-    return (c >= '0' && c <= '9') ||
-           (c >= 'a' && c <= 'f') ||
-           (c >= 'A' && c <= 'F');
+    int64_t len = end - start;
+
+    for (int64_t i = find_hole(start); i < holes_len && holes[i].start < end;
+         i++)
+    {
+        int64_t hole_start = holes[i].start > start ? holes[i].start : start;
+        int64_t hole_end = holes[i].end < end ? holes[i].end : end;
+        len -= hole_end - hole_start;
+    }
+
+    return len;
 }
 
-void set_search_term(char* hex_ascii, int len)
+void reserve_holes(int64_t len)
 {
-    int cur = 0;
-    search_term_len = 0;
+    if (len > holes_cap)
+    {
+        holes_cap = holes_cap * 2 > len ? holes_cap * 2 : len + 64;
+        holes = realloc(holes, holes_cap * sizeof(hole));
+    }
+}
 
-    while (true)
+// Find the holes in the first file_data_len bytes of the file open as fd
+void load_holes(int fd)
+{
+    holes_len = 0;
+
+    for (off_t data = 0; data < file_data_len; )
     {
-        // Skip any whitespace
-        while (cur < len && isspace(hex_ascii[cur]))
-        {
-            cur++;
-        }
+        off_t start = lseek(fd, data, SEEK_HOLE);
 
-        if (cur >= len)
+        // Either holes aren't supported or there are no more. The end of
+        // the file counts as a hole.
+        if (start < 0 || start >= file_data_len)
         {
             break;
         }
 
-        unsigned char first = hex_ascii[cur++];
-        unsigned char second = hex_ascii[cur++];
-
-        if (!is_hex_digit(first) || !is_hex_digit(second))
-        {
-            search_term_len = 0;
-            set_error("Invalid search term format");
-            return;
-        }
+        data = lseek(fd, start, SEEK_DATA);
 
-        if (search_term_len >= MAX_SEARCH_TERM_LEN)
+        if (data < 0 || data > file_data_len)
         {
-            search_term_len = 0;
-            set_error("Search term storage overflow");
-            return;
+            data = file_data_len;
         }
 
-        search_term[search_term_len++] = nibbles_to_byte(
-                hex_to_nibble(first), hex_to_nibble(second));
+        reserve_holes(holes_len + 1);
+        holes[holes_len].start = start;
+        holes[holes_len].end = data;
+        holes_len++;
     }
 }
 
-void handle_search_next()
+// Take [start, end) of file_data out of the holes since it's been written to
+void cut_holes(int64_t start, int64_t end)
 {
-    if (!search_term_len)
+    int64_t first = find_hole(start);
+
+    if (first == holes_len || holes[first].start >= end)
     {
         return;
     }
 
-    int cur = cursor_byte + 1;
+    int64_t last = first;
 
-    while (cur != cursor_byte)
+    while (last < holes_len && holes[last].start < end)
     {
-        if (cur + search_term_len >= source_len)
-        {
-            cur = 0;
-        }
+        last++;
+    }
 
-        bool match = true;
+    // What's left of the first and last holes overlapping the range
+    hole kept[2];
+    int kept_len = 0;
 
-        if (cur + search_term_len >= source_len)
-        {
-            continue;
-        }
+    if (holes[first].start < start)
+    {
+        kept[kept_len].start = holes[first].start;
+        kept[kept_len++].end = start;
+    }
 
-        for (int i = 0; i < search_term_len; i++)
-        {
-            if (source[cur + i] != search_term[i])
-            {
-                match = false;
-                break;
-            }
-        }
+    if (holes[last - 1].end > end)
+    {
+        kept[kept_len].start = end;
+        kept[kept_len++].end = holes[last - 1].end;
+    }
 
-        if (match)
-        {
-            cursor_byte = cur;
-            cursor_nibble = 0;
-            return;
-        }
+    // Background searches skip holes
+    pthread_rwlock_wrlock(&pieces_lock);
 
-        cur++;
-    }
+    reserve_holes(holes_len + 1);
+    memmove(&holes[first + kept_len], &holes[last],
+            (holes_len - last) * sizeof(hole));
+    memcpy(&holes[first], kept, kept_len * sizeof(hole));
+    holes_len += kept_len - (last - first);
 
-    set_error("Search term not found");
+    pthread_rwlock_unlock(&pieces_lock);
 }
 
-void handle_search_previous()
+// The hole nearest one end of [start, end) of file_data (the first if
+// forward, else the last) at least min_len bytes long once clipped to the
+// range. Returns false if there isn't one.
+bool nearest_hole(int64_t start, int64_t end, int64_t min_len, bool forward,
+                  int64_t* hole_start, int64_t* hole_end)
 {
-    if (!search_term_len)
+    int64_t i = find_hole(start);
+
+    if (!forward)
     {
-        return;
+        // The last hole starting before end
+        i = find_hole(end);
+        i -= i == holes_len || holes[i].start >= end;
     }
 
-    int cur = cursor_byte - 1;
-
-    while (cur != cursor_byte)
+    while (i >= 0 && i < holes_len && holes[i].start < end &&
+           holes[i].end > start)
     {
-        if (cur < 0)
-        {
-            cur = source_len - search_term_len;
-        }
-
-        bool match = true;
-
-        for (int i = 0; i < search_term_len; i++)
-        {
-            if (source[cur + i] != search_term[i])
-            {
-                match = false;
-                break;
-            }
-        }
+        *hole_start = holes[i].start > start ? holes[i].start : start;
+        *hole_end = holes[i].end < end ? holes[i].end : end;
 
-        if (match)
+        if (*hole_end - *hole_start >= min_len)
         {
-            cursor_byte = cur;
-            cursor_nibble = 0;
-            return;
+            return true;
         }
 
-        cur--;
+        i += forward ? 1 : -1;
     }
 
-    set_error("Search term not found");
+    return false;
 }
 
-void handle_submit_command()
+int64_t piece_total(piece* p)
 {
-    command[command_len] = 0;
-    command_entering = false;
+    return p ? p->total : 0;
+}
 
-    if (command[0] == '/')
+void update_piece(piece* p)
+{
+    p->total = piece_total(p->left) + p->len + piece_total(p->right);
+}
+
+piece* new_piece(unsigned char* data, int64_t len)
+{
+    piece* p = malloc(sizeof(piece));
+    p->data = data;
+    p->len = len;
+    p->total = len;
+    p->priority = rand();
+    p->left = NULL;
+    p->right = NULL;
+    return p;
+}
+
+void free_pieces(piece* p)
+{
+    if (!p)
     {
-        set_search_term(&command[1], command_len - 1);
-        handle_search_next();
         return;
     }
 
-    if (strncmp(command, ":q", MAX_COMMAND_LEN) == 0)
+    free_pieces(p->left);
+    free_pieces(p->right);
+    free(p);
+}
+
+// Join two trees, with all of a's bytes coming before b's
+piece* merge_pieces(piece* a, piece* b)
+{
+    if (!a || !b)
     {
-        quit();
-        return;
+        return a ? a : b;
     }
 
-    if (command[1] == 'w')
+    if (a->priority > b->priority)
     {
-        handle_write();
-        return;
+        a->right = merge_pieces(a->right, b);
+        update_piece(a);
+        return a;
     }
 
-    handle_jump_offset();
+    b->left = merge_pieces(a, b->left);
+    update_piece(b);
+    return b;
 }
 
-void handle_backspace_command()
+// Split a tree into the bytes before offset and the rest, cutting the piece
+// that straddles offset in two
+void split_pieces(piece* p, int64_t offset, piece** before, piece** after)
 {
-    if (command_len == 1)
+    if (!p)
     {
-        handle_cancel_command();
+        *before = NULL;
+        *after = NULL;
         return;
     }
 
-    command_len--;
-}
+    int64_t left = piece_total(p->left);
 
-void handle_add_to_command(int event)
-{
-    if (event < 32 || event > '~')
+    if (offset <= left)
     {
-        return;
+        split_pieces(p->left, offset, before, &p->left);
+        update_piece(p);
+        *after = p;
     }
-
-    if (command_len >= MAX_COMMAND_LEN)
+    else if (offset >= left + p->len)
     {
-        return;
+        split_pieces(p->right, offset - left - p->len, &p->right, after);
+        update_piece(p);
+        *before = p;
+    }
+    else
+    {
+        // The second half takes over p's right subtree and its priority,
+        // which is at least that of everything below it
+        int64_t cut = offset - left;
+        piece* tail = new_piece(p->data + cut, p->len - cut);
+        tail->priority = p->priority;
+        tail->right = p->right;
+        update_piece(tail);
+
+        p->len = cut;
+        p->right = NULL;
+        update_piece(p);
+
+        *before = p;
+        *after = tail;
     }
-
-    command[command_len++] = event;
 }
 
-void handle_command_event(int event)
+// Grow the last piece of a tree by len bytes if its data carries on at
+// data, as it does when typing inserts bytes one after another
+bool extend_last_piece(piece* p, unsigned char* data, int64_t len)
 {
-    switch (event)
+    if (!p)
     {
-        case KEY_ESC:    handle_cancel_command();      break;
-        case KEY_RETURN: handle_submit_command();      break;
-        case KEY_DELETE: handle_backspace_command();   break;
-        default:         handle_add_to_command(event); break;
-    }
-}
-
-void render_command()
-{
-    if (!command_entering)
-    {
-        return;
+        return false;
     }
 
-    int start = 0;
-    int len = command_len;
-
-    // Scroll command horizontally
-    if (command_len >= max_x - 1)
+    if (p->right ? !extend_last_piece(p->right, data, len) :
+                   p->data + p->len != data)
     {
-        start = command_len - max_x + 1;
-        len = max_x - 1;
+        return false;
     }
 
-    move(max_y - 1, 0);
-
-    // Print command to screen
-    for (int i = 0; i < len; i++)
+    if (!p->right)
     {
-        addch(command[start + i]);
+        p->len += len;
     }
 
-    // Clear the rest of the command line
-    for (int i = len; i < max_x; i++)
-    {
-        addch(' ');
-    }
+    p->total += len;
+    return true;
 }
 
-void handle_key_left()
+// The piece holding offset, or NULL past the end of the buffer. Sets start
+// to the offset of the piece's first byte.
+piece* find_piece(int64_t offset, int64_t* start)
 {
-    if (cursor_nibble == 1)
-    {
-        cursor_nibble = 0;
-    }
-    else
-    {
-        cursor_nibble = 1;
-        cursor_byte--;
-    }
-}
+    piece* p = pieces;
+    *start = 0;
 
-void handle_key_right()
-{
-    if (cursor_nibble == 0)
-    {
-        cursor_nibble = 1;
-    }
-    else
+    while (p)
     {
-        cursor_nibble = 0;
-        cursor_byte++;
+        int64_t left = piece_total(p->left);
+
+        if (offset < *start + left)
+        {
+            p = p->left;
+        }
+        else if (offset < *start + left + p->len)
+        {
+            *start += left;
+            return p;
+        }
+        else
+        {
+            *start += left + p->len;
+            p = p->right;
+        }
     }
+
+    return NULL;
 }
 
-void handle_key_up()
+// The bytes at offset: returns a pointer to them and sets len to how many
+// are stored contiguously from there (0 past the end of the buffer)
+unsigned char* contiguous(int64_t offset, int64_t* len)
 {
-    int temp = cursor_byte - bytes_per_line();
+    int64_t start;
+    piece* p = offset >= 0 ? find_piece(offset, &start) : NULL;
 
-    if (temp >= 0)
+    if (!p)
     {
-        cursor_byte = temp;
+        *len = 0;
+        return NULL;
     }
+
+    *len = start + p->len - offset;
+    return p->data + (offset - start);
 }
 
-void handle_key_down()
+// Like contiguous() but for the bytes ending just before offset: returns a
+// pointer to the first of the len bytes stored contiguously up to offset
+unsigned char* contiguous_before(int64_t offset, int64_t* len)
 {
-    int temp = cursor_byte + bytes_per_line();
+    int64_t start;
+    piece* p = offset > 0 ? find_piece(offset - 1, &start) : NULL;
 
-    if (temp < source_len)
+    if (!p)
     {
-        cursor_byte = temp;
+        *len = 0;
+        return NULL;
     }
+
+    *len = offset - start;
+    return p->data;
 }
 
-void handle_previous_byte()
+// Copy len bytes starting at offset out of the buffer
+void read_bytes(int64_t offset, unsigned char* out, int64_t len)
 {
-    cursor_byte--;
+    while (len > 0)
+    {
+        int64_t available;
+        unsigned char* data = contiguous(offset, &available);
+
+        if (!available)
+        {
+            break;
+        }
+
+        if (available > len)
+        {
+            available = len;
+        }
+
+        memcpy(out, data, available);
+        out += available;
+        offset += available;
+        len -= available;
+    }
 }
 
-void handle_next_byte()
+bool in_file_data(const unsigned char* data)
 {
-    cursor_byte++;
+    return data >= file_data && data < file_data + file_data_len;
 }
 
-void handle_overwrite(int event)
+// Get len bytes where they're stored ready to be changed in place, marking
+// pages of the file as dirty. Returns false if the file can't be written.
+bool prepare_write(const unsigned char* data, int64_t len)
 {
-    // Convert A-F to lower case
-    if (event >= 'A' && event <= 'F')
+    if (!in_file_data(data))
     {
-        event += 'a' - 'A';
+        return true;
     }
 
-    // Only process 0-9 and a-f
-    if (!((event >= '0' && event <= '9') || (event >= 'a' && event <= 'f')))
+    if (!make_source_writable())
     {
-        return;
+        return false;
     }
 
-    unsigned char* byte = &source[cursor_byte];
-
-    unsigned char first = first_nibble(*byte);
-    unsigned char second = second_nibble(*byte);
+    int64_t start = data - file_data;
 
-    unsigned char* nibble = cursor_nibble ? &second : &first;
-    *nibble = hex_to_nibble(event);
+    for (int64_t page = start / page_size;
+         page <= (start + len - 1) / page_size; page++)
+    {
+        mark_dirty(page * page_size);
+    }
 
-    *byte = nibbles_to_byte(first, second);
+    cut_holes(start / page_size * page_size,
+              ((start + len - 1) / page_size + 1) * page_size);
 
-    handle_key_right();
+    return true;
 }
 
-void handle_page_up()
+// Overwrite bytes where they're stored
+void write_bytes(int64_t offset, const unsigned char* bytes, int64_t len)
 {
-    cursor_byte -= panes[PANE_HEX].height * bytes_per_line();
+    while (len > 0)
+    {
+        int64_t available;
+        unsigned char* data = contiguous(offset, &available);
+
+        if (!available)
+        {
+            break;
+        }
+
+        if (available > len)
+        {
+            available = len;
+        }
+
+        if (!prepare_write(data, available))
+        {
+            return;
+        }
+
+        memcpy(data, bytes, available);
+        bytes += available;
+        offset += available;
+        len -= available;
+    }
 }
 
-void handle_page_down()
+// Make sure there's room for at least len more bytes in the current chunk
+// of the add buffer, returning where they'd go
+unsigned char* reserve_add(int64_t len)
 {
-    cursor_byte += panes[PANE_HEX].height * bytes_per_line();
-    scroll_start += panes[PANE_HEX].height;
+    if (add_chunk_len + len > add_chunk_cap)
+    {
+        add_chunk_cap = len > ADD_CHUNK_SIZE ? len : ADD_CHUNK_SIZE;
+        add_chunk = malloc(add_chunk_cap);
+        add_chunk_len = 0;
+    }
+
+    return add_chunk + add_chunk_len;
 }
 
-void handle_end_of_buffer()
+// Copy bytes to the end of the add buffer, returning where they went
+unsigned char* append_bytes(const unsigned char* bytes, int64_t len)
 {
-    cursor_byte = source_len - 1;
-    cursor_nibble = 1;
+    unsigned char* data = reserve_add(len);
+    memcpy(data, bytes, len);
+    add_chunk_len += len;
+
+    return data;
 }
 
-// Handle compound commands that start with g (ex: gg).
-// Returns true if the event was handled.
-bool handle_g_chord(int event)
+// Whether every byte is still where it was in file_data, i.e. the buffer
+// has only been overwritten since the file was opened or saved
+bool layout_unchanged()
 {
-    static bool g_pressed = false;
-
-    if (!g_pressed)
+    if (source_len != file_data_len)
     {
-        // If g was pressed, remember that for next key in the chord.
-        // Otherwise, don't consume the event.
-        g_pressed = event == 'g';
-        return g_pressed;
+        return false;
     }
 
-    // Handle second key in the chord.
-    switch (event)
+    for (int64_t offset = 0; offset < source_len; )
     {
-        case 'g':
-            // Chord 'gg' - move to beginning of buffer
-            cursor_byte = 0;
-            cursor_nibble = 0;
-            break;
-    }
-
-    g_pressed = false;
-    return true;
-}
+        int64_t len;
 
-// Given an x,y location, find the pane at that position.
-// Return -1 if there is no pane at that position.
-int get_pane_under_coords(int x, int y)
-{
-    for (int pane = 0; pane < PANES_LEN; pane++)
-    {
-        if (x >= panes[pane].left && x <= right(panes[pane]) &&
-            y >= panes[pane].top && y <= bottom(panes[pane]))
+        if (contiguous(offset, &len) != file_data + offset)
         {
-            return pane;
+            return false;
         }
+
+        offset += len;
     }
 
-    return -1;
+    return true;
 }
 
-// Convert screen-space coords to pane-space coords
-point screen_to_pane(pane* pane, int x, int y)
-{
-    point ret;
+// Worker pool shared by anything that wants to spread a scan across cores.
+// A task is run once on every worker (including the calling thread, which
+// acts as the last worker); tasks divide up the work among themselves.
 
-    ret.x = x - pane->left;
-    ret.y = y - pane->top;
+typedef void (*pool_task)(void* arg, int worker);
 
-    return ret;
-}
+int worker_threads = 1;
 
-void handle_mouse_pressed(MEVENT mouse_event)
-{
-    int pane = get_pane_under_coords(mouse_event.x, mouse_event.y);
+pthread_t* pool_threads = NULL;
+int pool_threads_len = 0;
 
-    if (pane != PANE_HEX && pane != PANE_ASCII)
-    {
-        return;
-    }
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
 
-    point coords = screen_to_pane(&panes[pane], mouse_event.x, mouse_event.y);
+pool_task pool_current_task;
+void* pool_current_arg;
+unsigned pool_generation = 0;
+int pool_busy = 0;
+bool pool_stopping = false;
+
+void* pool_worker(void* arg)
+{
+    int worker = (intptr_t)arg;
+    unsigned seen_generation = 0;
 
-    if (pane == PANE_HEX)
+    pthread_mutex_lock(&pool_lock);
+
+    while (true)
     {
-        if (coords.x >= bytes_per_line() * CHARS_PER_BYTE - 1)
+        while (pool_generation == seen_generation && !pool_stopping)
         {
-            return;
+            pthread_cond_wait(&pool_wake, &pool_lock);
         }
 
-        cursor_byte = first_byte_in_line(coords.y + scroll_start) +
-                      coords.x / CHARS_PER_BYTE;
+        if (pool_stopping)
+        {
+            break;
+        }
 
-        cursor_nibble = coords.x % CHARS_PER_BYTE;
+        seen_generation = pool_generation;
+        pthread_mutex_unlock(&pool_lock);
 
-        if (cursor_nibble == 2)
+        pool_current_task(pool_current_arg, worker);
+
+        pthread_mutex_lock(&pool_lock);
+
+        if (--pool_busy == 0)
         {
-            cursor_byte++;
-            cursor_nibble = 0;
+            pthread_cond_signal(&pool_idle);
         }
     }
-    else if (pane == PANE_ASCII)
-    {
-        if (coords.x >= bytes_per_line())
-        {
-            return;
-        }
 
-        cursor_byte = first_byte_in_line(coords.y + scroll_start) + coords.x;
-        cursor_nibble = 0;
-    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
 }
 
-void handle_key_home()
+void stop_pool()
 {
-    cursor_byte = first_byte_in_line(byte_in_line(cursor_byte));
-    cursor_nibble = 0;
-}
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
 
-void handle_key_end()
-{
-    cursor_byte = last_byte_in_line(byte_in_line(cursor_byte));
-    cursor_nibble = 1;
-}
+    for (int i = 0; i < pool_threads_len; i++)
+    {
+        pthread_join(pool_threads[i], NULL);
+    }
 
-// Calculate the milliseconds elapsed between start and end
-unsigned ms_taken(struct timespec start, struct timespec end)
-{
-    return ((end.tv_sec - start.tv_sec) * 1000) +
-           ((end.tv_nsec - start.tv_nsec) / 1000000);
+    free(pool_threads);
+    pool_threads = NULL;
+    pool_threads_len = 0;
+    pool_stopping = false;
+    pool_generation = 0;
 }
 
-bool handle_escape_sequence(int event)
+// Threads are started lazily so that short sessions never pay for them.
+void start_pool()
 {
-    #define FULL_SEQUENCE_LEN 4
-
-    static char sequence[FULL_SEQUENCE_LEN];
-    static int sequence_len = 0;
+    pool_threads_len = worker_threads - 1;
+    pool_threads = malloc(pool_threads_len * sizeof(pthread_t));
 
-    static struct timespec start;
-    static struct timespec end;
-
-    // Sequence must start with an escape key. If sequence is unstarted then
-    // the only valid key is the escape key.
-    if (!sequence_len && event != KEY_ESC)
-    {
-        return false;
-    }
-
-    // Start the timer on the first key of the sequence.
-    if (!sequence_len)
-    {
-        clock_gettime(CLOCK_REALTIME, &start);
-    }
-    // Check the timer on subsequent keys of the sequence.
-    else
+    for (int i = 0; i < pool_threads_len; i++)
     {
-        clock_gettime(CLOCK_REALTIME, &end);
-
-        // Reset the sequence and don't consume the keypress if the sequence
-        // has taken too long to complete.
-        if (ms_taken(start, end) > ESCAPE_SEQUENCE_MAX_TIME_MS)
+        if (pthread_create(&pool_threads[i], NULL, pool_worker,
+                           (void*)(intptr_t)i) != 0)
         {
-            sequence_len = 0;
-            return false;
+            pool_threads_len = i;
+            break;
         }
     }
+}
 
-    sequence[sequence_len++] = event;
-
-    // Sequence is not yet complete
-    if (sequence_len != FULL_SEQUENCE_LEN)
+void set_worker_threads(int threads)
+{
+    if (threads < 1)
     {
-        return true;
+        threads = 1;
     }
 
-    // Handle sequence and reset
-    switch (sequence[2])
+    if (pool_threads)
     {
-        case 49:
-            handle_key_home();
-            break;
-
-        case 52:
-            handle_key_end();
-            break;
+        stop_pool();
     }
 
-    sequence_len = 0;
-    return true;
+    worker_threads = threads;
 }
 
-void handle_event(int event)
+// Run task on every worker and wait for all of them to finish.
+void run_in_pool(pool_task task, void* arg)
 {
-    if (command_entering)
+    if (!pool_threads && worker_threads > 1)
     {
-        handle_command_event(event);
-        return;
+        start_pool();
     }
 
-    if (handle_g_chord(event))
-    {
-        return;
-    }
+    pthread_mutex_lock(&pool_lock);
+    pool_current_task = task;
+    pool_current_arg = arg;
+    pool_busy = pool_threads_len;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
 
-    if (handle_escape_sequence(event))
+    task(arg, pool_threads_len);
+
+    pthread_mutex_lock(&pool_lock);
+
+    while (pool_busy > 0)
     {
-        return;
+        pthread_cond_wait(&pool_idle, &pool_lock);
     }
 
-    switch (event)
-    {
-        case 'h':
-        case 'H':
-        case KEY_LEFT:
-            handle_key_left();
-            break;
+    pthread_mutex_unlock(&pool_lock);
+}
 
-        case 'l':
+void stop_match_index();
+void stop_minimap();
+
+// Calculate the milliseconds elapsed between start and end
+unsigned ms_taken(struct timespec start, struct timespec end)
+{
+    return ((end.tv_sec - start.tv_sec) * 1000) +
+           ((end.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+double ms_between(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e3 +
+           (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+double ms_since(struct timespec start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ms_between(start, end);
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Frame statistics (:stats and --trace <file>). Each frame is timed stage by
+// stage; :stats shows the last, average and 99th percentile times over the
+// last STATS_FRAMES frames in the detail pane, and --trace writes every stage
+// as a Chrome trace event (load the file in chrome://tracing or Perfetto).
+// With both off, timing a stage costs a branch.
+#define STAGE_INPUT 0
+#define STAGE_POLL 1
+#define STAGE_CLAMP 2
+#define STAGE_MATCHES 3
+#define STAGE_ROWS 4
+#define STAGE_MINIMAP 5
+#define STAGE_DETAILS 6
+#define STAGE_COMMAND 7
+#define STAGE_FLUSH 8
+#define STAGES_LEN 9
+
+#define STATS_FRAMES 256
+
+// Names in the trace, and shorter ones for the detail pane
+const char* stage_names[STAGES_LEN] =
+{
+    "handle_event", "poll", "clamp_scrolling", "find_visible_matches",
+    "render_rows", "render_minimap", "render_details", "render_command",
+    "flush_output",
+};
+
+const char* stage_labels[STAGES_LEN] =
+{
+    "input", "poll", "clamp", "matches", "rows", "minimap", "details",
+    "command", "flush",
+};
+
+bool stats_shown = false;
+FILE* trace_file = NULL;
+
+// Trace timestamps are microseconds since this
+struct timespec trace_start;
+
+struct timespec stage_started;
+struct timespec frame_started;
+
+// The frame being timed is frames_timed % STATS_FRAMES
+double stage_ms[STATS_FRAMES][STAGES_LEN];
+int64_t output_bytes[STATS_FRAMES];
+int64_t frames_timed = 0;
+
+// The most recent search through search_range_with()
+int64_t search_scanned = 0;
+double search_ms = 0;
+
+int proc_io_fd = -1;
+
+bool timing_frames()
+{
+    return stats_shown || trace_file;
+}
+
+double trace_us(struct timespec time)
+{
+    return ms_between(trace_start, time) * 1e3;
+}
+
+// Start timing a stage
+void start_stage()
+{
+    if (timing_frames())
+    {
+        clock_gettime(CLOCK_MONOTONIC, &stage_started);
+    }
+}
+
+// Add the time since the last stage started (or ended) to a stage of the
+// current frame, and start timing the next one
+void end_stage(int stage)
+{
+    if (!timing_frames())
+    {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double ms = ms_between(stage_started, now);
+    stage_ms[frames_timed % STATS_FRAMES][stage] += ms;
+
+    if (trace_file)
+    {
+        fprintf(trace_file, ",\n{\"name\":\"%s\",\"cat\":\"frame\","
+                "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+                stage_names[stage], trace_us(stage_started), ms * 1e3);
+    }
+
+    stage_started = now;
+}
+
+// Total bytes the process has written, from /proc/self/io. Only the terminal
+// is written to while the screen is flushed, so the difference across
+// flush_output() is what was sent to it.
+int64_t bytes_written_total()
+{
+    if (!timing_frames())
+    {
+        return 0;
+    }
+
+    if (proc_io_fd < 0)
+    {
+        proc_io_fd = open("/proc/self/io", O_RDONLY);
+    }
+
+    char text[512];
+    ssize_t len = pread(proc_io_fd, text, sizeof(text) - 1, 0);
+
+    if (len <= 0)
+    {
+        return 0;
+    }
+
+    text[len] = 0;
+    char* wchar = strstr(text, "wchar: ");
+
+    return wchar ? strtoll(wchar + 7, NULL, 10) : 0;
+}
+
+void start_frame()
+{
+    start_stage();
+    frame_started = stage_started;
+}
+
+// Record the frame just drawn and start on the next one
+void end_frame(int64_t bytes)
+{
+    if (!timing_frames())
+    {
+        return;
+    }
+
+    output_bytes[frames_timed % STATS_FRAMES] = bytes;
+
+    if (trace_file)
+    {
+        fprintf(trace_file, ",\n{\"name\":\"frame\",\"cat\":\"frame\","
+                "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,"
+                "\"args\":{\"output_bytes\":%" PRId64 "}}",
+                trace_us(frame_started), ms_since(frame_started) * 1e3, bytes);
+    }
+
+    frames_timed++;
+    memset(stage_ms[frames_timed % STATS_FRAMES], 0,
+           sizeof(stage_ms[0]));
+}
+
+// Record how long a search took to scan from start to end (or to a match)
+void record_search(int64_t start, int64_t end, bool forward, int64_t match,
+                   struct timespec started)
+{
+    if (!timing_frames())
+    {
+        return;
+    }
+
+    if (match >= 0)
+    {
+        if (forward)
+        {
+            end = match;
+        }
+        else
+        {
+            start = match;
+        }
+    }
+
+    search_scanned = end - start;
+    search_ms = ms_since(started);
+
+    if (trace_file)
+    {
+        fprintf(trace_file, ",\n{\"name\":\"search_range\",\"cat\":\"search\","
+                "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,"
+                "\"args\":{\"bytes\":%" PRId64 "}}",
+                trace_us(started), search_ms * 1e3, search_scanned);
+    }
+}
+
+void show_stats(bool shown)
+{
+    stats_shown = shown;
+    frames_timed = 0;
+    memset(stage_ms, 0, sizeof(stage_ms));
+    clock_gettime(CLOCK_MONOTONIC, &stage_started);
+}
+
+bool open_trace(char* filename)
+{
+    trace_file = fopen(filename, "w");
+
+    if (!trace_file)
+    {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    stage_started = trace_start;
+
+    fprintf(trace_file, "[\n{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":1,\"tid\":1,\"args\":{\"name\":\"hexitor\"}}");
+
+    return true;
+}
+
+void close_trace()
+{
+    if (trace_file)
+    {
+        fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+// Kinds of change to the buffer, as kept in the undo journal and the
+// recovery log
+#define CHANGE_OVERWRITE 0
+#define CHANGE_INSERT 1
+#define CHANGE_DELETE 2
+#define CHANGE_TRANSFORM 3
+
+// Operations on every byte of a range (:xor and so on in visual mode), with
+// a key repeated over the range. Swaps use no key; key_len is the size of
+// the words swapped.
+#define TRANSFORM_FILL 0
+#define TRANSFORM_XOR 1
+#define TRANSFORM_AND 2
+#define TRANSFORM_OR 3
+#define TRANSFORM_ADD 4
+#define TRANSFORM_SWAP 5
+
+#define MAX_TRANSFORM_KEY 32
+
+typedef struct
+{
+    int op;
+    int key_len;
+    unsigned char key[MAX_TRANSFORM_KEY];
+} transform;
+
+// Crash recovery (--recovery). Every change to the buffer is appended to
+// <filename>.recovery as (kind, offset, length) records, followed by the
+// new bytes for overwrites and inserts or the transform. Records are
+// buffered and written out together at most once every RECOVERY_COMMIT_MS,
+// so typing doesn't cost a disk flush per keystroke. Saving to the original
+// file empties the log and quitting deletes it; if hexitor dies instead, the
+// log is replayed the next time the file is opened with --recovery.
+#define RECOVERY_COMMIT_MS 1000
+
+// Changes with more new bytes than this are written straight from the
+// buffer rather than held in memory until the next commit
+#define RECOVERY_STREAM_MIN (1 << 20)
+#define RECOVERY_MAGIC "hexitor recovery 3\n"
+#define RECOVERY_SAMPLE (64 << 10)
+
+// The file a log's changes apply to, as it was when the log was started or
+// last emptied: its length, modification time and a checksum of its first
+// and last RECOVERY_SAMPLE bytes. The log is only replayed onto a file that
+// still matches, never onto another one that happens to be the same size.
+typedef struct
+{
+    int64_t len;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t checksum;
+} recovery_base;
+
+#define RECOVERY_HEADER_LEN (sizeof(RECOVERY_MAGIC) - 1 + sizeof(recovery_base))
+
+char* recovery_filename = NULL;
+int recovery_fd = -1;
+
+// Records not yet written to the log
+unsigned char* recovery_pending = NULL;
+int64_t recovery_pending_len = 0;
+int64_t recovery_pending_cap = 0;
+struct timespec recovery_pending_since;
+
+// Describe filename, whose contents the buffer holds. Returns false if it
+// can't be looked at.
+bool find_recovery_base(const char* filename, recovery_base* base)
+{
+    struct stat st;
+
+    if (stat(filename, &st) != 0)
+    {
+        return false;
+    }
+
+    memset(base, 0, sizeof(recovery_base));
+    base->len = source_len;
+    base->mtime_sec = st.st_mtim.tv_sec;
+    base->mtime_nsec = st.st_mtim.tv_nsec;
+
+    // FNV-1a over the start and the end of the file
+    unsigned char sample[RECOVERY_SAMPLE];
+    int64_t starts[2] = { 0, source_len - RECOVERY_SAMPLE };
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int i = 0; i < 2; i++)
+    {
+        int64_t start = starts[i] > 0 ? starts[i] : 0;
+        int64_t len = source_len - start < RECOVERY_SAMPLE ?
+                      source_len - start : RECOVERY_SAMPLE;
+
+        read_bytes(start, sample, len);
+
+        for (int64_t j = 0; j < len; j++)
+        {
+            hash = (hash ^ sample[j]) * 0x100000001b3ULL;
+        }
+    }
+
+    base->checksum = hash;
+    return true;
+}
+
+// Make room for len more bytes of records, returning where they go
+unsigned char* reserve_recovery(int64_t len)
+{
+    if (recovery_pending_len + len > recovery_pending_cap)
+    {
+        recovery_pending_cap = (recovery_pending_len + len) * 2;
+        recovery_pending = realloc(recovery_pending, recovery_pending_cap);
+    }
+
+    recovery_pending_len += len;
+    return recovery_pending + recovery_pending_len - len;
+}
+
+void append_recovery(const void* data, int64_t len)
+{
+    memcpy(reserve_recovery(len), data, len);
+}
+
+// Start a record in the log, returning false if there's no log
+bool log_record(int64_t kind, int64_t offset, int64_t len)
+{
+    if (recovery_fd < 0)
+    {
+        return false;
+    }
+
+    if (!recovery_pending_len)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &recovery_pending_since);
+    }
+
+    append_recovery(&kind, sizeof(kind));
+    append_recovery(&offset, sizeof(offset));
+    append_recovery(&len, sizeof(len));
+    return true;
+}
+
+// Log a transform that has just been applied to len bytes at offset
+void log_transform(int64_t offset, int64_t len, const transform* t)
+{
+    if (log_record(CHANGE_TRANSFORM, offset, len))
+    {
+        append_recovery(t, sizeof(transform));
+    }
+}
+
+bool write_all(int fd, const unsigned char* data, int64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        data += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+void stop_recovery(const char* error)
+{
+    set_error(error);
+    close(recovery_fd);
+    recovery_fd = -1;
+}
+
+// Write out buffered records as one group
+void commit_recovery_log()
+{
+    if (recovery_fd < 0 || !recovery_pending_len)
+    {
+        return;
+    }
+
+    if (!write_all(recovery_fd, recovery_pending, recovery_pending_len) ||
+        fdatasync(recovery_fd) != 0)
+    {
+        stop_recovery("Error writing recovery log; recovery disabled");
+    }
+
+    recovery_pending_len = 0;
+}
+
+// Write len bytes of the buffer from offset to the log after the records
+// buffered so far, piece by piece. A crash part way leaves a short record,
+// which is dropped when the log is replayed.
+void stream_recovery(int64_t offset, int64_t len)
+{
+    commit_recovery_log();
+
+    for (int64_t done = 0; recovery_fd >= 0 && done < len; )
+    {
+        int64_t available;
+        unsigned char* data = contiguous(offset + done, &available);
+        available = available < len - done ? available : len - done;
+
+        if (!write_all(recovery_fd, data, available))
+        {
+            stop_recovery("Error writing recovery log; recovery disabled");
+        }
+
+        done += available;
+    }
+
+    if (recovery_fd >= 0 && fdatasync(recovery_fd) != 0)
+    {
+        stop_recovery("Error writing recovery log; recovery disabled");
+    }
+}
+
+// Log a change that has just been made to the buffer. Large ones (undoing
+// a fill over a big selection) are streamed rather than copied.
+void log_change(int64_t kind, int64_t offset, int64_t len)
+{
+    if (!log_record(kind, offset, len) || kind == CHANGE_DELETE)
+    {
+        return;
+    }
+
+    if (len > RECOVERY_STREAM_MIN)
+    {
+        stream_recovery(offset, len);
+    }
+    else
+    {
+        read_bytes(offset, reserve_recovery(len), len);
+    }
+}
+
+// Milliseconds until buffered records are due to be committed, or -1 if
+// there are none
+int recovery_commit_wait()
+{
+    if (recovery_fd < 0 || !recovery_pending_len)
+    {
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    unsigned elapsed = ms_taken(recovery_pending_since, now);
+
+    return elapsed >= RECOVERY_COMMIT_MS ? 0 : RECOVERY_COMMIT_MS - elapsed;
+}
+
+// The buffer was saved to the original file: nothing left to recover
+void reset_recovery_log()
+{
+    if (recovery_fd < 0)
+    {
+        return;
+    }
+
+    recovery_pending_len = 0;
+
+    // The file was just rewritten, so the log now applies to it as it is
+    recovery_base base;
+
+    if (!find_recovery_base(original_filename, &base) ||
+        pwrite(recovery_fd, &base, sizeof(base),
+               sizeof(RECOVERY_MAGIC) - 1) != sizeof(base) ||
+        ftruncate(recovery_fd, RECOVERY_HEADER_LEN) != 0 ||
+        lseek(recovery_fd, 0, SEEK_END) < 0)
+    {
+        stop_recovery("Error resetting recovery log; recovery disabled");
+    }
+}
+
+void close_recovery_log()
+{
+    if (recovery_fd < 0)
+    {
+        return;
+    }
+
+    close(recovery_fd);
+    unlink(recovery_filename);
+    recovery_fd = -1;
+}
+
+void quit()
+{
+    stop_match_index();
+    stop_minimap();
+    close_recovery_log();
+    close_trace();
+
+    if (source_mapped)
+    {
+        munmap(file_data, file_data_len);
+    }
+    else
+    {
+        free(file_data);
+    }
+
+    if (!batch_mode)
+    {
+        // Turn bracketed paste back off
+        printf("\033[?2004l");
+        endwin();
+    }
+
+    exit(0);
+}
+
+void report_bytes_written(int64_t bytes)
+{
+    char rendered[MAX_RENDERED_INT];
+    int len = snprintf(rendered, MAX_RENDERED_INT, "%" PRId64, bytes);
+    add_commas(rendered, len);
+
+    char message[MAX_ERROR_LEN];
+    snprintf(message, MAX_ERROR_LEN, "Wrote %s bytes", rendered);
+    set_message(message);
+}
+
+// Save back to the file the buffer was opened from by writing only the
+// dirty pages in place. Returns false if the file can't be patched in place
+// (bytes were inserted or deleted, or it was replaced or resized), in which
+// case the caller rewrites it fully.
+bool write_dirty_pages(const char* filename)
+{
+    struct stat st;
+
+    if (!layout_unchanged() || stat(filename, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_dev != source_dev || st.st_ino != source_ino ||
+        st.st_size != source_len)
+    {
+        return false;
+    }
+
+    int fd = open(filename, O_WRONLY);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    int64_t bytes_written = 0;
+
+    for (int64_t i = 0; i < dirty_pages_len; )
+    {
+        // Coalesce consecutive dirty pages into a single write
+        int64_t run = 1;
+
+        while (i + run < dirty_pages_len &&
+               dirty_pages[i + run] == dirty_pages[i] + run)
+        {
+            run++;
+        }
+
+        int64_t start = dirty_pages[i] * page_size;
+        int64_t len = run * page_size;
+
+        if (start + len > source_len)
+        {
+            len = source_len - start;
+        }
+
+        while (len > 0)
+        {
+            ssize_t written = pwrite(fd, file_data + start, len, start);
+
+            if (written <= 0)
+            {
+                close(fd);
+                set_error("Encountered error while writing file; may be corrupt.");
+                return true;
+            }
+
+            start += written;
+            len -= written;
+            bytes_written += written;
+        }
+
+        i += run;
+    }
+
+    if (fsync_on_write && fdatasync(fd) != 0)
+    {
+        close(fd);
+        set_error("Error flushing file to disk");
+        return true;
+    }
+
+    close(fd);
+
+    dirty_pages_len = 0;
+    report_bytes_written(bytes_written);
+
+    return true;
+}
+
+// Whether filename is the file the buffer was opened from
+bool is_original_file(const char* filename)
+{
+    struct stat st;
+
+    return original_filename && stat(filename, &st) == 0 &&
+           st.st_dev == source_dev && st.st_ino == source_ino;
+}
+
+// Open the file file_data was mapped from, if it's still there unchanged in
+// size, so data that hasn't been edited can be copied from it.
+int open_original()
+{
+    if (!source_mapped)
+    {
+        return -1;
+    }
+
+    int fd = open(original_filename, O_RDONLY);
+    struct stat st;
+
+    if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_dev != source_dev ||
+                    st.st_ino != source_ino || st.st_size != file_data_len))
+    {
+        close(fd);
+        fd = -1;
+    }
+
+    return fd;
+}
+
+bool write_range(int fd, int64_t position, const unsigned char* data,
+                 int64_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = pwrite(fd, data, len, position);
+
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        data += written;
+        position += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+bool all_zero(const unsigned char* data, int64_t len)
+{
+    return !len || (!data[0] && memcmp(data, data + 1, len - 1) == 0);
+}
+
+// Like write_range() into a new file, but leave out whole pages of zeros so
+// the file stays sparse. Returns the bytes actually written, or -1 on
+// errors.
+int64_t write_sparse(int fd, int64_t position, const unsigned char* data,
+                     int64_t len)
+{
+    const unsigned char* run = data;
+    int64_t run_position = position;
+    int64_t written = 0;
+
+    while (len > 0)
+    {
+        // Up to the next page boundary in the file
+        int64_t block = page_size - position % page_size;
+        block = block < len ? block : len;
+
+        if (block == page_size && all_zero(data, block))
+        {
+            if (!write_range(fd, run_position, run, data - run))
+            {
+                return -1;
+            }
+
+            written += data - run;
+            run = data + block;
+            run_position = position + block;
+        }
+
+        data += block;
+        position += block;
+        len -= block;
+    }
+
+    if (!write_range(fd, run_position, run, data - run))
+    {
+        return -1;
+    }
+
+    return written + (data - run);
+}
+
+// Copy an unedited range of file_data from the original file to position
+// in out inside the kernel, using copy_file_range() (which may share blocks
+// or copy server-side) and then sendfile(), and falling back to writing it
+// from memory.
+bool copy_range(int in, int out, int64_t start, int64_t position,
+                int64_t len)
+{
+    while (len > 0)
+    {
+        loff_t in_offset = start;
+        loff_t out_offset = position;
+        ssize_t copied = copy_file_range(in, &in_offset, out, &out_offset,
+                                         len, 0);
+
+        if (copied <= 0)
+        {
+            break;
+        }
+
+        start += copied;
+        position += copied;
+        len -= copied;
+    }
+
+    if (len > 0 && lseek(out, position, SEEK_SET) == position)
+    {
+        off_t in_offset = start;
+
+        while (len > 0)
+        {
+            ssize_t copied = sendfile(out, in, &in_offset, len);
+
+            if (copied <= 0)
+            {
+                break;
+            }
+
+            start += copied;
+            position += copied;
+            len -= copied;
+        }
+    }
+
+    return write_range(out, position, file_data + start, len);
+}
+
+// Copy an unedited range of file_data to position in a new file, from
+// original when it's open, skipping holes. Returns the bytes copied, or -1
+// on errors.
+int64_t copy_unedited(int fd, int original, int64_t start, int64_t position,
+                      int64_t len)
+{
+    int64_t end = start + len;
+    int64_t i = find_hole(start);
+    int64_t written = 0;
+
+    while (start < end)
+    {
+        int64_t data_end = end;
+        int64_t hole_end = end;
+
+        if (i < holes_len && holes[i].start < end)
+        {
+            data_end = holes[i].start > start ? holes[i].start : start;
+            hole_end = holes[i].end < end ? holes[i].end : end;
+            i++;
+        }
+
+        if (data_end > start &&
+            !(original >= 0 ? copy_range(original, fd, start, position,
+                                         data_end - start) :
+                              write_range(fd, position, file_data + start,
+                                          data_end - start)))
+        {
+            return -1;
+        }
+
+        written += data_end - start;
+        position += hole_end - start;
+        start = hole_end;
+    }
+
+    return written;
+}
+
+// Write len bytes of file_data from start to position in fd: dirty pages
+// from memory and the rest copied from original when it's open, leaving
+// holes and pages of zeros unwritten. Unless cloned (fd already holds a copy
+// of the original file and nothing has moved), in which case only dirty
+// pages are written. Returns the bytes actually written, or -1 on errors.
+int64_t write_file_range(int fd, int original, bool cloned, int64_t start,
+                         int64_t position, int64_t len)
+{
+    int64_t end = start + len;
+    int64_t i = find_dirty_page(start / page_size);
+    int64_t written = 0;
+
+    while (start < end)
+    {
+        // The unedited stretch before the next dirty page
+        int64_t dirty = i < dirty_pages_len ? dirty_pages[i] * page_size : end;
+        dirty = dirty < start ? start : dirty < end ? dirty : end;
+
+        if (!cloned && dirty > start)
+        {
+            int64_t copied = copy_unedited(fd, original, start, position,
+                                           dirty - start);
+
+            if (copied < 0)
+            {
+                return -1;
+            }
+
+            written += copied;
+        }
+
+        position += dirty - start;
+        start = dirty;
+
+        if (start == end)
+        {
+            break;
+        }
+
+        // The run of consecutive dirty pages
+        int64_t run_end = (dirty_pages[i++] + 1) * page_size;
+
+        while (i < dirty_pages_len && dirty_pages[i] * page_size == run_end)
+        {
+            run_end += page_size;
+            i++;
+        }
+
+        run_end = run_end < end ? run_end : end;
+
+        int64_t run = run_end - start;
+
+        if (!cloned)
+        {
+            run = write_sparse(fd, position, file_data + start, run);
+        }
+        else if (!write_range(fd, position, file_data + start, run))
+        {
+            run = -1;
+        }
+
+        if (run < 0)
+        {
+            return -1;
+        }
+
+        written += run;
+        position += run_end - start;
+        start = run_end;
+    }
+
+    return written;
+}
+
+// Write the buffer to fd piece by piece. Returns the bytes actually written
+// (not counting holes, or what a clone already holds), or -1 on errors.
+int64_t write_buffer(int fd, int original, bool cloned)
+{
+    int64_t written = 0;
+
+    for (int64_t position = 0; position < source_len; )
+    {
+        int64_t len;
+        unsigned char* data = contiguous(position, &len);
+        int64_t piece = in_file_data(data) ?
+                        write_file_range(fd, original, cloned,
+                                         data - file_data, position, len) :
+                        write_sparse(fd, position, data, len);
+
+        if (piece < 0)
+        {
+            return -1;
+        }
+
+        written += piece;
+        position += len;
+    }
+
+    return ftruncate(fd, source_len) == 0 ? written : -1;
+}
+
+// After bytes were inserted or deleted and the buffer was saved over the
+// file it came from, map the new file so that later saves can again copy
+// unedited data from it. The old mapping is left in place, since pieces
+// kept for undo still point into it.
+void remap_source(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    void* mapping = MAP_FAILED;
+
+    if (fd >= 0 && source_len > 0)
+    {
+        mapping = mmap(NULL, source_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    // Restored pieces may be edited in place like any added bytes
+    if (source_mapped && !source_writable)
+    {
+        mprotect(file_data, file_data_len, PROT_READ | PROT_WRITE);
+    }
+
+    dirty_pages_len = 0;
+
+    if (mapping == MAP_FAILED)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        // Keep the buffer as it is, with nothing to copy from
+        holes_len = 0;
+        file_data = NULL;
+        file_data_len = 0;
+        source_mapped = false;
+        source_writable = true;
+        return;
+    }
+
+    // Background readers may be between chunks
+    pthread_rwlock_wrlock(&pieces_lock);
+    free_pieces(pieces);
+    pieces = new_piece(mapping, source_len);
+    file_data = mapping;
+    file_data_len = source_len;
+    load_holes(fd);
+    pthread_rwlock_unlock(&pieces_lock);
+
+    close(fd);
+
+    source_mapped = true;
+    source_writable = false;
+
+    advise_source(MADV_RANDOM);
+}
+
+// Save the buffer to filename without ever leaving it partly written: the
+// data goes to a temporary file in the same directory, which is flushed and
+// then renamed over the target. Unedited data is cloned from the original
+// file when the filesystem supports reflinks, so saving a few patched bytes
+// of a huge file is nearly instant. Returns false (with an error shown) on
+// failure, in which case the target is untouched.
+bool save_file(const char* filename)
+{
+    bool to_original = is_original_file(filename);
+    int original = open_original();
+
+    // Write through symlinks rather than replacing them
+    char* target = realpath(filename, NULL);
+
+    if (!target)
+    {
+        target = strdup(filename);
+    }
+
+    char* slash = strrchr(target, '/');
+    char directory[PATH_MAX];
+    char temp[PATH_MAX];
+    snprintf(directory, PATH_MAX, "%.*s",
+             slash ? (int)(slash - target + 1) : 1, slash ? target : ".");
+    int temp_len = snprintf(temp, PATH_MAX, "%s%s.%s", directory,
+                            slash ? "" : "/", slash ? slash + 1 : target);
+
+    int fd = -1;
+
+    if (temp_len + 8 < PATH_MAX)
+    {
+        strcat(temp, ".XXXXXX");
+        fd = mkstemp(temp);
+    }
+    bool cloned = false;
+
+#ifdef FICLONE
+    cloned = fd >= 0 && original >= 0 && layout_unchanged() &&
+             ioctl(fd, FICLONE, original) == 0;
+#endif
+
+    // Without reflinks, unedited data is still copied inside the kernel.
+    // Patching the file in place skips even that, if asked for.
+    if (to_original && !cloned && save_in_place &&
+        write_dirty_pages(filename))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temp);
+        }
+
+        if (original >= 0)
+        {
+            close(original);
+        }
+
+        free(target);
+        return error_is_message;
+    }
+
+    if (fd < 0)
+    {
+        if (original >= 0)
+        {
+            close(original);
+        }
+
+        free(target);
+        set_error("Error opening file: path not found or permissions?");
+        return false;
+    }
+
+    int64_t written = write_buffer(fd, original, cloned);
+    bool ok = written >= 0;
+
+    if (original >= 0)
+    {
+        close(original);
+    }
+
+    // Keep the owner and permissions of the file being replaced, in that
+    // order since fchown() clears setuid and setgid bits. New files get the
+    // usual 0666 less the umask (mkstemp() uses 0600).
+    struct stat st;
+    mode_t mask = umask(0);
+    umask(mask);
+
+    if (stat(target, &st) == 0)
+    {
+        fchown(fd, st.st_uid, st.st_gid);
+        fchmod(fd, st.st_mode & 07777);
+    }
+    else
+    {
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    ok = ok && (!fsync_on_write || fsync(fd) == 0) && fstat(fd, &st) == 0;
+    close(fd);
+
+    if (!ok || rename(temp, target) != 0)
+    {
+        unlink(temp);
+        free(target);
+        set_error("Encountered error while writing file; file left unchanged.");
+        return false;
+    }
+
+    // Make the rename itself durable
+    if (fsync_on_write)
+    {
+        int dir = open(directory, O_RDONLY);
+
+        if (dir >= 0)
+        {
+            fsync(dir);
+            close(dir);
+        }
+    }
+
+    free(target);
+
+    if (to_original)
+    {
+        // Edits from here on are relative to the file just written
+        source_dev = st.st_dev;
+        source_ino = st.st_ino;
+        dirty_pages_len = 0;
+
+        if (!layout_unchanged())
+        {
+            remap_source(filename);
+        }
+    }
+
+    report_bytes_written(written);
+    return true;
+}
+
+void handle_write()
+{
+    char* subcommand = command + 2;
+    int remaining = command_len - 2;
+
+    // Check for quit
+    bool also_quit = false;
+    if (remaining > 0 && subcommand[0] == 'q')
+    {
+        also_quit = true;
+        subcommand++;
+        remaining--;
+    }
+
+    // Check for filename in command
+    char* filename = original_filename;
+    if (remaining > 0 && subcommand[0] == ' ')
+    {
+        filename = subcommand + 1;
+    }
+
+    if (!filename)
+    {
+        set_error("No file name to save to; use :w <filename>");
+        return;
+    }
+
+    bool to_original = is_original_file(filename);
+
+    if (!save_file(filename))
+    {
+        return;
+    }
+
+    if (to_original)
+    {
+        reset_recovery_log();
+    }
+
+    if (also_quit)
+    {
+        quit();
+    }
+}
+
+// Parse a decimal or 0x-prefixed hex offset. Returns false if str isn't
+// entirely a valid number or doesn't fit in 64 bits.
+bool parse_offset(const char* str, int64_t* offset)
+{
+    int base = 10;
+
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X'))
+    {
+        base = 16;
+        str += 2;
+    }
+
+    if (!isxdigit((unsigned char)str[0]))
+    {
+        return false;
+    }
+
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, base);
+
+    if (*end || errno == ERANGE || value > INT64_MAX)
+    {
+        return false;
+    }
+
+    *offset = value;
+    return true;
+}
+
+void handle_jump_offset()
+{
+    int64_t offset;
+
+    if (!parse_offset(command + 1, &offset))
+    {
+        set_error("Unknown command");
+        return;
+    }
+
+    // Move cursor to requested offset
+    cursor_byte = offset;
+    cursor_nibble = 0;
+    cursor_jumped = true;
+}
+
+// Byte pattern search. A pattern is a value/mask pair per byte, so
+// wildcards, nibble wildcards, bitmasks and case-insensitive ASCII all use
+// the same kernels. Candidate positions are found by a SIMD prefilter that
+// masks and compares two of the pattern's most selective bytes at once, then
+// verified 8 bytes at a time (memcmp() for exact patterns). When SIMD isn't
+// available, or when the prefilter stops paying for itself (repetitive
+// data), Boyer-Moore-Horspool is used.
+
+typedef struct
+{
+    const unsigned char* needle;
+    const unsigned char* mask;
+    int len;
+
+    // Every mask byte is 0xff
+    bool exact;
+
+    // Every mask byte is 0 (matches anywhere)
+    bool anything;
+
+    // Offsets in the needle of the two bytes the prefilter looks for
+    int rare1;
+    int rare2;
+
+    // Horspool shift tables for forward and backward scans
+    int shift[256];
+    int reverse_shift[256];
+} search_plan;
+
+search_plan current_search;
+
+typedef int64_t (*search_kernel)(const unsigned char* haystack, int64_t len,
+                                 const search_plan* plan);
+
+// Rough likelihood of a byte value appearing in typical binaries: zero
+// padding, 0xff fill, ASCII text and small integers are common.
+int byte_commonness(unsigned char byte)
+{
+    if (byte == 0x00)                   return 255;
+    if (byte == 0xff)                   return 240;
+    if (byte == ' ')                    return 220;
+    if (byte >= 'a' && byte <= 'z')     return 200;
+    if (byte >= '0' && byte <= '9')     return 180;
+    if (byte >= 'A' && byte <= 'Z')     return 170;
+    if (byte >= 0x01 && byte <= 0x0f)   return 160;
+    if (byte >= '!' && byte <= '~')     return 150;
+    if (byte < ' ')                     return 120;
+
+    return 100;
+}
+
+// How poorly pattern position i narrows down candidates: every wildcarded
+// bit doubles the number of matching byte values.
+int anchor_cost(const unsigned char* needle, const unsigned char* mask, int i)
+{
+    return (8 - __builtin_popcount(mask[i])) * 256 + byte_commonness(needle[i]);
+}
+
+void compile_search(search_plan* plan, const unsigned char* needle,
+                    const unsigned char* mask, int len)
+{
+    plan->needle = needle;
+    plan->mask = mask;
+    plan->len = len;
+    plan->exact = true;
+    plan->anything = true;
+    plan->rare1 = 0;
+    plan->rare2 = 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        plan->exact &= mask[i] == 0xff;
+        plan->anything &= mask[i] == 0;
+    }
+
+    for (int i = 1; i < len; i++)
+    {
+        if (anchor_cost(needle, mask, i) <
+            anchor_cost(needle, mask, plan->rare1))
+        {
+            plan->rare1 = i;
+        }
+    }
+
+    plan->rare2 = plan->rare1 == 0 ? len - 1 : 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        if (i != plan->rare1 && anchor_cost(needle, mask, i) <
+                                anchor_cost(needle, mask, plan->rare2))
+        {
+            plan->rare2 = i;
+        }
+    }
+
+    // Horspool shifts: how far the pattern can move when byte c is seen at
+    // the position compared first, i.e. the distance to the nearest other
+    // pattern position that c could match.
+    for (int c = 0; c < 256; c++)
+    {
+        plan->shift[c] = len;
+        plan->reverse_shift[c] = len;
+
+        for (int i = 0; i < len - 1; i++)
+        {
+            if ((c & mask[i]) == needle[i])
+            {
+                plan->shift[c] = len - 1 - i;
+            }
+        }
+
+        for (int i = len - 1; i > 0; i--)
+        {
+            if ((c & mask[i]) == needle[i])
+            {
+                plan->reverse_shift[c] = i;
+            }
+        }
+    }
+}
+
+// Whether the pattern matches the bytes starting at bytes
+bool pattern_matches(const unsigned char* bytes, const search_plan* plan)
+{
+    if (plan->exact)
+    {
+        return memcmp(bytes, plan->needle, plan->len) == 0;
+    }
+
+    int i = 0;
+
+    for (; i + 8 <= plan->len; i += 8)
+    {
+        uint64_t word;
+        uint64_t mask;
+        uint64_t value;
+
+        memcpy(&word, bytes + i, 8);
+        memcpy(&mask, plan->mask + i, 8);
+        memcpy(&value, plan->needle + i, 8);
+
+        if ((word & mask) != value)
+        {
+            return false;
+        }
+    }
+
+    for (; i < plan->len; i++)
+    {
+        if ((bytes[i] & plan->mask[i]) != plan->needle[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int64_t find_forward_horspool(const unsigned char* haystack, int64_t len,
+                              const search_plan* plan)
+{
+    int n = plan->len;
+    unsigned char last = plan->needle[n - 1];
+    unsigned char last_mask = plan->mask[n - 1];
+
+    for (int64_t pos = 0; pos + n <= len; )
+    {
+        unsigned char byte = haystack[pos + n - 1];
+
+        if ((byte & last_mask) == last &&
+            pattern_matches(haystack + pos, plan))
+        {
+            return pos;
+        }
+
+        pos += plan->shift[byte];
+    }
+
+    return -1;
+}
+
+int64_t find_backward_horspool(const unsigned char* haystack, int64_t len,
+                               const search_plan* plan)
+{
+    int n = plan->len;
+    unsigned char first = plan->needle[0];
+    unsigned char first_mask = plan->mask[0];
+
+    for (int64_t pos = len - n; pos >= 0; )
+    {
+        unsigned char byte = haystack[pos];
+
+        if ((byte & first_mask) == first &&
+            pattern_matches(haystack + pos, plan))
+        {
+            return pos;
+        }
+
+        pos -= plan->reverse_shift[byte];
+    }
+
+    return -1;
+}
+
+// Once the prefilter has verified more than one candidate per this many
+// bytes scanned it is doing more harm than good.
+#define PREFILTER_MIN_BYTES_PER_CANDIDATE 8
+#define PREFILTER_GRACE_CANDIDATES 256
+
+#define prefilter_ineffective(candidates, scanned) \
+    ((candidates) > PREFILTER_GRACE_CANDIDATES + \
+                    (scanned) / PREFILTER_MIN_BYTES_PER_CANDIDATE)
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+int64_t find_forward_sse2(const unsigned char* haystack, int64_t len,
+                          const search_plan* plan)
+{
+    int n = plan->len;
+    int64_t last_start = len - n;
+    int64_t candidates = 0;
+    int64_t pos = 0;
+
+    __m128i rare1 = _mm_set1_epi8(plan->needle[plan->rare1]);
+    __m128i rare2 = _mm_set1_epi8(plan->needle[plan->rare2]);
+    __m128i mask1 = _mm_set1_epi8(plan->mask[plan->rare1]);
+    __m128i mask2 = _mm_set1_epi8(plan->mask[plan->rare2]);
+
+    for (; pos + 16 <= last_start + 1; pos += 16)
+    {
+        __m128i a = _mm_and_si128(mask1, _mm_loadu_si128(
+                (const __m128i*)(haystack + pos + plan->rare1)));
+        __m128i b = _mm_and_si128(mask2, _mm_loadu_si128(
+                (const __m128i*)(haystack + pos + plan->rare2)));
+
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(a, rare1), _mm_cmpeq_epi8(b, rare2)));
+
+        while (mask)
+        {
+            int64_t start = pos + __builtin_ctz(mask);
+
+            if (pattern_matches(haystack + start, plan))
+            {
+                return start;
+            }
+
+            candidates++;
+            mask &= mask - 1;
+        }
+
+        if (prefilter_ineffective(candidates, pos))
+        {
+            pos += 16;
+            break;
+        }
+    }
+
+    int64_t found = find_forward_horspool(haystack + pos, len - pos, plan);
+
+    return found < 0 ? -1 : pos + found;
+}
+
+int64_t find_backward_sse2(const unsigned char* haystack, int64_t len,
+                           const search_plan* plan)
+{
+    int n = plan->len;
+    int64_t end = len - n + 1;
+    int64_t candidates = 0;
+
+    __m128i rare1 = _mm_set1_epi8(plan->needle[plan->rare1]);
+    __m128i rare2 = _mm_set1_epi8(plan->needle[plan->rare2]);
+    __m128i mask1 = _mm_set1_epi8(plan->mask[plan->rare1]);
+    __m128i mask2 = _mm_set1_epi8(plan->mask[plan->rare2]);
+
+    for (; end >= 16; end -= 16)
+    {
+        int64_t pos = end - 16;
+
+        __m128i a = _mm_and_si128(mask1, _mm_loadu_si128(
+                (const __m128i*)(haystack + pos + plan->rare1)));
+        __m128i b = _mm_and_si128(mask2, _mm_loadu_si128(
+                (const __m128i*)(haystack + pos + plan->rare2)));
+
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpeq_epi8(a, rare1), _mm_cmpeq_epi8(b, rare2)));
+
+        while (mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+
+            if (pattern_matches(haystack + pos + bit, plan))
+            {
+                return pos + bit;
+            }
+
+            candidates++;
+            mask &= ~(1u << bit);
+        }
+
+        if (prefilter_ineffective(candidates, len - pos))
+        {
+            end -= 16;
+            break;
+        }
+    }
+
+    return find_backward_horspool(haystack, end + n - 1, plan);
+}
+
+__attribute__((target("avx2")))
+int64_t find_forward_avx2(const unsigned char* haystack, int64_t len,
+                          const search_plan* plan)
+{
+    int n = plan->len;
+    int64_t last_start = len - n;
+    int64_t candidates = 0;
+    int64_t pos = 0;
+
+    __m256i rare1 = _mm256_set1_epi8(plan->needle[plan->rare1]);
+    __m256i rare2 = _mm256_set1_epi8(plan->needle[plan->rare2]);
+    __m256i mask1 = _mm256_set1_epi8(plan->mask[plan->rare1]);
+    __m256i mask2 = _mm256_set1_epi8(plan->mask[plan->rare2]);
+
+    for (; pos + 32 <= last_start + 1; pos += 32)
+    {
+        __m256i a = _mm256_and_si256(mask1, _mm256_loadu_si256(
+                (const __m256i*)(haystack + pos + plan->rare1)));
+        __m256i b = _mm256_and_si256(mask2, _mm256_loadu_si256(
+                (const __m256i*)(haystack + pos + plan->rare2)));
+
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(a, rare1), _mm256_cmpeq_epi8(b, rare2)));
+
+        while (mask)
+        {
+            int64_t start = pos + __builtin_ctz(mask);
+
+            if (pattern_matches(haystack + start, plan))
+            {
+                return start;
+            }
+
+            candidates++;
+            mask &= mask - 1;
+        }
+
+        if (prefilter_ineffective(candidates, pos))
+        {
+            pos += 32;
+            break;
+        }
+    }
+
+    int64_t found = find_forward_horspool(haystack + pos, len - pos, plan);
+
+    return found < 0 ? -1 : pos + found;
+}
+
+__attribute__((target("avx2")))
+int64_t find_backward_avx2(const unsigned char* haystack, int64_t len,
+                           const search_plan* plan)
+{
+    int n = plan->len;
+    int64_t end = len - n + 1;
+    int64_t candidates = 0;
+
+    __m256i rare1 = _mm256_set1_epi8(plan->needle[plan->rare1]);
+    __m256i rare2 = _mm256_set1_epi8(plan->needle[plan->rare2]);
+    __m256i mask1 = _mm256_set1_epi8(plan->mask[plan->rare1]);
+    __m256i mask2 = _mm256_set1_epi8(plan->mask[plan->rare2]);
+
+    for (; end >= 32; end -= 32)
+    {
+        int64_t pos = end - 32;
+
+        __m256i a = _mm256_and_si256(mask1, _mm256_loadu_si256(
+                (const __m256i*)(haystack + pos + plan->rare1)));
+        __m256i b = _mm256_and_si256(mask2, _mm256_loadu_si256(
+                (const __m256i*)(haystack + pos + plan->rare2)));
+
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpeq_epi8(a, rare1), _mm256_cmpeq_epi8(b, rare2)));
+
+        while (mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+
+            if (pattern_matches(haystack + pos + bit, plan))
+            {
+                return pos + bit;
+            }
+
+            candidates++;
+            mask &= ~(1u << bit);
+        }
+
+        if (prefilter_ineffective(candidates, len - pos))
+        {
+            end -= 32;
+            break;
+        }
+    }
+
+    return find_backward_horspool(haystack, end + n - 1, plan);
+}
+
+#endif
+
+search_kernel find_forward_kernel = NULL;
+search_kernel find_backward_kernel = NULL;
+
+// Pick the widest kernels the CPU supports
+void select_search_kernels()
+{
+    find_forward_kernel = find_forward_horspool;
+    find_backward_kernel = find_backward_horspool;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        find_forward_kernel = find_forward_avx2;
+        find_backward_kernel = find_backward_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        find_forward_kernel = find_forward_sse2;
+        find_backward_kernel = find_backward_sse2;
+    }
+#endif
+}
+
+// Find the first (or last, if !forward) occurrence of the plan's needle in
+// haystack. Returns its offset or -1.
+int64_t find_in(const unsigned char* haystack, int64_t len,
+                const search_plan* plan, bool forward)
+{
+    if (len < plan->len)
+    {
+        return -1;
+    }
+
+    if (plan->anything)
+    {
+        return forward ? 0 : len - plan->len;
+    }
+
+    // libc's memchr/memrchr are already vectorized for single bytes
+    if (plan->len == 1 && plan->exact)
+    {
+        const unsigned char* found = forward ?
+                memchr(haystack, plan->needle[0], len) :
+                memrchr(haystack, plan->needle[0], len);
+
+        return found ? found - haystack : -1;
+    }
+
+    if (!find_forward_kernel)
+    {
+        select_search_kernels();
+    }
+
+    return forward ? find_forward_kernel(haystack, len, plan) :
+                     find_backward_kernel(haystack, len, plan);
+}
+
+// Like find_in() for the current search, but skipping the stretches of
+// haystack that lie in holes of the mapped file, which are all zeros, unless
+// the search matches zeros. Matches may still start before a hole and run
+// into it, or start in a hole and run out of it.
+int64_t find_outside_holes(const unsigned char* haystack, int64_t len,
+                           bool forward)
+{
+    static const unsigned char zeros[MAX_SEARCH_TERM_LEN];
+    const search_plan* plan = &current_search;
+
+    if (!holes_len || !in_file_data(haystack) ||
+        pattern_matches(zeros, plan))
+    {
+        return find_in(haystack, len, plan, forward);
+    }
+
+    int64_t base = haystack - file_data;
+    int64_t from = 0;
+    int64_t to = len;
+    int64_t hole_start;
+    int64_t hole_end;
+
+    while (to - from >= plan->len)
+    {
+        bool hole = nearest_hole(base + from, base + to, plan->len, forward,
+                                 &hole_start, &hole_end);
+        int64_t found;
+
+        if (!hole)
+        {
+            found = find_in(haystack + from, to - from, plan, forward);
+            return found < 0 ? -1 : from + found;
+        }
+
+        hole_start -= base;
+        hole_end -= base;
+
+        if (forward)
+        {
+            // Up to the last match that could start before the hole
+            found = find_in(haystack + from, hole_start + plan->len - 1 - from,
+                            plan, true);
+
+            if (found >= 0)
+            {
+                return from + found;
+            }
+
+            from = hole_end - plan->len + 1;
+        }
+        else
+        {
+            int64_t after = hole_end - plan->len + 1;
+            found = find_in(haystack + after, to - after, plan, false);
+
+            if (found >= 0)
+            {
+                return after + found;
+            }
+
+            to = hole_start + plan->len - 1;
+        }
+    }
+
+    return -1;
+}
+
+// Find a match of the current search crossing the piece boundary at
+// boundary, within [start, end), by searching a copy of the bytes around it
+int64_t search_seam(int64_t boundary, int64_t start, int64_t end,
+                    bool forward)
+{
+    unsigned char seam[2 * MAX_SEARCH_TERM_LEN];
+    int64_t from = boundary - current_search.len + 1;
+    int64_t to = boundary + current_search.len - 1;
+
+    from = from > start ? from : start;
+    to = to < end ? to : end;
+
+    read_bytes(from, seam, to - from);
+
+    int64_t found = find_in(seam, to - from, &current_search, forward);
+
+    return found < 0 ? -1 : from + found;
+}
+
+// Search [start, end) one piece at a time, checking each boundary between
+// pieces for matches that straddle it. Returns the first match or -1.
+int64_t search_pieces_forward(int64_t start, int64_t end)
+{
+    for (int64_t position = start; position < end; )
+    {
+        int64_t len;
+        unsigned char* data = contiguous(position, &len);
+        len = len < end - position ? len : end - position;
+
+        int64_t found = find_outside_holes(data, len, true);
+
+        if (found >= 0)
+        {
+            return position + found;
+        }
+
+        position += len;
+
+        if (position < end && current_search.len > 1 &&
+            (found = search_seam(position, start, end, true)) >= 0)
+        {
+            return found;
+        }
+    }
+
+    return -1;
+}
+
+// Like search_pieces_forward(), but from the end. Returns the last match.
+int64_t search_pieces_backward(int64_t start, int64_t end)
+{
+    for (int64_t position = end; position > start; )
+    {
+        int64_t len;
+        unsigned char* data = contiguous_before(position, &len);
+
+        if (len > position - start)
+        {
+            data += len - (position - start);
+            len = position - start;
+        }
+
+        int64_t found = find_outside_holes(data, len, false);
+
+        if (found >= 0)
+        {
+            return position - len + found;
+        }
+
+        position -= len;
+
+        if (position > start && current_search.len > 1 &&
+            (found = search_seam(position, start, end, false)) >= 0)
+        {
+            return found;
+        }
+    }
+
+    return -1;
+}
+
+// Find the nearest match of the current search whose starting offset is in
+// [start, end), scanning in the given direction on the calling thread.
+// Returns -1 if none.
+int64_t search_range_serial(int64_t start, int64_t end, bool forward)
+{
+    int64_t haystack_end = end - 1 + current_search.len;
+
+    if (haystack_end > source_len)
+    {
+        haystack_end = source_len;
+    }
+
+    if (start < 0 || start >= haystack_end)
+    {
+        return -1;
+    }
+
+    return forward ? search_pieces_forward(start, haystack_end) :
+                     search_pieces_backward(start, haystack_end);
+}
+
+// Ranges are split into chunks of this many starting offsets per worker
+#define SEARCH_CHUNK_SIZE (1 << 20)
+
+// Below this size a search isn't worth waking the worker pool for
+#define PARALLEL_SEARCH_MIN (8 << 20)
+
+// Finds the first (or last) offset in [start, end) where something starts
+typedef int64_t (*range_search)(int64_t start, int64_t end, bool forward);
+
+typedef struct
+{
+    range_search serial;
+    int64_t start;
+    int64_t end;
+    bool forward;
+
+    int64_t chunks;
+    atomic_int_fast64_t next_chunk;
+
+    // Nearest match found so far: lowest offset when searching forward,
+    // highest when searching backward, or -1 / INT64_MAX if none yet.
+    atomic_int_fast64_t best;
+} parallel_search;
+
+void parallel_search_task(void* arg, int worker)
+{
+    (void)worker;
+    parallel_search* search = arg;
+
+    while (true)
+    {
+        // Workers take chunks nearest-first, so once a chunk lies beyond the
+        // best match so far, every chunk after it does too.
+        int64_t chunk = atomic_fetch_add(&search->next_chunk, 1);
+
+        if (chunk >= search->chunks)
+        {
+            break;
+        }
+
+        int64_t chunk_start;
+        int64_t chunk_end;
+        int64_t best = atomic_load(&search->best);
+
+        if (search->forward)
+        {
+            chunk_start = search->start + chunk * SEARCH_CHUNK_SIZE;
+            chunk_end = chunk_start + SEARCH_CHUNK_SIZE;
+
+            if (chunk_end > search->end)
+            {
+                chunk_end = search->end;
+            }
+
+            if (chunk_start > best)
+            {
+                break;
+            }
+        }
+        else
+        {
+            chunk_end = search->end - chunk * SEARCH_CHUNK_SIZE;
+            chunk_start = chunk_end - SEARCH_CHUNK_SIZE;
+
+            if (chunk_start < search->start)
+            {
+                chunk_start = search->start;
+            }
+
+            if (chunk_end <= best)
+            {
+                break;
+            }
+        }
+
+        int64_t match = search->serial(chunk_start, chunk_end,
+                                       search->forward);
+
+        if (match < 0)
+        {
+            continue;
+        }
+
+        // Keep the nearer of this match and whatever another worker found
+        while (search->forward ? match < best : match > best)
+        {
+            if (atomic_compare_exchange_weak(&search->best, &best, match))
+            {
+                break;
+            }
+        }
+    }
+}
+
+// Run a serial range search, splitting large ranges into chunks for the
+// worker pool
+int64_t search_range_with(range_search serial, int64_t start, int64_t end,
+                          bool forward)
+{
+    struct timespec started;
+
+    if (timing_frames())
+    {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+
+    if (worker_threads < 2 || end - start < PARALLEL_SEARCH_MIN)
+    {
+        int64_t match = serial(start, end, forward);
+        record_search(start, end, forward, match, started);
+        return match;
+    }
+
+    parallel_search search;
+    search.serial = serial;
+    search.start = start;
+    search.end = end;
+    search.forward = forward;
+    search.chunks = (end - start + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    atomic_init(&search.next_chunk, 0);
+    atomic_init(&search.best, forward ? INT64_MAX : -1);
+
+    run_in_pool(parallel_search_task, &search);
+
+    int64_t best = atomic_load(&search.best);
+    int64_t match = best == INT64_MAX ? -1 : best;
+
+    record_search(start, end, forward, match, started);
+    return match;
+}
+
+// Like search_range_serial(), but large ranges are scanned by the worker
+// pool. Adjacent chunks overlap by the term length minus one so matches
+// spanning a chunk boundary are still found.
+int64_t search_range(int64_t start, int64_t end, bool forward)
+{
+    return search_range_with(search_range_serial, start, end, forward);
+}
+
+// Sorted offsets of every occurrence of the search term, built by a
+// background thread after each new search. Once ready, n / N are binary
+// searches and the detail pane can show "match k of N".
+#define MAX_INDEXED_MATCHES (1 << 24)
+
+typedef struct
+{
+    int64_t* offsets;
+    int64_t len;
+    int64_t cap;
+} match_list;
+
+// Owned by the UI thread. Only valid when match_index_ready.
+match_list match_index;
+bool match_index_ready = false;
+bool match_index_overflow = false;
+
+// State shared with the background builder
+pthread_t match_index_thread;
+bool match_index_building = false;
+bool match_index_paused = false;
+match_list match_index_pending;
+bool match_index_pending_overflow;
+atomic_bool match_index_cancel;
+atomic_bool match_index_done;
+atomic_int_fast64_t match_index_scanned;
+
+// The builder indexes matches starting before this. Anything appended to
+// the buffer past it meanwhile is scanned once the index is adopted.
+// match_index_pending holds every match starting before
+// match_index_scanned.
+int64_t match_index_end;
+
+void free_match_list(match_list* list)
+{
+    free(list->offsets);
+    list->offsets = NULL;
+    list->len = 0;
+    list->cap = 0;
+}
+
+// Insert count offsets at position at. Returns false if the list would grow
+// past MAX_INDEXED_MATCHES.
+bool insert_matches(match_list* list, int64_t at, const int64_t* offsets,
+                    int64_t count)
+{
+    if (list->len + count > MAX_INDEXED_MATCHES)
+    {
+        return false;
+    }
+
+    if (list->len + count > list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+
+        if (list->cap < list->len + count)
+        {
+            list->cap = list->len + count;
+        }
+
+        list->offsets = realloc(list->offsets, list->cap * sizeof(int64_t));
+    }
+
+    memmove(&list->offsets[at + count], &list->offsets[at],
+            (list->len - at) * sizeof(int64_t));
+    memcpy(&list->offsets[at], offsets, count * sizeof(int64_t));
+    list->len += count;
+
+    return true;
+}
+
+// Position of the first offset in the list that is >= offset
+int64_t lower_bound(const match_list* list, int64_t offset)
+{
+    int64_t low = 0;
+    int64_t high = list->len;
+
+    while (low < high)
+    {
+        int64_t mid = low + (high - low) / 2;
+
+        if (list->offsets[mid] < offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+// Append every match starting in [start, end) to list, storing how far it
+// got in scanned after each chunk. Returns false if the list overflowed or
+// the scan was cancelled.
+bool collect_matches(match_list* list, int64_t start, int64_t end,
+                     atomic_bool* cancel, atomic_int_fast64_t* scanned)
+{
+    for (int64_t chunk = start; chunk < end; chunk += SEARCH_CHUNK_SIZE)
+    {
+        if (cancel && atomic_load(cancel))
+        {
+            return false;
+        }
+
+        int64_t chunk_end = chunk + SEARCH_CHUNK_SIZE;
+
+        if (chunk_end > end)
+        {
+            chunk_end = end;
+        }
+
+        int64_t match = chunk;
+        bool ok = true;
+
+        pthread_rwlock_rdlock(&pieces_lock);
+
+        while (ok && (match = search_range_serial(match, chunk_end,
+                                                  true)) >= 0)
+        {
+            ok = insert_matches(list, list->len, &match, 1);
+            match++;
+        }
+
+        pthread_rwlock_unlock(&pieces_lock);
+
+        if (!ok)
+        {
+            return false;
+        }
+
+        if (scanned)
+        {
+            atomic_store(scanned, chunk_end);
+        }
+    }
+
+    return true;
+}
+
+void* build_match_index(void* arg)
+{
+    (void)arg;
+
+    // Carries on from where a paused build left off
+    if (!match_index_pending_overflow &&
+        !collect_matches(&match_index_pending,
+                         atomic_load(&match_index_scanned), match_index_end,
+                         &match_index_cancel, &match_index_scanned))
+    {
+        match_index_pending_overflow = !atomic_load(&match_index_cancel);
+    }
+
+    atomic_store(&match_index_done, true);
+    return NULL;
+}
+
+void stop_match_index()
+{
+    if (!match_index_building)
+    {
+        return;
+    }
+
+    if (!match_index_paused)
+    {
+        atomic_store(&match_index_cancel, true);
+        pthread_join(match_index_thread, NULL);
+    }
+
+    free_match_list(&match_index_pending);
+    match_index_building = false;
+    match_index_paused = false;
+}
+
+// Stop the builder at the end of its current chunk, keeping what it has
+// indexed so far.
+void pause_match_index()
+{
+    if (!match_index_building || match_index_paused)
+    {
+        return;
+    }
+
+    atomic_store(&match_index_cancel, true);
+    pthread_join(match_index_thread, NULL);
+    match_index_paused = true;
+
+    // Drop anything from a chunk it didn't finish
+    match_index_pending.len =
+        lower_bound(&match_index_pending, atomic_load(&match_index_scanned));
+}
+
+void resume_match_index()
+{
+    if (!match_index_paused)
+    {
+        return;
+    }
+
+    match_index_paused = false;
+    atomic_store(&match_index_cancel, false);
+    atomic_store(&match_index_done, false);
+
+    if (pthread_create(&match_index_thread, NULL, build_match_index,
+                       NULL) != 0)
+    {
+        free_match_list(&match_index_pending);
+        match_index_building = false;
+    }
+}
+
+// Throw away the current index and start building one for the current
+// search term.
+void start_match_index()
+{
+    stop_match_index();
+
+    free_match_list(&match_index);
+    match_index_ready = false;
+    match_index_overflow = false;
+
+    // Nothing shows the match count in batch mode
+    if (!search_term_len || batch_mode)
+    {
+        return;
+    }
+
+    match_index_pending_overflow = false;
+    atomic_store(&match_index_cancel, false);
+    atomic_store(&match_index_done, false);
+    atomic_store(&match_index_scanned, 0);
+    match_index_end = source_len;
+
+    if (pthread_create(&match_index_thread, NULL, build_match_index,
+                       NULL) == 0)
+    {
+        match_index_building = true;
+    }
+}
+
+// repair_match_index() for a paused build: the part already scanned is
+// repaired the same way, and the rest is left to the builder.
+void repair_pending_index(int64_t start, int64_t offset, int64_t removed,
+                          int64_t inserted)
+{
+    int64_t scanned = atomic_load(&match_index_scanned);
+
+    if (offset < match_index_end)
+    {
+        // An edit running past the end is scanned by the builder as a whole
+        match_index_end = offset + removed <= match_index_end ?
+            match_index_end + inserted - removed : offset + inserted;
+    }
+
+    if (start >= scanned || match_index_pending_overflow)
+    {
+        return;
+    }
+
+    match_list* list = &match_index_pending;
+    int64_t low = lower_bound(list, start);
+    int64_t high = lower_bound(list, offset + removed);
+
+    memmove(&list->offsets[low], &list->offsets[high],
+            (list->len - high) * sizeof(int64_t));
+    list->len -= high - low;
+
+    // The edit reaches into what's still to be scanned, so the builder picks
+    // up from before it
+    if (scanned <= offset + removed)
+    {
+        atomic_store(&match_index_scanned, start);
+        return;
+    }
+
+    for (int64_t i = low; inserted != removed && i < list->len; i++)
+    {
+        list->offsets[i] += inserted - removed;
+    }
+
+    atomic_store(&match_index_scanned, scanned + inserted - removed);
+
+    match_list found = {0};
+
+    if (!collect_matches(&found, start, offset + inserted, NULL, NULL) ||
+        !insert_matches(list, low, found.offsets, found.len))
+    {
+        match_index_pending_overflow = true;
+    }
+
+    free_match_list(&found);
+}
+
+void repair_match_index(int64_t offset, int64_t removed, int64_t inserted);
+
+// Adopt the index if the builder has finished. Returns true if it has.
+bool poll_match_index()
+{
+    if (!match_index_building || match_index_paused ||
+        !atomic_load(&match_index_done))
+    {
+        return false;
+    }
+
+    pthread_join(match_index_thread, NULL);
+    match_index_building = false;
+
+    if (match_index_pending_overflow)
+    {
+        free_match_list(&match_index_pending);
+        match_index_overflow = true;
+        return true;
+    }
+
+    match_index = match_index_pending;
+    match_index_pending.offsets = NULL;
+    match_index_pending.len = 0;
+    match_index_pending.cap = 0;
+    match_index_ready = true;
+
+    if (match_index_end < source_len)
+    {
+        repair_match_index(match_index_end, 0, source_len - match_index_end);
+    }
+
+    return true;
+}
+
+// Bring the index up to date after removed bytes at offset were replaced by
+// inserted new ones (the same number for an overwrite): matches after them
+// move and only the starting offsets a match there could overlap are
+// rescanned.
+void repair_match_index(int64_t offset, int64_t removed, int64_t inserted)
+{
+    // Bytes appended past what the builder scans are handled once it's done
+    if (match_index_building && !removed && offset >= match_index_end)
+    {
+        return;
+    }
+
+    int64_t start = offset - search_term_len + 1;
+
+    if (start < 0)
+    {
+        start = 0;
+    }
+
+    if (match_index_building)
+    {
+        bool running = !match_index_paused;
+        pause_match_index();
+        repair_pending_index(start, offset, removed, inserted);
+
+        if (running)
+        {
+            resume_match_index();
+        }
+
+        return;
+    }
+
+    if (!match_index_ready)
+    {
+        return;
+    }
+
+    int64_t low = lower_bound(&match_index, start);
+    int64_t high = lower_bound(&match_index, offset + removed);
+
+    memmove(&match_index.offsets[low], &match_index.offsets[high],
+            (match_index.len - high) * sizeof(int64_t));
+    match_index.len -= high - low;
+
+    for (int64_t i = low; inserted != removed && i < match_index.len; i++)
+    {
+        match_index.offsets[i] += inserted - removed;
+    }
+
+    match_list found = {0};
+
+    if (!collect_matches(&found, start, offset + inserted, NULL, NULL) ||
+        !insert_matches(&match_index, low, found.offsets, found.len))
+    {
+        free_match_list(&match_index);
+        match_index_ready = false;
+        match_index_overflow = true;
+    }
+
+    free_match_list(&found);
+}
+
+bool is_hex_digit(char c)
+{
+    return (c >= '0' && c <= '9') ||
+           (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+// Parse a hex digit, or ? for a wildcard nibble, into a value and mask
+bool parse_pattern_nibble(char c, unsigned char* value, unsigned char* mask)
+{
+    if (c == '?')
+    {
+        *value = 0;
+        *mask = 0;
+        return true;
+    }
+
+    if (!is_hex_digit(c))
+    {
+        return false;
+    }
+
+    *value = hex_to_nibble(tolower(c));
+    *mask = 0x0f;
+    return true;
+}
+
+bool add_pattern_byte(unsigned char value, unsigned char mask)
+{
+    if (search_term_len >= MAX_SEARCH_TERM_LEN)
+    {
+        search_term_len = 0;
+        set_error("Search term storage overflow");
+        return false;
+    }
+
+    search_term[search_term_len] = value & mask;
+    search_mask[search_term_len] = mask;
+    search_term_len++;
+
+    return true;
+}
+
+// Parse a quoted ASCII string starting at the opening quote, adding its
+// bytes to the pattern. A trailing i makes letters match either case.
+// Returns the index just past the string, or -1 on error.
+int parse_quoted_pattern(char* text, int len, int cur)
+{
+    int start = ++cur;
+
+    while (cur < len && text[cur] != '"')
+    {
+        cur += text[cur] == '\\' ? 2 : 1;
+    }
+
+    if (cur >= len)
+    {
+        set_error("Unterminated string in search term");
+        return -1;
+    }
+
+    int end = cur++;
+    bool ignore_case = cur < len && text[cur] == 'i';
+
+    if (ignore_case)
+    {
+        cur++;
+    }
+
+    for (int i = start; i < end; i++)
+    {
+        unsigned char c = text[i] == '\\' ? text[++i] : text[i];
+        unsigned char mask = 0xff;
+
+        // Upper and lower case letters differ only in bit 0x20
+        if (ignore_case && isalpha(c))
+        {
+            mask = 0xdf;
+        }
+
+        if (!add_pattern_byte(c, mask))
+        {
+            return -1;
+        }
+    }
+
+    return cur;
+}
+
+// Parse a search pattern. Bytes are written as hex pairs, where either digit
+// may be ? for a wildcard nibble (4?, ??), optionally followed by &xx to only
+// compare the bits set in xx (ff&f0). "text" matches ASCII, and "text"i
+// matches it case-insensitively.
+void set_search_term(char* text, int len)
+{
+    int cur = 0;
+    search_term_len = 0;
+
+    while (true)
+    {
+        // Skip any whitespace
+        while (cur < len && isspace(text[cur]))
+        {
+            cur++;
+        }
+
+        if (cur >= len)
+        {
+            break;
+        }
+
+        if (text[cur] == '"')
+        {
+            if ((cur = parse_quoted_pattern(text, len, cur)) < 0)
+            {
+                search_term_len = 0;
+                return;
+            }
+
+            continue;
+        }
+
+        unsigned char first, first_mask;
+        unsigned char second, second_mask;
+
+        if (cur + 1 >= len ||
+            !parse_pattern_nibble(text[cur], &first, &first_mask) ||
+            !parse_pattern_nibble(text[cur + 1], &second, &second_mask))
+        {
+            search_term_len = 0;
+            set_error("Invalid search term format");
+            return;
+        }
+
+        cur += 2;
+
+        unsigned char value = nibbles_to_byte(first, second);
+        unsigned char mask = nibbles_to_byte(first_mask, second_mask);
+
+        // Explicit bitmask
+        if (cur < len && text[cur] == '&')
+        {
+            if (cur + 2 >= len || !is_hex_digit(text[cur + 1]) ||
+                !is_hex_digit(text[cur + 2]))
+            {
+                search_term_len = 0;
+                set_error("Invalid search term mask");
+                return;
+            }
+
+            mask &= nibbles_to_byte(hex_to_nibble(tolower(text[cur + 1])),
+                                    hex_to_nibble(tolower(text[cur + 2])));
+            cur += 3;
+        }
+
+        if (!add_pattern_byte(value, mask))
+        {
+            return;
+        }
+    }
+
+    compile_search(&current_search, search_term, search_mask,
+                   search_term_len);
+}
+
+// Signature scanning (:sigscan <file>). The rules file has one signature per
+// line in the form "name = 7f 45 4c 46" (blank lines and lines starting with
+// # are ignored). All signatures are compiled into a single Aho-Corasick
+// automaton, so the buffer is scanned once no matter how many there are.
+
+#define MAX_SIGNATURE_NAME_LEN 64
+#define MAX_SIGNATURE_STATES (1 << 16)
+#define MAX_SIGNATURE_HITS (1 << 22)
+
+typedef struct
+{
+    char name[MAX_SIGNATURE_NAME_LEN];
+    int len;
+} signature;
+
+typedef struct
+{
+    int64_t offset;
+    int signature;
+} signature_hit;
+
+signature* signatures = NULL;
+int signatures_len = 0;
+int longest_signature = 0;
+
+// The automaton as a full DFA: transitions[state * 256 + byte]. Each state
+// records the signature ending there (or -1) and the next state along its
+// failure chain that also ends a signature (or -1). Once built, transitions
+// hold the target's row offset (state * 256), with the low bit set if any
+// signature ends at the target, so the scan loop needs only one load per
+// byte.
+int* transitions = NULL;
+int* state_signature = NULL;
+int* state_next_output = NULL;
+int states_len = 0;
+int states_cap = 0;
+
+signature_hit* signature_hits = NULL;
+int64_t signature_hits_len = 0;
+int64_t signature_hits_cap = 0;
+
+// What n / N step through: the last / search, the last :sigscan or the last
+// /re: regular expression
+#define SEARCH_PATTERN 0
+#define SEARCH_SIGNATURES 1
+#define SEARCH_REGEX 2
+
+int search_mode = SEARCH_PATTERN;
+
+void free_signatures()
+{
+    free(signatures);
+    free(transitions);
+    free(state_signature);
+    free(state_next_output);
+
+    signatures = NULL;
+    transitions = NULL;
+    state_signature = NULL;
+    state_next_output = NULL;
+    signatures_len = 0;
+    states_len = 0;
+    states_cap = 0;
+    longest_signature = 0;
+}
+
+// The loaded signatures and their automaton, set aside while another rules
+// file is loaded so a bad file leaves them (and their hits) in place
+typedef struct
+{
+    signature* signatures;
+    int signatures_len;
+    int longest_signature;
+    int* transitions;
+    int* state_signature;
+    int* state_next_output;
+    int states_len;
+    int states_cap;
+} signature_set;
+
+// Move the loaded signatures out, leaving none loaded
+signature_set take_signatures()
+{
+    signature_set set;
+    set.signatures = signatures;
+    set.signatures_len = signatures_len;
+    set.longest_signature = longest_signature;
+    set.transitions = transitions;
+    set.state_signature = state_signature;
+    set.state_next_output = state_next_output;
+    set.states_len = states_len;
+    set.states_cap = states_cap;
+
+    signatures = NULL;
+    transitions = NULL;
+    state_signature = NULL;
+    state_next_output = NULL;
+    free_signatures();
+
+    return set;
+}
+
+// Replace the loaded signatures with ones set aside
+void restore_signatures(signature_set set)
+{
+    free_signatures();
+
+    signatures = set.signatures;
+    signatures_len = set.signatures_len;
+    longest_signature = set.longest_signature;
+    transitions = set.transitions;
+    state_signature = set.state_signature;
+    state_next_output = set.state_next_output;
+    states_len = set.states_len;
+    states_cap = set.states_cap;
+}
+
+void free_signature_set(signature_set set)
+{
+    free(set.signatures);
+    free(set.transitions);
+    free(set.state_signature);
+    free(set.state_next_output);
+}
+
+int add_state()
+{
+    if (states_len == states_cap)
+    {
+        states_cap = states_cap ? states_cap * 2 : 256;
+        transitions = realloc(transitions, states_cap * 256 * sizeof(int));
+        state_signature = realloc(state_signature, states_cap * sizeof(int));
+        state_next_output = realloc(state_next_output,
+                                    states_cap * sizeof(int));
+    }
+
+    int state = states_len++;
+
+    for (int i = 0; i < 256; i++)
+    {
+        transitions[state * 256 + i] = -1;
+    }
+
+    state_signature[state] = -1;
+    state_next_output[state] = -1;
+
+    return state;
+}
+
+// Add a signature to the trie. Returns false if the automaton is full.
+bool add_signature(const char* name, const unsigned char* bytes, int len)
+{
+    int state = 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        int* next = &transitions[state * 256 + bytes[i]];
+
+        if (*next < 0)
+        {
+            if (states_len >= MAX_SIGNATURE_STATES)
+            {
+                return false;
+            }
+
+            int added = add_state();
+
+            // add_state() may have moved the table
+            next = &transitions[state * 256 + bytes[i]];
+            *next = added;
+        }
+
+        state = *next;
+    }
+
+    signatures = realloc(signatures, (signatures_len + 1) * sizeof(signature));
+    strncpy(signatures[signatures_len].name, name, MAX_SIGNATURE_NAME_LEN - 1);
+    signatures[signatures_len].name[MAX_SIGNATURE_NAME_LEN - 1] = 0;
+    signatures[signatures_len].len = len;
+
+    // Identical signatures share a state; the first one wins
+    if (state_signature[state] < 0)
+    {
+        state_signature[state] = signatures_len;
+    }
+
+    if (len > longest_signature)
+    {
+        longest_signature = len;
+    }
+
+    signatures_len++;
+    return true;
+}
+
+// Turn the trie into a DFA: compute failure links breadth-first and fill in
+// every missing transition from the failure state's.
+void build_automaton()
+{
+    int* failure = malloc(states_len * sizeof(int));
+    int* queue = malloc(states_len * sizeof(int));
+    int head = 0;
+    int tail = 0;
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        int* next = &transitions[byte];
+
+        if (*next < 0)
+        {
+            *next = 0;
+        }
+        else
+        {
+            failure[*next] = 0;
+            queue[tail++] = *next;
+        }
+    }
+
+    while (head < tail)
+    {
+        int state = queue[head++];
+        int fail = failure[state];
+
+        state_next_output[state] = state_signature[fail] >= 0 ?
+                                   fail : state_next_output[fail];
+
+        for (int byte = 0; byte < 256; byte++)
+        {
+            int* next = &transitions[state * 256 + byte];
+
+            if (*next < 0)
+            {
+                *next = transitions[fail * 256 + byte];
+            }
+            else
+            {
+                failure[*next] = transitions[fail * 256 + byte];
+                queue[tail++] = *next;
+            }
+        }
+    }
+
+    // Encode transitions as row offsets plus an output flag
+    for (int i = 0; i < states_len * 256; i++)
+    {
+        int target = transitions[i];
+        bool output = state_signature[target] >= 0 ||
+                      state_next_output[target] >= 0;
+
+        transitions[i] = target * 256 | output;
+    }
+
+    free(failure);
+    free(queue);
+}
+
+// Parse a hex byte string like "7f 45 4c 46" into bytes. Returns the number
+// of bytes or -1 if it's malformed.
+int parse_hex_bytes(const char* text, unsigned char* bytes, int max)
+{
+    int len = 0;
+
+    while (*text)
+    {
+        if (isspace(*text))
+        {
+            text++;
+            continue;
+        }
+
+        if (!is_hex_digit(text[0]) || !is_hex_digit(text[1]) || len >= max)
+        {
+            return -1;
+        }
+
+        bytes[len++] = nibbles_to_byte(hex_to_nibble(tolower(text[0])),
+                                       hex_to_nibble(tolower(text[1])));
+        text += 2;
+    }
+
+    return len;
+}
+
+bool load_signatures(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+
+    if (!file)
+    {
+        set_error("Error opening signature file");
+        return false;
+    }
+
+    signature_set previous = take_signatures();
+    add_state();
+
+    char line[MAX_COMMAND_LEN * 4];
+    unsigned char bytes[MAX_COMMAND_LEN * 2];
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        char* name = line;
+
+        while (isspace(*name))
+        {
+            name++;
+        }
+
+        if (!*name || *name == '#')
+        {
+            continue;
+        }
+
+        char* separator = strchr(name, '=');
+
+        if (!separator)
+        {
+            set_error("Signature lines must look like: name = 7f 45");
+            ok = false;
+            break;
+        }
+
+        // Trim the name
+        char* name_end = separator;
+
+        while (name_end > name && isspace(name_end[-1]))
+        {
+            name_end--;
+        }
+
+        *name_end = 0;
+
+        int len = parse_hex_bytes(separator + 1, bytes, sizeof(bytes));
+
+        if (len <= 0)
+        {
+            set_error("Invalid hex bytes in signature file");
+            ok = false;
+        }
+        else if (!add_signature(name, bytes, len))
+        {
+            set_error("Too many signatures");
+            ok = false;
+        }
+    }
+
+    fclose(file);
+
+    if (ok && !signatures_len)
+    {
+        set_error("No signatures in file");
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        restore_signatures(previous);
+        return false;
+    }
+
+    free_signature_set(previous);
+    build_automaton();
+    return true;
+}
+
+typedef struct
+{
+    int64_t start;
+    int64_t end;
+    int64_t chunks;
+    atomic_int_fast64_t next_chunk;
+    atomic_int_fast64_t total_hits;
+
+    // One hit list per worker, merged afterwards
+    signature_hit** hits;
+    int64_t* hits_len;
+    int64_t* hits_cap;
+} signature_scan;
+
+// Run the automaton over the buffer, recording hits that start in
+// [start, end). Scanning begins longest_signature - 1 bytes early so that
+// matches starting right at start are seen.
+void scan_signatures(signature_scan* scan, int worker, int64_t start,
+                     int64_t end)
+{
+    int64_t from = start - longest_signature + 1;
+    int64_t to = end + longest_signature - 1;
+
+    if (from < 0)
+    {
+        from = 0;
+    }
+
+    if (to > source_len)
+    {
+        to = source_len;
+    }
+
+    int row = 0;
+    int64_t len = 0;
+    unsigned char* data = NULL;
+
+    for (int64_t i = from; i < to; i++, data++, len--)
+    {
+        if (!len)
+        {
+            data = contiguous(i, &len);
+        }
+
+        int next = transitions[row + *data];
+        row = next & ~0xff;
+
+        if (!(next & 1))
+        {
+            continue;
+        }
+
+        int state = row / 256;
+        int output = state_signature[state] >= 0 ?
+                     state : state_next_output[state];
+
+        while (output >= 0)
+        {
+            int sig = state_signature[output];
+            int64_t offset = i - signatures[sig].len + 1;
+
+            if (offset >= start && offset < end)
+            {
+                if (atomic_fetch_add(&scan->total_hits, 1) >=
+                    MAX_SIGNATURE_HITS)
+                {
+                    return;
+                }
+
+                int64_t* len = &scan->hits_len[worker];
+
+                if (*len == scan->hits_cap[worker])
+                {
+                    scan->hits_cap[worker] = *len ? *len * 2 : 1024;
+                    scan->hits[worker] = realloc(scan->hits[worker],
+                            scan->hits_cap[worker] * sizeof(signature_hit));
+                }
+
+                scan->hits[worker][*len].offset = offset;
+                scan->hits[worker][*len].signature = sig;
+                (*len)++;
+            }
+
+            output = state_next_output[output];
+        }
+    }
+}
+
+void signature_scan_task(void* arg, int worker)
+{
+    signature_scan* scan = arg;
+    int64_t chunk;
+
+    while ((chunk = atomic_fetch_add(&scan->next_chunk, 1)) < scan->chunks)
+    {
+        int64_t start = scan->start + chunk * SEARCH_CHUNK_SIZE;
+        int64_t end = start + SEARCH_CHUNK_SIZE;
+
+        scan_signatures(scan, worker, start, end < scan->end ?
+                                              end : scan->end);
+    }
+}
+
+int compare_signature_hits(const void* a, const void* b)
+{
+    const signature_hit* x = a;
+    const signature_hit* y = b;
+
+    if (x->offset != y->offset)
+    {
+        return x->offset < y->offset ? -1 : 1;
+    }
+
+    return x->signature - y->signature;
+}
+
+// Find every signature hit starting in [start, end), sorted by offset.
+// Returns false if there were too many to keep.
+bool find_signature_hits(int64_t start, int64_t end, signature_hit** hits,
+                         int64_t* hits_len)
+{
+    int workers = worker_threads;
+
+    signature_scan scan;
+    scan.start = start;
+    scan.end = end;
+    scan.chunks = (end - start + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+    scan.hits = calloc(workers, sizeof(signature_hit*));
+    scan.hits_len = calloc(workers, sizeof(int64_t));
+    scan.hits_cap = calloc(workers, sizeof(int64_t));
+    atomic_init(&scan.next_chunk, 0);
+    atomic_init(&scan.total_hits, 0);
+
+    if (scan.chunks > 1)
+    {
+        run_in_pool(signature_scan_task, &scan);
+    }
+    else
+    {
+        signature_scan_task(&scan, 0);
+    }
+
+    int64_t total = 0;
+
+    for (int i = 0; i < workers; i++)
+    {
+        total += scan.hits_len[i];
+    }
+
+    *hits = malloc((total ? total : 1) * sizeof(signature_hit));
+    *hits_len = 0;
+
+    for (int i = 0; i < workers; i++)
+    {
+        memcpy(*hits + *hits_len, scan.hits[i],
+               scan.hits_len[i] * sizeof(signature_hit));
+        *hits_len += scan.hits_len[i];
+        free(scan.hits[i]);
+    }
+
+    qsort(*hits, *hits_len, sizeof(signature_hit), compare_signature_hits);
+
+    free(scan.hits);
+    free(scan.hits_len);
+    free(scan.hits_cap);
+
+    return atomic_load(&scan.total_hits) <= MAX_SIGNATURE_HITS;
+}
+
+void handle_sigscan()
+{
+    if (!load_signatures(command + 9))
+    {
+        return;
+    }
+
+    free(signature_hits);
+    advise_source(MADV_SEQUENTIAL);
+
+    bool complete = find_signature_hits(0, source_len, &signature_hits,
+                                        &signature_hits_len);
+
+    advise_source(MADV_RANDOM);
+
+    signature_hits_cap = signature_hits_len;
+    search_mode = SEARCH_SIGNATURES;
+
+    char count[MAX_RENDERED_INT];
+    char message[MAX_ERROR_LEN];
+    format_count(signature_hits_len, count);
+    snprintf(message, MAX_ERROR_LEN, "%s signature hits%s", count,
+             complete ? "" : " (too many, list truncated)");
+    set_message(message);
+}
+
+// Position of the first hit at or after offset
+int64_t first_hit_from(int64_t offset)
+{
+    int64_t low = 0;
+    int64_t high = signature_hits_len;
+
+    while (low < high)
+    {
+        int64_t mid = low + (high - low) / 2;
+
+        if (signature_hits[mid].offset < offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+void jump_to_match(int64_t match)
+{
+    cursor_byte = match;
+    cursor_nibble = 0;
+    cursor_jumped = true;
+}
+
+// The hit list (:sigs) shown in the detail pane in place of the cursor's
+// values: every hit's offset and signature, moved through with j / k and
+// jumped to with Enter
+#define SIG_LIST_ROWS 4
+
+bool sig_list_shown = false;
+int64_t sig_list_selected = 0;
+int64_t sig_list_top = 0;
+
+void handle_sig_list()
+{
+    if (!signatures_len || !signature_hits_len)
+    {
+        set_error("No signature hits; run :sigscan <rules_file> first");
+        return;
+    }
+
+    // Start at the hit under or after the cursor
+    sig_list_selected = first_hit_from(cursor_byte);
+
+    if (sig_list_selected >= signature_hits_len)
+    {
+        sig_list_selected = signature_hits_len - 1;
+    }
+
+    sig_list_top = sig_list_selected;
+    sig_list_shown = true;
+}
+
+// Keys while the hit list is shown, which takes them all
+void handle_sig_list_event(int event)
+{
+    switch (event)
+    {
+        case 'j':
+        case KEY_DOWN:
+            sig_list_selected++;
+            break;
+
+        case 'k':
+        case KEY_UP:
+            sig_list_selected--;
+            break;
+
+        case KEY_NPAGE:
+            sig_list_selected += SIG_LIST_ROWS;
+            break;
+
+        case KEY_PPAGE:
+            sig_list_selected -= SIG_LIST_ROWS;
+            break;
+
+        case KEY_RETURN:
+        case KEY_ENTER:
+            // n / N carry on from the chosen hit
+            search_mode = SEARCH_SIGNATURES;
+            jump_to_match(signature_hits[sig_list_selected].offset);
+            sig_list_shown = false;
+            return;
+
+        case KEY_ESC:
+        case 'q':
+            sig_list_shown = false;
+            return;
+    }
+
+    if (sig_list_selected >= signature_hits_len)
+    {
+        sig_list_selected = signature_hits_len - 1;
+    }
+
+    if (sig_list_selected < 0)
+    {
+        sig_list_selected = 0;
+    }
+
+    // Scroll the list to keep the selected hit in view
+    if (sig_list_selected < sig_list_top)
+    {
+        sig_list_top = sig_list_selected;
+    }
+    else if (sig_list_selected >= sig_list_top + SIG_LIST_ROWS)
+    {
+        sig_list_top = sig_list_selected - SIG_LIST_ROWS + 1;
+    }
+}
+
+// Rescan for hits around the bytes at offset after removed bytes there
+// were replaced by inserted new ones, moving the hits after them
+void repair_signature_hits(int64_t offset, int64_t removed, int64_t inserted)
+{
+    if (!signature_hits_len || !states_len)
+    {
+        return;
+    }
+
+    int64_t start = offset - longest_signature + 1;
+
+    if (start < 0)
+    {
+        start = 0;
+    }
+
+    int64_t low = first_hit_from(start);
+    int64_t high = first_hit_from(offset + removed);
+
+    for (int64_t i = high; inserted != removed && i < signature_hits_len; i++)
+    {
+        signature_hits[i].offset += inserted - removed;
+    }
+
+    signature_hit* found;
+    int64_t found_len;
+    find_signature_hits(start, offset + inserted, &found, &found_len);
+
+    int64_t new_len = signature_hits_len - (high - low) + found_len;
+
+    if (new_len > signature_hits_cap)
+    {
+        signature_hits_cap = new_len;
+        signature_hits = realloc(signature_hits,
+                                 new_len * sizeof(signature_hit));
+    }
+
+    memmove(&signature_hits[low + found_len], &signature_hits[high],
+            (signature_hits_len - high) * sizeof(signature_hit));
+    memcpy(&signature_hits[low], found, found_len * sizeof(signature_hit));
+    signature_hits_len = new_len;
+
+    free(found);
+}
+
+// Comparing with another file (--diff). Bytes at the same offset are
+// compared; offsets past the end of the shorter file count as differing.
+
+// Summary for the detail pane, recounted after edits
+int64_t diff_bytes = 0;
+int64_t diff_ranges = 0;
+bool diff_counted = false;
+
+// Buffers up to this size are recounted right after an edit. Beyond that
+// the count waits for the next ]d / [d.
+#define DIFF_RECOUNT_MAX (64 << 20)
+
+// Compare kernels. find_difference_* return the first (or last) offset in
+// [0, len) where a and b differ, or agree if !differ, or -1.
+// count_differences_* add up the differing bytes and the runs of them that
+// start in [0, len), given whether the byte before a differed, and return
+// whether the last byte did.
+typedef int64_t (*difference_kernel)(const unsigned char* a,
+                                     const unsigned char* b, int64_t len,
+                                     bool differ);
+typedef bool (*count_kernel)(const unsigned char* a, const unsigned char* b,
+                             int64_t len, bool before, int64_t* bytes,
+                             int64_t* ranges);
+
+// Whether any byte of x is zero
+#define has_zero_byte(x) \
+    (((x) - 0x0101010101010101ULL) & ~(x) & 0x8080808080808080ULL)
+
+int64_t find_difference_forward_scalar(const unsigned char* a,
+                                       const unsigned char* b, int64_t len,
+                                       bool differ)
+{
+    int64_t i = 0;
+
+    // Skip 8 bytes at a time while none of them qualify
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+
+        if (differ ? x != y : has_zero_byte(x ^ y) != 0)
+        {
+            break;
+        }
+    }
+
+    for (; i < len; i++)
+    {
+        if ((a[i] != b[i]) == differ)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int64_t find_difference_backward_scalar(const unsigned char* a,
+                                        const unsigned char* b, int64_t len,
+                                        bool differ)
+{
+    int64_t end = len;
+
+    for (; end >= 8; end -= 8)
+    {
+        uint64_t x;
+        uint64_t y;
+        memcpy(&x, a + end - 8, 8);
+        memcpy(&y, b + end - 8, 8);
+
+        if (differ ? x != y : has_zero_byte(x ^ y) != 0)
+        {
+            break;
+        }
+    }
+
+    for (int64_t i = end - 1; i >= 0; i--)
+    {
+        if ((a[i] != b[i]) == differ)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool count_differences_scalar(const unsigned char* a, const unsigned char* b,
+                              int64_t len, bool before, int64_t* bytes,
+                              int64_t* ranges)
+{
+    for (int64_t i = 0; i < len; i++)
+    {
+        bool differs = a[i] != b[i];
+        *bytes += differs;
+        *ranges += differs && !before;
+        before = differs;
+    }
+
+    return before;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Bit i set if a[i] != b[i], for 64 bytes
+__attribute__((target("avx2")))
+static inline uint64_t difference_mask_avx2(const unsigned char* a,
+                                            const unsigned char* b)
+{
+    __m256i low = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)a),
+            _mm256_loadu_si256((const __m256i*)b));
+    __m256i high = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(a + 32)),
+            _mm256_loadu_si256((const __m256i*)(b + 32)));
+
+    uint64_t equal = (uint32_t)_mm256_movemask_epi8(low) |
+                     (uint64_t)(uint32_t)_mm256_movemask_epi8(high) << 32;
+
+    return ~equal;
+}
+
+__attribute__((target("avx2")))
+int64_t find_difference_forward_avx2(const unsigned char* a,
+                                     const unsigned char* b, int64_t len,
+                                     bool differ)
+{
+    int64_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        uint64_t mask = difference_mask_avx2(a + i, b + i);
+        mask = differ ? mask : ~mask;
+
+        if (mask)
+        {
+            return i + __builtin_ctzll(mask);
+        }
+    }
+
+    int64_t found = find_difference_forward_scalar(a + i, b + i, len - i,
+                                                   differ);
+
+    return found < 0 ? -1 : i + found;
+}
+
+__attribute__((target("avx2")))
+int64_t find_difference_backward_avx2(const unsigned char* a,
+                                      const unsigned char* b, int64_t len,
+                                      bool differ)
+{
+    int64_t end = len;
+
+    for (; end >= 64; end -= 64)
+    {
+        uint64_t mask = difference_mask_avx2(a + end - 64, b + end - 64);
+        mask = differ ? mask : ~mask;
+
+        if (mask)
+        {
+            return end - 1 - __builtin_clzll(mask);
+        }
+    }
+
+    return find_difference_backward_scalar(a, b, end, differ);
+}
+
+__attribute__((target("avx2,popcnt")))
+bool count_differences_avx2(const unsigned char* a, const unsigned char* b,
+                            int64_t len, bool before, int64_t* bytes,
+                            int64_t* ranges)
+{
+    uint64_t carry = before;
+    int64_t i = 0;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        uint64_t mask = difference_mask_avx2(a + i, b + i);
+
+        // A run starts at each differing byte whose predecessor agreed
+        *bytes += __builtin_popcountll(mask);
+        *ranges += __builtin_popcountll(mask & ~(mask << 1 | carry));
+        carry = mask >> 63;
+    }
+
+    return count_differences_scalar(a + i, b + i, len - i, carry, bytes,
+                                    ranges);
+}
+
+#endif
+
+difference_kernel find_difference_forward = NULL;
+difference_kernel find_difference_backward = NULL;
+count_kernel count_differences_kernel = NULL;
+
+void select_difference_kernels()
+{
+    find_difference_forward = find_difference_forward_scalar;
+    find_difference_backward = find_difference_backward_scalar;
+    count_differences_kernel = count_differences_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+    {
+        find_difference_forward = find_difference_forward_avx2;
+        find_difference_backward = find_difference_backward_avx2;
+        count_differences_kernel = count_differences_avx2;
+    }
+#endif
+}
+
+int64_t diff_common_len()
+{
+    return source_len < diff_len ? source_len : diff_len;
+}
+
+// When the other file is longer, its extra bytes start at source_len, where
+// the cursor may then rest as it does in insert mode
+bool diff_tail_in_other()
+{
+    return diff_filename && diff_len > source_len;
+}
+
+bool byte_differs(int64_t offset)
+{
+    if (offset >= diff_common_len())
+    {
+        return true;
+    }
+
+    unsigned char byte;
+    read_bytes(offset, &byte, 1);
+
+    return byte != diff_data[offset];
+}
+
+// First (or last) offset in [start, end) where the files differ (or agree,
+// if !differ), or -1
+int64_t find_difference_serial(int64_t start, int64_t end, bool forward,
+                               bool differ)
+{
+    int64_t common = diff_common_len();
+    int64_t common_end = end < common ? end : common;
+
+    // Everything from the end of the shorter file on differs
+    int64_t tail_start = start > common ? start : common;
+    bool in_tail = differ && tail_start < end;
+
+    if (forward)
+    {
+        int64_t len;
+
+        for (int64_t offset = start; offset < common_end; offset += len)
+        {
+            unsigned char* data = contiguous(offset, &len);
+
+            if (len > common_end - offset)
+            {
+                len = common_end - offset;
+            }
+
+            int64_t found = find_difference_forward(data, diff_data + offset,
+                                                    len, differ);
+
+            if (found >= 0)
+            {
+                return offset + found;
+            }
+        }
+
+        return in_tail ? tail_start : -1;
+    }
+
+    if (in_tail)
+    {
+        return end - 1;
+    }
+
+    int64_t len;
+
+    for (int64_t offset = common_end; offset > start; offset -= len)
+    {
+        unsigned char* data = contiguous_before(offset, &len);
+
+        if (len > offset - start)
+        {
+            data += len - (offset - start);
+            len = offset - start;
+        }
+
+        int64_t found = find_difference_backward(data,
+                                                 diff_data + offset - len,
+                                                 len, differ);
+
+        if (found >= 0)
+        {
+            return offset - len + found;
+        }
+    }
+
+    return -1;
+}
+
+int64_t find_differing_byte(int64_t start, int64_t end, bool forward)
+{
+    return find_difference_serial(start, end, forward, true);
+}
+
+int64_t find_matching_byte(int64_t start, int64_t end, bool forward)
+{
+    return find_difference_serial(start, end, forward, false);
+}
+
+// Count differences in [start, end) of the common length
+bool count_differences_serial(int64_t start, int64_t end, int64_t* bytes,
+                              int64_t* ranges)
+{
+    bool before = start > 0 && byte_differs(start - 1);
+    int64_t len;
+
+    for (int64_t offset = start; offset < end; offset += len)
+    {
+        unsigned char* data = contiguous(offset, &len);
+
+        if (len > end - offset)
+        {
+            len = end - offset;
+        }
+
+        before = count_differences_kernel(data, diff_data + offset, len,
+                                          before, bytes, ranges);
+    }
+
+    return before;
+}
+
+typedef struct
+{
+    int64_t len;
+    int64_t chunks;
+    atomic_int_fast64_t next_chunk;
+    atomic_int_fast64_t bytes;
+    atomic_int_fast64_t ranges;
+} parallel_count;
+
+void parallel_count_task(void* arg, int worker)
+{
+    (void)worker;
+    parallel_count* count = arg;
+    int64_t chunk;
+
+    while ((chunk = atomic_fetch_add(&count->next_chunk, 1)) < count->chunks)
+    {
+        int64_t start = chunk * SEARCH_CHUNK_SIZE;
+        int64_t end = start + SEARCH_CHUNK_SIZE;
+        int64_t bytes = 0;
+        int64_t ranges = 0;
+
+        count_differences_serial(start, end < count->len ? end : count->len,
+                                 &bytes, &ranges);
+
+        atomic_fetch_add(&count->bytes, bytes);
+        atomic_fetch_add(&count->ranges, ranges);
+    }
+}
+
+// Total up the differing bytes and ranges for the detail pane
+void count_differences()
+{
+    if (!find_difference_forward)
+    {
+        select_difference_kernels();
+    }
+
+    int64_t common = diff_common_len();
+    diff_bytes = 0;
+    diff_ranges = 0;
+
+    if (worker_threads < 2 || common < PARALLEL_SEARCH_MIN)
+    {
+        count_differences_serial(0, common, &diff_bytes, &diff_ranges);
+    }
+    else
+    {
+        parallel_count count;
+        count.len = common;
+        count.chunks = (common + SEARCH_CHUNK_SIZE - 1) / SEARCH_CHUNK_SIZE;
+        atomic_init(&count.next_chunk, 0);
+        atomic_init(&count.bytes, 0);
+        atomic_init(&count.ranges, 0);
+
+        run_in_pool(parallel_count_task, &count);
+
+        diff_bytes = atomic_load(&count.bytes);
+        diff_ranges = atomic_load(&count.ranges);
+    }
+
+    // The longer file's extra bytes are one more range
+    if (source_len != diff_len)
+    {
+        diff_bytes += llabs(source_len - diff_len);
+        diff_ranges += common == 0 || !byte_differs(common - 1);
+    }
+
+    diff_counted = true;
+}
+
+// Find where the next (or previous) range of differing bytes starts,
+// looking from the cursor. Returns -1 if there isn't one.
+int64_t find_difference(bool forward)
+{
+    if (!find_difference_forward)
+    {
+        select_difference_kernels();
+    }
+
+    // Up to the end of the longer file, so the extra bytes are a range too
+    int64_t len = source_len > diff_len ? source_len : diff_len;
+
+    if (forward)
+    {
+        int64_t start = cursor_byte + 1;
+
+        // Skip the rest of the range the cursor is in
+        if (cursor_byte < len && byte_differs(cursor_byte))
+        {
+            start = search_range_with(find_matching_byte, start, len, true);
+        }
+
+        return start < 0 ? -1 : search_range_with(find_differing_byte, start,
+                                                  len, true);
+    }
+
+    int64_t end = cursor_byte < len ? cursor_byte : len;
+    int64_t last = search_range_with(find_differing_byte, 0, end, false);
+
+    if (last < 0)
+    {
+        return -1;
+    }
+
+    return search_range_with(find_matching_byte, 0, last, false) + 1;
+}
+
+void handle_next_difference(bool forward)
+{
+    if (!diff_filename)
+    {
+        set_error("Not comparing files; start with --diff");
+        return;
+    }
+
+    if (!diff_counted)
+    {
+        count_differences();
+    }
+
+    int64_t found = find_difference(forward);
+
+    if (found < 0)
+    {
+        set_error(forward ? "No more differences" : "No earlier differences");
+        return;
+    }
+
+    jump_to_match(found);
+}
+
+// Map the file to compare the buffer with
+void open_diff_file(char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        printf("Error opening %s to compare with.\n", filename);
+        exit(2);
+    }
+
+    if (st.st_size > 0)
+    {
+        diff_data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (diff_data == MAP_FAILED)
+        {
+            printf("Error mapping %s.\n", filename);
+            exit(2);
+        }
+
+        madvise(diff_data, st.st_size, MADV_RANDOM);
+    }
+
+    close(fd);
+
+    diff_filename = filename;
+    diff_len = st.st_size;
+}
+
+// Checksums and hashes (:hash <algorithm> [start end]). The range is hashed
+// in place, piece by piece, on a background thread; edits cancel it.
+// CRC-32 uses carry-less multiplication (PCLMULQDQ), CRC-32C the SSE4.2
+// crc32 instruction and SHA-256 the SHA extensions when the CPU has them.
+
+#define HASH_CRC32 0
+#define HASH_CRC32C 1
+#define HASH_XXH64 2
+#define HASH_SHA256 3
+
+const char* hash_names[] = {"crc32", "crc32c", "xxh64", "sha256"};
+
+#define HASH_ALGORITHMS_LEN 4
+
+// Bytes hashed between checks for cancellation and buffer appends
+#define HASH_CHUNK_SIZE (1 << 20)
+
+typedef struct
+{
+    int algorithm;
+    uint32_t crc;
+    uint64_t lanes[4];   // xxh64
+    uint32_t state[8];   // sha256
+
+    // Bytes not making up a whole xxh64 stripe or SHA-256 block yet
+    unsigned char pending[64];
+    int pending_len;
+    int64_t total;
+} hash_state;
+
+// Slicing-by-8 tables for both (reflected) CRC polynomials
+uint32_t crc_tables[2][8][256];
+bool crc_tables_ready = false;
+
+void init_crc_tables()
+{
+    uint32_t polynomials[2] = {0xedb88320, 0x82f63b78};
+
+    for (int kind = 0; kind < 2; kind++)
+    {
+        for (int byte = 0; byte < 256; byte++)
+        {
+            uint32_t crc = byte;
+
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = crc >> 1 ^ (crc & 1 ? polynomials[kind] : 0);
+            }
+
+            crc_tables[kind][0][byte] = crc;
+        }
+
+        for (int byte = 0; byte < 256; byte++)
+        {
+            for (int slice = 1; slice < 8; slice++)
+            {
+                uint32_t previous = crc_tables[kind][slice - 1][byte];
+                crc_tables[kind][slice][byte] =
+                        previous >> 8 ^ crc_tables[kind][0][previous & 0xff];
+            }
+        }
+    }
+
+    crc_tables_ready = true;
+}
+
+uint32_t crc_table_update(int kind, uint32_t crc, const unsigned char* data,
+                          int64_t len)
+{
+    uint32_t (*t)[256] = crc_tables[kind];
+
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint32_t low;
+        uint32_t high;
+        memcpy(&low, data, 4);
+        memcpy(&high, data + 4, 4);
+        low ^= crc;
+
+        crc = t[7][low & 0xff] ^ t[6][low >> 8 & 0xff] ^
+              t[5][low >> 16 & 0xff] ^ t[4][low >> 24] ^
+              t[3][high & 0xff] ^ t[2][high >> 8 & 0xff] ^
+              t[1][high >> 16 & 0xff] ^ t[0][high >> 24];
+    }
+
+    for (; len > 0; data++, len--)
+    {
+        crc = crc >> 8 ^ t[0][(crc ^ *data) & 0xff];
+    }
+
+    return crc;
+}
+
+const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define rotr32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+// Hash len / 64 whole blocks into state
+void sha256_blocks_scalar(uint32_t* state, const unsigned char* data,
+                          int64_t len)
+{
+    for (; len >= 64; data += 64, len -= 64)
+    {
+        uint32_t w[64];
+
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)data[i * 4] << 24 | data[i * 4 + 1] << 16 |
+                   data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+                          w[i - 15] >> 3;
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+                          w[i - 2] >> 10;
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t v[8];
+        memcpy(v, state, sizeof(v));
+
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t s1 = rotr32(v[4], 6) ^ rotr32(v[4], 11) ^
+                          rotr32(v[4], 25);
+            uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + s1 + choice + sha256_k[i] + w[i];
+            uint32_t s0 = rotr32(v[0], 2) ^ rotr32(v[0], 13) ^
+                          rotr32(v[0], 22);
+            uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^
+                                (v[1] & v[2]);
+
+            memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + majority;
+        }
+
+        for (int i = 0; i < 8; i++)
+        {
+            state[i] += v[i];
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// CRC-32 by folding 64 bytes at a time with carry-less multiplication, as
+// in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+// len must be at least 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t crc, const unsigned char* data, int64_t len)
+{
+    static const uint64_t k1k2[2] = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] = {0x01db710641, 0x01f7011641};
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+    __m128i k = _mm_loadu_si128((const __m128i*)k1k2);
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    data += 64;
+    len -= 64;
+
+    // Fold four lanes of 128 bits forward over each 64 bytes
+    for (; len >= 64; data += 64, len -= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*)data));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i*)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i*)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i*)(data + 48)));
+    }
+
+    // Fold the lanes into one, then fold in what's left 16 bytes at a time
+    k = _mm_loadu_si128((const __m128i*)k3k4);
+
+    __m128i lanes[3] = {x2, x3, x4};
+
+    for (int i = 0; i < 3; i++)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, lanes[i]), x5);
+    }
+
+    for (; len >= 16; data += 16, len -= 16)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*)data));
+    }
+
+    // Reduce 128 bits to 64
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    k = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    k = _mm_loadu_si128((const __m128i*)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, int64_t len)
+{
+    uint64_t crc64 = crc;
+
+    for (; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+
+    crc = crc64;
+
+    for (; len > 0; data++, len--)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_blocks_shani(uint32_t* state, const unsigned char* data,
+                         int64_t len)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                             0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(
+            _mm_loadu_si128((const __m128i*)state), 0xb1);
+    __m128i state1 = _mm_shuffle_epi32(
+            _mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);
+
+    for (; len >= 64; data += 64, len -= 64)
+    {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i w[4];
+
+        for (int i = 0; i < 4; i++)
+        {
+            w[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i*)(data + i * 16)),
+                    byte_swap);
+        }
+
+        // Each group of four rounds also extends the message schedule
+        // for the groups after it
+        for (int i = 0; i < 16; i++)
+        {
+            __m128i current = w[i % 4];
+            __m128i rounds = _mm_add_epi32(current,
+                    _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+
+            state1 = _mm_sha256rnds2_epu32(state1, state0, rounds);
+
+            if (i >= 3 && i < 15)
+            {
+                __m128i next = _mm_add_epi32(w[(i + 1) % 4],
+                        _mm_alignr_epi8(current, w[(i + 3) % 4], 4));
+                w[(i + 1) % 4] = _mm_sha256msg2_epu32(next, current);
+            }
+
+            rounds = _mm_shuffle_epi32(rounds, 0x0e);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, rounds);
+
+            if (i >= 1 && i < 13)
+            {
+                w[(i + 3) % 4] = _mm_sha256msg1_epu32(w[(i + 3) % 4],
+                                                      current);
+            }
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i*)state, state0);
+    _mm_storeu_si128((__m128i*)(state + 4), state1);
+}
+
+#endif
+
+// Kernels picked for the CPU on first use
+bool crc32_use_pclmul = false;
+bool crc32c_use_sse42 = false;
+void (*sha256_blocks)(uint32_t* state, const unsigned char* data,
+                      int64_t len) = NULL;
+
+void select_hash_kernels()
+{
+    init_crc_tables();
+    sha256_blocks = sha256_blocks_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    crc32_use_pclmul = __builtin_cpu_supports("pclmul") &&
+                       __builtin_cpu_supports("sse4.1");
+    crc32c_use_sse42 = __builtin_cpu_supports("sse4.2");
+
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1") &&
+        __builtin_cpu_supports("ssse3"))
+    {
+        sha256_blocks = sha256_blocks_shani;
+    }
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const unsigned char* data, int64_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (crc32_use_pclmul && len >= 64)
+    {
+        int64_t folded = len & ~15;
+        crc = crc32_pclmul(crc, data, folded);
+        data += folded;
+        len -= folded;
+    }
+#endif
+
+    return crc_table_update(0, crc, data, len);
+}
+
+uint32_t crc32c_update(uint32_t crc, const unsigned char* data, int64_t len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (crc32c_use_sse42)
+    {
+        return crc32c_sse42(crc, data, len);
+    }
+#endif
+
+    return crc_table_update(1, crc, data, len);
+}
+
+#define XXH_PRIME1 0x9e3779b185ebca87ULL
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3 0x165667b19e3779f9ULL
+#define XXH_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5 0x27d4eb2f165667c5ULL
+
+#define rotl64(x, n) ((x) << (n) | (x) >> (64 - (n)))
+
+uint64_t xxh64_round(uint64_t lane, uint64_t input)
+{
+    lane += input * XXH_PRIME2;
+    lane = rotl64(lane, 31);
+    return lane * XXH_PRIME1;
+}
+
+uint64_t xxh64_merge(uint64_t hash, uint64_t lane)
+{
+    hash ^= xxh64_round(0, lane);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t read_le64(const unsigned char* data)
+{
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return value;
+}
+
+// Hash len / 32 whole stripes into the lanes
+void xxh64_stripes(uint64_t* lanes, const unsigned char* data, int64_t len)
+{
+    uint64_t v0 = lanes[0];
+    uint64_t v1 = lanes[1];
+    uint64_t v2 = lanes[2];
+    uint64_t v3 = lanes[3];
+
+    for (; len >= 32; data += 32, len -= 32)
+    {
+        v0 = xxh64_round(v0, read_le64(data));
+        v1 = xxh64_round(v1, read_le64(data + 8));
+        v2 = xxh64_round(v2, read_le64(data + 16));
+        v3 = xxh64_round(v3, read_le64(data + 24));
+    }
+
+    lanes[0] = v0;
+    lanes[1] = v1;
+    lanes[2] = v2;
+    lanes[3] = v3;
+}
+
+void hash_init(hash_state* h, int algorithm)
+{
+    static const uint32_t sha256_initial[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    if (!sha256_blocks)
+    {
+        select_hash_kernels();
+    }
+
+    memset(h, 0, sizeof(*h));
+    h->algorithm = algorithm;
+    h->crc = 0xffffffff;
+    h->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    h->lanes[1] = XXH_PRIME2;
+    h->lanes[2] = 0;
+    h->lanes[3] = -XXH_PRIME1;
+    memcpy(h->state, sha256_initial, sizeof(h->state));
+}
+
+// Feed bytes to a block-based hash, keeping partial blocks in pending
+void hash_blocks(hash_state* h, const unsigned char* data, int64_t len,
+                 int block_size)
+{
+    if (h->pending_len)
+    {
+        int take = block_size - h->pending_len < len ?
+                   block_size - h->pending_len : len;
+
+        memcpy(h->pending + h->pending_len, data, take);
+        h->pending_len += take;
+        data += take;
+        len -= take;
+
+        if (h->pending_len < block_size)
+        {
+            return;
+        }
+
+        if (h->algorithm == HASH_XXH64)
+        {
+            xxh64_stripes(h->lanes, h->pending, block_size);
+        }
+        else
+        {
+            sha256_blocks(h->state, h->pending, block_size);
+        }
+
+        h->pending_len = 0;
+    }
+
+    int64_t whole = len - len % block_size;
+
+    if (h->algorithm == HASH_XXH64)
+    {
+        xxh64_stripes(h->lanes, data, whole);
+    }
+    else
+    {
+        sha256_blocks(h->state, data, whole);
+    }
+
+    memcpy(h->pending, data + whole, len - whole);
+    h->pending_len = len - whole;
+}
+
+void hash_update(hash_state* h, const unsigned char* data, int64_t len)
+{
+    h->total += len;
+
+    switch (h->algorithm)
+    {
+        case HASH_CRC32:  h->crc = crc32_update(h->crc, data, len);  break;
+        case HASH_CRC32C: h->crc = crc32c_update(h->crc, data, len); break;
+        case HASH_XXH64:  hash_blocks(h, data, len, 32);             break;
+        case HASH_SHA256: hash_blocks(h, data, len, 64);             break;
+    }
+}
+
+// Write the digest as hex to output (at least 65 chars)
+void hash_final(hash_state* h, char* output)
+{
+    if (h->algorithm == HASH_CRC32 || h->algorithm == HASH_CRC32C)
+    {
+        sprintf(output, "%08x", ~h->crc);
+        return;
+    }
+
+    if (h->algorithm == HASH_XXH64)
+    {
+        uint64_t hash;
+
+        if (h->total >= 32)
+        {
+            uint64_t* v = h->lanes;
+            hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) +
+                   rotl64(v[3], 18);
+
+            for (int i = 0; i < 4; i++)
+            {
+                hash = xxh64_merge(hash, v[i]);
+            }
+        }
+        else
+        {
+            hash = XXH_PRIME5;
+        }
+
+        hash += h->total;
+
+        const unsigned char* p = h->pending;
+        int left = h->pending_len;
+
+        for (; left >= 8; p += 8, left -= 8)
+        {
+            hash ^= xxh64_round(0, read_le64(p));
+            hash = rotl64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+        }
+
+        if (left >= 4)
+        {
+            uint32_t word;
+            memcpy(&word, p, 4);
+            hash ^= word * XXH_PRIME1;
+            hash = rotl64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+            p += 4;
+            left -= 4;
+        }
+
+        for (; left > 0; p++, left--)
+        {
+            hash ^= *p * XXH_PRIME5;
+            hash = rotl64(hash, 11) * XXH_PRIME1;
+        }
+
+        hash ^= hash >> 33;
+        hash *= XXH_PRIME2;
+        hash ^= hash >> 29;
+        hash *= XXH_PRIME3;
+        hash ^= hash >> 32;
+
+        sprintf(output, "%016" PRIx64, hash);
+        return;
+    }
+
+    // SHA-256: a 1 bit, zeros and the length in bits fill out the last block
+    uint64_t bits = h->total * 8;
+    unsigned char padding[72] = {0x80};
+    int padding_len = (h->pending_len < 56 ? 56 : 120) - h->pending_len;
+
+    for (int i = 0; i < 8; i++)
+    {
+        padding[padding_len + i] = bits >> (56 - i * 8);
+    }
+
+    hash_blocks(h, padding, padding_len + 8, 64);
+
+    for (int i = 0; i < 8; i++)
+    {
+        sprintf(output + i * 8, "%08x", h->state[i]);
+    }
+}
+
+// The hash being computed (or last computed) for the detail pane
+pthread_t hash_thread;
+bool hash_running = false;
+atomic_bool hash_cancel;
+atomic_bool hash_done;
+atomic_int_fast64_t hash_hashed;
+hash_state hash_current;
+int64_t hash_start;
+int64_t hash_end;
+char hash_digest[65] = "";
+
+void* run_hash(void* arg)
+{
+    (void)arg;
+
+    for (int64_t offset = hash_start; offset < hash_end; )
+    {
+        if (atomic_load(&hash_cancel))
+        {
+            break;
+        }
+
+        int64_t chunk_end = offset + HASH_CHUNK_SIZE < hash_end ?
+                            offset + HASH_CHUNK_SIZE : hash_end;
+
+        // Input appended meanwhile may rearrange the pieces
+        pthread_rwlock_rdlock(&pieces_lock);
+
+        while (offset < chunk_end)
+        {
+            int64_t len;
+            unsigned char* data = contiguous(offset, &len);
+
+            if (len > chunk_end - offset)
+            {
+                len = chunk_end - offset;
+            }
+
+            hash_update(&hash_current, data, len);
+            offset += len;
+        }
+
+        pthread_rwlock_unlock(&pieces_lock);
+        atomic_store(&hash_hashed, offset - hash_start);
+    }
+
+    atomic_store(&hash_done, true);
+    return NULL;
+}
+
+// Cancel a hash in progress; the buffer is about to change under it
+void stop_hash()
+{
+    if (!hash_running)
+    {
+        return;
+    }
+
+    atomic_store(&hash_cancel, true);
+    pthread_join(hash_thread, NULL);
+    hash_running = false;
+    advise_source(MADV_RANDOM);
+    set_error("Hash cancelled by an edit");
+}
+
+void finish_hash()
+{
+    hash_running = false;
+    advise_source(MADV_RANDOM);
+    hash_final(&hash_current, hash_digest);
+
+    if (batch_mode)
+    {
+        printf("%s: %s %s\n", original_filename ? original_filename : "-",
+               hash_names[hash_current.algorithm], hash_digest);
+    }
+    else
+    {
+        set_message(hash_digest);
+    }
+}
+
+// Pick up a finished hash. Returns true if one finished.
+bool poll_hash()
+{
+    if (!hash_running || !atomic_load(&hash_done))
+    {
+        return false;
+    }
+
+    pthread_join(hash_thread, NULL);
+    finish_hash();
+    return true;
+}
+
+void handle_hash()
+{
+    char name[16];
+    char start_text[32] = "";
+    char end_text[32] = "";
+    int fields = sscanf(command + 6, "%15s %31s %31s", name, start_text,
+                        end_text);
+
+    int algorithm = 0;
+
+    while (algorithm < HASH_ALGORITHMS_LEN &&
+           (fields < 1 || strcmp(name, hash_names[algorithm]) != 0))
+    {
+        algorithm++;
+    }
+
+    if (algorithm == HASH_ALGORITHMS_LEN)
+    {
+        set_error("Usage: :hash crc32|crc32c|xxh64|sha256 [start end]");
+        return;
+    }
+
+    int64_t start = 0;
+    int64_t end = source_len;
+
+    if (fields == 2 || (fields == 3 && (!parse_offset(start_text, &start) ||
+                                        !parse_offset(end_text, &end))))
+    {
+        set_error("Expected a start and end offset");
+        return;
+    }
+
+    if (start > end || end > source_len)
+    {
+        set_error("Range is outside the buffer");
+        return;
+    }
+
+    stop_hash();
+    hash_init(&hash_current, algorithm);
+    hash_start = start;
+    hash_end = end;
+    hash_digest[0] = 0;
+
+    atomic_store(&hash_cancel, false);
+    atomic_store(&hash_done, false);
+    atomic_store(&hash_hashed, 0);
+    advise_source(MADV_SEQUENTIAL);
+
+    // Scripts use the result right away
+    if (batch_mode)
+    {
+        run_hash(NULL);
+        finish_hash();
+        return;
+    }
+
+    if (pthread_create(&hash_thread, NULL, run_hash, NULL) != 0)
+    {
+        advise_source(MADV_RANDOM);
+        set_error("Error starting hash thread");
+        return;
+    }
+
+    hash_running = true;
+}
+
+// The minimap (:set minimap): a column summarizing the whole buffer, one
+// block of MINIMAP_BLOCK_SIZE bytes at a time, by entropy and by which kind
+// of bytes dominate. Blocks are summarized by a background thread and kept
+// up to date as the buffer changes. Each level of minimap_levels merges
+// pairs of entries of the level below, so a row of the minimap covering any
+// number of blocks is drawn from a handful of entries.
+
+#define MINIMAP_BLOCK_SIZE (16 << 10)
+#define MINIMAP_MAX_LEVELS 48
+
+typedef struct
+{
+    double entropy;  // average bits per byte
+    int64_t zeros;
+    int64_t text;    // printable ASCII and whitespace
+    int64_t len;
+} block_summary;
+
+block_summary* minimap_levels[MINIMAP_MAX_LEVELS];
+int64_t minimap_levels_len[MINIMAP_MAX_LEVELS];
+int minimap_depth = 0;
+
+// Blocks below minimap_scanned are summarized. The worker advances it;
+// minimap_merged is how far the upper levels have caught up.
+pthread_t minimap_thread;
+bool minimap_running = false;
+atomic_bool minimap_cancel;
+atomic_bool minimap_done;
+atomic_int_fast64_t minimap_scanned;
+int64_t minimap_merged = 0;
+
+// count * log2(count) for every count a block can have
+float* count_log_count = NULL;
+
+void summarize_block(int64_t block)
+{
+    // Counting into four tables in turn keeps consecutive equal bytes from
+    // waiting on each other's increments
+    uint32_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+
+    int64_t offset = block * MINIMAP_BLOCK_SIZE;
+    int64_t end = offset + MINIMAP_BLOCK_SIZE < source_len ?
+                  offset + MINIMAP_BLOCK_SIZE : source_len;
+    int64_t len;
+
+    for (; offset < end; offset += len)
+    {
+        unsigned char* data = contiguous(offset, &len);
+
+        if (len > end - offset)
+        {
+            len = end - offset;
+        }
+
+        int64_t i = 0;
+
+        for (; i + 4 <= len; i += 4)
+        {
+            counts[0][data[i]]++;
+            counts[1][data[i + 1]]++;
+            counts[2][data[i + 2]]++;
+            counts[3][data[i + 3]]++;
+        }
+
+        for (; i < len; i++)
+        {
+            counts[0][data[i]]++;
+        }
+    }
+
+    block_summary* summary = &minimap_levels[0][block];
+    int64_t total = end - block * MINIMAP_BLOCK_SIZE;
+    double sum = 0;
+
+    summary->text = 0;
+    summary->len = total;
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        uint32_t count = counts[0][byte] + counts[1][byte] +
+                         counts[2][byte] + counts[3][byte];
+
+        sum += count_log_count[count];
+
+        if ((byte >= ' ' && byte <= '~') || byte == '\t' || byte == '\n' ||
+            byte == '\r')
+        {
+            summary->text += count;
+        }
+    }
+
+    summary->zeros = counts[0][0] + counts[1][0] + counts[2][0] +
+                     counts[3][0];
+
+    // H = log2(n) - sum(c log2 c) / n
+    summary->entropy = total ? log2(total) - sum / total : 0;
+}
+
+void merge_summaries(block_summary* out, const block_summary* a,
+                     const block_summary* b)
+{
+    int64_t len = a->len + b->len;
+
+    out->entropy = len ? (a->entropy * a->len + b->entropy * b->len) / len : 0;
+    out->zeros = a->zeros + b->zeros;
+    out->text = a->text + b->text;
+    out->len = len;
+}
+
+// Recompute the upper level entries covering blocks [first, end). Entries
+// only take in blocks that are summarized; the worker may be writing the
+// ones after them.
+void merge_minimap_levels(int64_t first, int64_t end)
+{
+    int64_t summarized = atomic_load(&minimap_scanned);
+
+    for (int level = 1; level < minimap_depth && first < end; level++)
+    {
+        first /= 2;
+        end = (end + 1) / 2;
+
+        block_summary* below = minimap_levels[level - 1];
+
+        for (int64_t i = first; i < end; i++)
+        {
+            if (2 * i + 1 < summarized)
+            {
+                merge_summaries(&minimap_levels[level][i], &below[2 * i],
+                                &below[2 * i + 1]);
+            }
+            else
+            {
+                minimap_levels[level][i] = below[2 * i];
+            }
+        }
+
+        summarized = (summarized + 1) / 2;
+    }
+}
+
+void* run_minimap(void* arg)
+{
+    (void)arg;
+
+    int64_t blocks = minimap_levels_len[0];
+
+    for (int64_t block = atomic_load(&minimap_scanned); block < blocks;
+         block++)
+    {
+        if (atomic_load(&minimap_cancel))
+        {
+            break;
+        }
+
+        pthread_rwlock_rdlock(&pieces_lock);
+        summarize_block(block);
+        pthread_rwlock_unlock(&pieces_lock);
+
+        atomic_store(&minimap_scanned, block + 1);
+    }
+
+    atomic_store(&minimap_done, true);
+    return NULL;
+}
+
+void stop_minimap()
+{
+    if (!minimap_running)
+    {
+        return;
+    }
+
+    atomic_store(&minimap_cancel, true);
+    pthread_join(minimap_thread, NULL);
+    minimap_running = false;
+}
+
+// Size the levels for the buffer and summarize whatever isn't yet
+void start_minimap()
+{
+    stop_minimap();
+
+    if (!count_log_count)
+    {
+        count_log_count = malloc((MINIMAP_BLOCK_SIZE + 1) * sizeof(float));
+
+        for (int count = 0; count <= MINIMAP_BLOCK_SIZE; count++)
+        {
+            count_log_count[count] = count ? count * log2(count) : 0;
+        }
+    }
+
+    int64_t blocks = (source_len + MINIMAP_BLOCK_SIZE - 1) /
+                     MINIMAP_BLOCK_SIZE;
+
+    // Each level has half as many entries as the one below, down to one
+    int64_t len = blocks;
+    minimap_depth = 0;
+
+    while (minimap_depth < MINIMAP_MAX_LEVELS)
+    {
+        minimap_levels[minimap_depth] = realloc(
+                minimap_levels[minimap_depth],
+                (len ? len : 1) * sizeof(block_summary));
+        minimap_levels_len[minimap_depth++] = len;
+
+        if (len <= 1)
+        {
+            break;
+        }
+
+        len = (len + 1) / 2;
+    }
+
+    if (atomic_load(&minimap_scanned) > blocks)
+    {
+        atomic_store(&minimap_scanned, blocks);
+    }
+
+    if (minimap_merged > atomic_load(&minimap_scanned))
+    {
+        minimap_merged = atomic_load(&minimap_scanned);
+    }
+
+    if (atomic_load(&minimap_scanned) == blocks)
+    {
+        return;
+    }
+
+    atomic_store(&minimap_cancel, false);
+    atomic_store(&minimap_done, false);
+
+    if (pthread_create(&minimap_thread, NULL, run_minimap, NULL) == 0)
+    {
+        minimap_running = true;
+    }
+}
+
+// Merge newly summarized blocks into the upper levels
+void poll_minimap()
+{
+    if (!minimap_shown)
+    {
+        return;
+    }
+
+    int64_t scanned = atomic_load(&minimap_scanned);
+
+    if (minimap_merged < scanned)
+    {
+        merge_minimap_levels(minimap_merged, scanned);
+        minimap_merged = scanned;
+    }
+
+    if (minimap_running && atomic_load(&minimap_done))
+    {
+        pthread_join(minimap_thread, NULL);
+        minimap_running = false;
+    }
+}
+
+// Bring the minimap up to date after removed bytes at offset were replaced
+// by inserted new ones. Overwritten blocks are summarized again on the spot;
+// anything else moves every block after the change, so those are
+// summarized again in the background.
+void repair_minimap(int64_t offset, int64_t removed, int64_t inserted)
+{
+    if (!minimap_shown)
+    {
+        return;
+    }
+
+    int64_t first = offset / MINIMAP_BLOCK_SIZE;
+
+    if (removed != inserted)
+    {
+        if (atomic_load(&minimap_scanned) > first)
+        {
+            atomic_store(&minimap_scanned, first);
+        }
+    }
+    else if (inserted > 0)
+    {
+        int64_t end = (offset + inserted - 1) / MINIMAP_BLOCK_SIZE + 1;
+
+        if (end > atomic_load(&minimap_scanned))
+        {
+            end = atomic_load(&minimap_scanned);
+        }
+
+        for (int64_t block = first; block < end; block++)
+        {
+            summarize_block(block);
+        }
+
+        merge_minimap_levels(first, end);
+    }
+
+    start_minimap();
+}
+
+void show_minimap(bool show)
+{
+    stop_minimap();
+    minimap_shown = show;
+
+    if (show)
+    {
+        atomic_store(&minimap_scanned, 0);
+        minimap_merged = 0;
+        start_minimap();
+    }
+}
+
+// Summary of blocks [first, end), which must be summarized, from the
+// fewest entries of the levels
+block_summary summarize_blocks(int64_t first, int64_t end)
+{
+    block_summary total = {0};
+    int level = 0;
+
+    while (level + 1 < minimap_depth && (2LL << level) <= end - first)
+    {
+        level++;
+    }
+
+    // Entries of the chosen level inside the range, and of lower levels for
+    // the parts at either end
+    for (; level >= 0; level--)
+    {
+        int64_t size = 1LL << level;
+        int64_t from = (first + size - 1) / size;
+        int64_t to = end / size;
+
+        for (int64_t i = from; i < to; i++)
+        {
+            merge_summaries(&total, &total, &minimap_levels[level][i]);
+        }
+
+        if (from < to)
+        {
+            block_summary left = summarize_blocks(first, from * size);
+            block_summary right = summarize_blocks(to * size, end);
+            merge_summaries(&total, &total, &left);
+            merge_summaries(&total, &total, &right);
+            break;
+        }
+    }
+
+    return total;
+}
+
+// Regular expression search (/re:...). Expressions work on bytes:
+//
+//   \xHH  a byte         .      any byte         [...] [^...]  byte classes
+//   \n \r \t \0          \d \w \s (and \D \W \S)   * + ? {n} {n,} {n,m}
+//   a|b   alternation    (...)  grouping         \c    literal c
+//
+// An expression is parsed into a tree, compiled to two Thompson NFAs (one
+// for the expression and one for its reverse) and searched with lazily
+// built DFAs. The forward DFA finds where the leftmost match ends and the
+// reverse DFA then walks back from there to find where it starts. DFA states
+// are built on demand and cached; when the cache fills up it's flushed and
+// rebuilt as needed, so memory stays bounded and every search is linear in
+// the number of bytes scanned.
+
+#define MAX_REGEX_NODES 4096
+#define MAX_REGEX_CLASSES 1024
+#define MAX_REGEX_REPEAT 1000
+#define MAX_NFA_STATES (1 << 14)
+#define MAX_DFA_STATES 2048
+#define MAX_DFA_THREADS (1 << 20)
+
+// How far outside the viewport to look for highlighted matches, and the
+// most DFA steps spent finding them each frame
+#define REGEX_HIGHLIGHT_MARGIN 4096
+#define REGEX_HIGHLIGHT_MAX_STEPS (1 << 20)
+
+#define RE_EMPTY 0
+#define RE_CLASS 1
+#define RE_CONCAT 2
+#define RE_ALTERNATE 3
+#define RE_REPEAT 4
+
+typedef struct
+{
+    int type;
+    int cls;
+    int min;
+    int max;    // -1 for unbounded
+    int left;
+    int right;
+} regex_node;
+
+typedef struct
+{
+    uint64_t bits[4];
+} byte_class;
+
+#define NFA_EMPTY 0
+#define NFA_SPLIT 1
+#define NFA_BYTE 2
+#define NFA_MATCH 3
+
+typedef struct
+{
+    int type;
+    int out;
+    int out2;
+    int cls;
+} nfa_state;
+
+typedef struct
+{
+    nfa_state* states;
+    int len;
+
+    // Entry points: anchored (match must start here) and unanchored (match
+    // may start anywhere, via a lowest-priority "skip a byte" loop)
+    int anchored;
+    int unanchored;
+} regex_program;
+
+typedef struct
+{
+    regex_program* program;
+
+    // Stop following lower-priority threads once one matches. This gives
+    // leftmost-first matches; without it the DFA finds the longest match.
+    bool cut_on_match;
+
+    int len;
+    int* transitions;   // [state * 256 + byte], -1 if not yet computed
+    int* thread_start;  // each state's NFA thread list within threads
+    int* thread_len;
+    bool* match;
+
+    int* threads;
+    int threads_len;
+
+    // Open-addressed hash of thread lists to states (state + 1, 0 = empty)
+    int* table;
+    int table_cap;
+
+    // The unanchored and anchored start states, rebuilt after a flush
+    int unanchored_start;
+    int anchored_start;
+
+    // Scratch space for computing a new state
+    int* scratch;
+    int* stack;
+    unsigned* visited;
+    unsigned generation;
+} regex_dfa;
+
+regex_node regex_nodes[MAX_REGEX_NODES];
+int regex_nodes_len;
+
+byte_class regex_classes[MAX_REGEX_CLASSES];
+int regex_classes_len;
+
+// Parser state
+const char* regex_text;
+int regex_pos;
+int regex_len;
+const char* regex_error;
+
+regex_program regex_forward;
+regex_program regex_reverse;
+
+// Forward leftmost-first, reverse longest (for the start of a forward
+// match) and reverse leftmost-first (for searching backwards)
+regex_dfa forward_dfa;
+regex_dfa reverse_longest_dfa;
+regex_dfa reverse_dfa;
+
+// Bytes every match must start with, searched for with the regular search
+// kernels to skip ahead while the forward DFA is idle.
+unsigned char regex_prefix[MAX_SEARCH_TERM_LEN];
+unsigned char regex_prefix_mask[MAX_SEARCH_TERM_LEN];
+search_plan regex_prefix_plan;
+int regex_prefix_len = 0;
+
+bool regex_ready = false;
+
+bool class_has(const byte_class* cls, unsigned char byte)
+{
+    return cls->bits[byte >> 6] & (1ull << (byte & 63));
+}
+
+void class_add(byte_class* cls, unsigned char byte)
+{
+    cls->bits[byte >> 6] |= 1ull << (byte & 63);
+}
+
+void class_add_range(byte_class* cls, int first, int last)
+{
+    for (int byte = first; byte <= last; byte++)
+    {
+        class_add(cls, byte);
+    }
+}
+
+// Returns the single byte a class matches, or -1
+int class_single_byte(const byte_class* cls)
+{
+    int found = -1;
+
+    for (int byte = 0; byte < 256; byte++)
+    {
+        if (class_has(cls, byte))
+        {
+            if (found >= 0)
+            {
+                return -1;
+            }
+
+            found = byte;
+        }
+    }
+
+    return found;
+}
+
+int new_regex_node(int type)
+{
+    if (regex_nodes_len >= MAX_REGEX_NODES)
+    {
+        regex_error = "Regular expression too large";
+        return -1;
+    }
+
+    regex_node* node = &regex_nodes[regex_nodes_len];
+    memset(node, 0, sizeof(regex_node));
+    node->type = type;
+
+    return regex_nodes_len++;
+}
+
+int new_class_node(byte_class* cls)
+{
+    if (regex_classes_len >= MAX_REGEX_CLASSES)
+    {
+        regex_error = "Regular expression too large";
+        return -1;
+    }
+
+    int node = new_regex_node(RE_CLASS);
+
+    if (node >= 0)
+    {
+        regex_classes[regex_classes_len] = *cls;
+        regex_nodes[node].cls = regex_classes_len++;
+    }
+
+    return node;
+}
+
+int new_pair_node(int type, int left, int right)
+{
+    int node = new_regex_node(type);
+
+    if (node >= 0)
+    {
+        regex_nodes[node].left = left;
+        regex_nodes[node].right = right;
+    }
+
+    return node;
+}
+
+bool regex_more()
+{
+    return regex_pos < regex_len;
+}
+
+char regex_peek()
+{
+    return regex_text[regex_pos];
+}
+
+// Parse the escape after a backslash into a class. Returns false on error.
+bool parse_regex_escape(byte_class* cls)
+{
+    if (!regex_more())
+    {
+        regex_error = "Trailing backslash in regular expression";
+        return false;
+    }
+
+    char c = regex_text[regex_pos++];
+
+    switch (c)
+    {
+        case 'x':
+            if (regex_pos + 1 >= regex_len ||
+                !is_hex_digit(regex_text[regex_pos]) ||
+                !is_hex_digit(regex_text[regex_pos + 1]))
+            {
+                regex_error = "\\x must be followed by two hex digits";
+                return false;
+            }
+
+            class_add(cls, nibbles_to_byte(
+                    hex_to_nibble(tolower(regex_text[regex_pos])),
+                    hex_to_nibble(tolower(regex_text[regex_pos + 1]))));
+            regex_pos += 2;
+            return true;
+
+        case 'n': class_add(cls, '\n'); return true;
+        case 'r': class_add(cls, '\r'); return true;
+        case 't': class_add(cls, '\t'); return true;
+        case '0': class_add(cls, 0);    return true;
+
+        case 'd':
+        case 'D':
+        case 'w':
+        case 'W':
+        case 's':
+        case 'S':
+        {
+            byte_class named = {{0}};
+            char lower = tolower(c);
+
+            for (int byte = 0; byte < 256; byte++)
+            {
+                if ((lower == 'd' && isdigit(byte)) ||
+                    (lower == 'w' && (isalnum(byte) || byte == '_')) ||
+                    (lower == 's' && isspace(byte)))
+                {
+                    class_add(&named, byte);
+                }
+            }
+
+            for (int i = 0; i < 4; i++)
+            {
+                cls->bits[i] |= c == lower ? named.bits[i] : ~named.bits[i];
+            }
+
+            return true;
+        }
+
+        default:
+            class_add(cls, c);
+            return true;
+    }
+}
+
+// Parse one class endpoint (a literal or escaped byte). Returns the byte or
+// -1 on error.
+int parse_class_byte()
+{
+    if (regex_peek() != '\\')
+    {
+        return (unsigned char)regex_text[regex_pos++];
+    }
+
+    regex_pos++;
+
+    byte_class cls = {{0}};
+
+    if (!parse_regex_escape(&cls))
+    {
+        return -1;
+    }
+
+    int byte = class_single_byte(&cls);
+
+    if (byte < 0)
+    {
+        regex_error = "Class shorthand can't be a range endpoint";
+    }
+
+    return byte;
+}
+
+// Parse a [...] class, starting just after the [
+int parse_regex_class()
+{
+    byte_class cls = {{0}};
+    bool negate = false;
+
+    if (regex_more() && regex_peek() == '^')
+    {
+        negate = true;
+        regex_pos++;
+    }
+
+    bool first = true;
+
+    while (regex_more() && (regex_peek() != ']' || first))
+    {
+        first = false;
+
+        // Shorthand classes inside brackets
+        if (regex_peek() == '\\' && regex_pos + 1 < regex_len &&
+            strchr("dDwWsS", regex_text[regex_pos + 1]))
+        {
+            regex_pos++;
+            parse_regex_escape(&cls);
+            continue;
+        }
+
+        int low = parse_class_byte();
+
+        if (low < 0)
+        {
+            return -1;
+        }
+
+        int high = low;
+
+        if (regex_pos + 1 < regex_len && regex_peek() == '-' &&
+            regex_text[regex_pos + 1] != ']')
+        {
+            regex_pos++;
+
+            if ((high = parse_class_byte()) < 0)
+            {
+                return -1;
+            }
+
+            if (high < low)
+            {
+                regex_error = "Invalid range in byte class";
+                return -1;
+            }
+        }
+
+        class_add_range(&cls, low, high);
+    }
+
+    if (!regex_more())
+    {
+        regex_error = "Unterminated [ in regular expression";
+        return -1;
+    }
+
+    regex_pos++;
+
+    if (negate)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            cls.bits[i] = ~cls.bits[i];
+        }
+    }
+
+    return new_class_node(&cls);
+}
+
+int parse_regex_alternation();
+
+int parse_regex_atom()
+{
+    char c = regex_text[regex_pos++];
+    byte_class cls = {{0}};
+
+    switch (c)
+    {
+        case '(':
+        {
+            int inner = parse_regex_alternation();
+
+            if (inner < 0)
+            {
+                return -1;
+            }
+
+            if (!regex_more() || regex_peek() != ')')
+            {
+                regex_error = "Missing ) in regular expression";
+                return -1;
+            }
+
+            regex_pos++;
+            return inner;
+        }
+
+        case '[':
+            return parse_regex_class();
+
+        case '.':
+            class_add_range(&cls, 0, 255);
+            return new_class_node(&cls);
+
+        case '\\':
+            if (!parse_regex_escape(&cls))
+            {
+                return -1;
+            }
+
+            return new_class_node(&cls);
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case ')':
+            regex_error = "Unexpected character in regular expression";
+            return -1;
+
+        default:
+            class_add(&cls, c);
+            return new_class_node(&cls);
+    }
+}
+
+// Parse a decimal repeat count. Returns -1 if there isn't one.
+int parse_regex_count()
+{
+    if (!regex_more() || !isdigit(regex_peek()))
+    {
+        return -1;
+    }
+
+    int count = 0;
+
+    while (regex_more() && isdigit(regex_peek()))
+    {
+        count = count * 10 + regex_text[regex_pos++] - '0';
+
+        if (count > MAX_REGEX_REPEAT)
+        {
+            count = MAX_REGEX_REPEAT + 1;
+        }
+    }
+
+    return count;
+}
+
+int parse_regex_repeat()
+{
+    int node = parse_regex_atom();
+
+    while (node >= 0 && regex_more())
+    {
+        int min;
+        int max;
+        char c = regex_peek();
+
+        if (c == '*')
+        {
+            min = 0;
+            max = -1;
+        }
+        else if (c == '+')
+        {
+            min = 1;
+            max = -1;
+        }
+        else if (c == '?')
+        {
+            min = 0;
+            max = 1;
+        }
+        else if (c == '{')
+        {
+            regex_pos++;
+            min = parse_regex_count();
+            max = min;
+
+            if (regex_more() && regex_peek() == ',')
+            {
+                regex_pos++;
+                max = parse_regex_count();
+            }
+
+            if (min < 0 || !regex_more() || regex_peek() != '}' ||
+                (max >= 0 && max < min))
+            {
+                regex_error = "Invalid {} repetition";
+                return -1;
+            }
+
+            if (min > MAX_REGEX_REPEAT || max > MAX_REGEX_REPEAT)
+            {
+                regex_error = "Repetition count too large";
+                return -1;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        regex_pos++;
+
+        int repeat = new_regex_node(RE_REPEAT);
+
+        if (repeat < 0)
+        {
+            return -1;
+        }
+
+        regex_nodes[repeat].left = node;
+        regex_nodes[repeat].min = min;
+        regex_nodes[repeat].max = max;
+        node = repeat;
+    }
+
+    return node;
+}
+
+int parse_regex_concatenation()
+{
+    int node = new_regex_node(RE_EMPTY);
+
+    while (node >= 0 && regex_more() && regex_peek() != '|' &&
+           regex_peek() != ')')
+    {
+        int next = parse_regex_repeat();
+
+        if (next < 0)
+        {
+            return -1;
+        }
+
+        node = regex_nodes[node].type == RE_EMPTY ? next :
+               new_pair_node(RE_CONCAT, node, next);
+    }
+
+    return node;
+}
+
+int parse_regex_alternation()
+{
+    int node = parse_regex_concatenation();
+
+    while (node >= 0 && regex_more() && regex_peek() == '|')
+    {
+        regex_pos++;
+
+        int next = parse_regex_concatenation();
+
+        if (next < 0)
+        {
+            return -1;
+        }
+
+        node = new_pair_node(RE_ALTERNATE, node, next);
+    }
+
+    return node;
+}
+
+int add_nfa_state(regex_program* program, int type, int out, int out2,
+                  int cls)
+{
+    if (program->len >= MAX_NFA_STATES)
+    {
+        regex_error = "Regular expression too large";
+        return -1;
+    }
+
+    nfa_state* state = &program->states[program->len];
+    state->type = type;
+    state->out = out;
+    state->out2 = out2;
+    state->cls = cls;
+
+    return program->len++;
+}
+
+// A compiled piece of NFA: its entry state and an NFA_EMPTY exit state
+// whose out is patched to whatever follows.
+typedef struct
+{
+    int start;
+    int end;
+} nfa_fragment;
+
+bool compile_regex_node(regex_program* program, int node, bool reverse,
+                        nfa_fragment* fragment);
+
+// Compile node as optional (x?) into fragment
+bool compile_regex_optional(regex_program* program, int node, bool reverse,
+                            nfa_fragment* fragment)
+{
+    nfa_fragment inner;
+
+    if (!compile_regex_node(program, node, reverse, &inner))
+    {
+        return false;
+    }
+
+    int end = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+    int split = add_nfa_state(program, NFA_SPLIT, inner.start, end, 0);
+
+    if (split < 0)
+    {
+        return false;
+    }
+
+    program->states[inner.end].out = end;
+    fragment->start = split;
+    fragment->end = end;
+
+    return true;
+}
+
+bool compile_regex_node(regex_program* program, int node, bool reverse,
+                        nfa_fragment* fragment)
+{
+    regex_node* n = &regex_nodes[node];
+
+    switch (n->type)
+    {
+        case RE_EMPTY:
+        {
+            int end = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+            fragment->start = end;
+            fragment->end = end;
+            return end >= 0;
+        }
+
+        case RE_CLASS:
+        {
+            int end = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+            int byte = add_nfa_state(program, NFA_BYTE, end, -1, n->cls);
+            fragment->start = byte;
+            fragment->end = end;
+            return byte >= 0;
+        }
+
+        case RE_CONCAT:
+        {
+            nfa_fragment first;
+            nfa_fragment second;
+            int left = reverse ? n->right : n->left;
+            int right = reverse ? n->left : n->right;
+
+            if (!compile_regex_node(program, left, reverse, &first) ||
+                !compile_regex_node(program, right, reverse, &second))
+            {
+                return false;
+            }
+
+            program->states[first.end].out = second.start;
+            fragment->start = first.start;
+            fragment->end = second.end;
+            return true;
+        }
+
+        case RE_ALTERNATE:
+        {
+            nfa_fragment first;
+            nfa_fragment second;
+
+            if (!compile_regex_node(program, n->left, reverse, &first) ||
+                !compile_regex_node(program, n->right, reverse, &second))
+            {
+                return false;
+            }
+
+            int end = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+            int split = add_nfa_state(program, NFA_SPLIT, first.start,
+                                      second.start, 0);
+
+            if (split < 0)
+            {
+                return false;
+            }
+
+            program->states[first.end].out = end;
+            program->states[second.end].out = end;
+            fragment->start = split;
+            fragment->end = end;
+            return true;
+        }
+
+        case RE_REPEAT:
+        {
+            // x{min,max} becomes min copies of x followed by either a loop
+            // (unbounded) or max - min optional copies.
+            int start = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+            int end = start;
+
+            if (start < 0)
+            {
+                return false;
+            }
+
+            for (int i = 0; i < n->min; i++)
+            {
+                nfa_fragment copy;
+
+                if (!compile_regex_node(program, n->left, reverse, &copy))
+                {
+                    return false;
+                }
+
+                program->states[end].out = copy.start;
+                end = copy.end;
+            }
+
+            if (n->max < 0)
+            {
+                nfa_fragment body;
+
+                if (!compile_regex_node(program, n->left, reverse, &body))
+                {
+                    return false;
+                }
+
+                int exit = add_nfa_state(program, NFA_EMPTY, -1, -1, 0);
+                int loop = add_nfa_state(program, NFA_SPLIT, body.start, exit,
+                                         0);
+
+                if (loop < 0)
+                {
+                    return false;
+                }
+
+                program->states[body.end].out = loop;
+                program->states[end].out = loop;
+                end = exit;
+            }
+
+            for (int i = n->min; i < n->max; i++)
+            {
+                nfa_fragment optional;
+
+                if (!compile_regex_optional(program, n->left, reverse,
+                                            &optional))
+                {
+                    return false;
+                }
+
+                program->states[end].out = optional.start;
+                end = optional.end;
+            }
+
+            fragment->start = start;
+            fragment->end = end;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool compile_regex_program(regex_program* program, int root, bool reverse)
+{
+    free(program->states);
+    program->states = malloc(MAX_NFA_STATES * sizeof(nfa_state));
+    program->len = 0;
+
+    nfa_fragment body;
+
+    if (!compile_regex_node(program, root, reverse, &body))
+    {
+        return false;
+    }
+
+    int match = add_nfa_state(program, NFA_MATCH, -1, -1, 0);
+
+    // Unanchored entry: try a match here first, otherwise skip a byte
+    byte_class any;
+    memset(&any, 0xff, sizeof(any));
+
+    if (regex_classes_len >= MAX_REGEX_CLASSES)
+    {
+        regex_error = "Regular expression too large";
+        return false;
+    }
+
+    regex_classes[regex_classes_len] = any;
+
+    int loop = add_nfa_state(program, NFA_SPLIT, body.start, -1, 0);
+    int skip = add_nfa_state(program, NFA_BYTE, loop, -1, regex_classes_len);
+
+    if (skip < 0)
+    {
+        return false;
+    }
+
+    regex_classes_len++;
+
+    program->states[body.end].out = match;
+    program->states[loop].out2 = skip;
+    program->anchored = body.start;
+    program->unanchored = loop;
+
+    return true;
+}
+
+void free_regex_dfa(regex_dfa* dfa)
+{
+    free(dfa->transitions);
+    free(dfa->thread_start);
+    free(dfa->thread_len);
+    free(dfa->match);
+    free(dfa->threads);
+    free(dfa->table);
+    free(dfa->scratch);
+    free(dfa->stack);
+    free(dfa->visited);
+    memset(dfa, 0, sizeof(regex_dfa));
+}
+
+uint64_t hash_threads(const int* threads, int len)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (int i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint32_t)threads[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// Find or add the state for a thread list. Returns -1 if the cache is full.
+int dfa_state_for(regex_dfa* dfa, const int* threads, int len)
+{
+    int slot = hash_threads(threads, len) & (dfa->table_cap - 1);
+
+    while (dfa->table[slot])
+    {
+        int state = dfa->table[slot] - 1;
+
+        if (dfa->thread_len[state] == len &&
+            memcmp(&dfa->threads[dfa->thread_start[state]], threads,
+                   len * sizeof(int)) == 0)
+        {
+            return state;
+        }
+
+        slot = (slot + 1) & (dfa->table_cap - 1);
+    }
+
+    if (dfa->len >= MAX_DFA_STATES ||
+        dfa->threads_len + len > MAX_DFA_THREADS)
+    {
+        return -1;
+    }
+
+    int state = dfa->len++;
+
+    memcpy(&dfa->threads[dfa->threads_len], threads, len * sizeof(int));
+    dfa->thread_start[state] = dfa->threads_len;
+    dfa->thread_len[state] = len;
+    dfa->threads_len += len;
+    dfa->match[state] = false;
+
+    for (int i = 0; i < len; i++)
+    {
+        if (dfa->program->states[threads[i]].type == NFA_MATCH)
+        {
+            dfa->match[state] = true;
+        }
+    }
+
+    memset(&dfa->transitions[state * 256], 0xff, 256 * sizeof(int));
+    dfa->table[slot] = state + 1;
+
+    return state;
+}
+
+// Append the threads reachable from NFA state s without consuming a byte,
+// in priority order. Returns true if a match was reached and lower-priority
+// threads should be cut.
+bool add_closure(regex_dfa* dfa, int s, int* list, int* len)
+{
+    int top = 0;
+    dfa->stack[top++] = s;
+
+    while (top)
+    {
+        int state = dfa->stack[--top];
+
+        if (state < 0 || dfa->visited[state] == dfa->generation)
+        {
+            continue;
+        }
+
+        dfa->visited[state] = dfa->generation;
+        nfa_state* n = &dfa->program->states[state];
+
+        switch (n->type)
+        {
+            case NFA_EMPTY:
+                dfa->stack[top++] = n->out;
+                break;
+
+            case NFA_SPLIT:
+                // Push the lower-priority branch first so it's visited last
+                dfa->stack[top++] = n->out2;
+                dfa->stack[top++] = n->out;
+                break;
+
+            case NFA_BYTE:
+                list[(*len)++] = state;
+                break;
+
+            case NFA_MATCH:
+                list[(*len)++] = state;
+
+                if (dfa->cut_on_match)
+                {
+                    return true;
+                }
+
+                break;
+        }
+    }
+
+    return false;
+}
+
+int dfa_start_state(regex_dfa* dfa, int entry)
+{
+    int len = 0;
+    dfa->generation++;
+    add_closure(dfa, entry, dfa->scratch, &len);
+
+    return dfa_state_for(dfa, dfa->scratch, len);
+}
+
+// Empty the cache, keeping only the start states
+void flush_regex_dfa(regex_dfa* dfa)
+{
+    dfa->len = 0;
+    dfa->threads_len = 0;
+    memset(dfa->table, 0, dfa->table_cap * sizeof(int));
+
+    dfa->unanchored_start = dfa_start_state(dfa, dfa->program->unanchored);
+    dfa->anchored_start = dfa_start_state(dfa, dfa->program->anchored);
+}
+
+void init_regex_dfa(regex_dfa* dfa, regex_program* program, bool cut)
+{
+    free_regex_dfa(dfa);
+
+    dfa->program = program;
+    dfa->cut_on_match = cut;
+    dfa->transitions = malloc(MAX_DFA_STATES * 256 * sizeof(int));
+    dfa->thread_start = malloc(MAX_DFA_STATES * sizeof(int));
+    dfa->thread_len = malloc(MAX_DFA_STATES * sizeof(int));
+    dfa->match = malloc(MAX_DFA_STATES * sizeof(bool));
+    dfa->threads = malloc(MAX_DFA_THREADS * sizeof(int));
+    dfa->table_cap = MAX_DFA_STATES * 2;
+    dfa->table = calloc(dfa->table_cap, sizeof(int));
+    dfa->scratch = malloc(program->len * sizeof(int));
+    dfa->stack = malloc(program->len * 2 * sizeof(int));
+    dfa->visited = calloc(program->len, sizeof(unsigned));
+
+    flush_regex_dfa(dfa);
+}
+
+// Compute (and cache) the state reached from state on byte
+int compute_dfa_next(regex_dfa* dfa, int state, unsigned char byte)
+{
+    int next;
+    int len = 0;
+    int* threads = &dfa->threads[dfa->thread_start[state]];
+    dfa->generation++;
+
+    for (int i = 0; i < dfa->thread_len[state]; i++)
+    {
+        nfa_state* n = &dfa->program->states[threads[i]];
+
+        if (n->type == NFA_BYTE &&
+            class_has(&regex_classes[n->cls], byte) &&
+            add_closure(dfa, n->out, dfa->scratch, &len))
+        {
+            break;
+        }
+    }
+
+    next = dfa_state_for(dfa, dfa->scratch, len);
+
+    if (next < 0)
+    {
+        // Cache full: start over. The thread list is in scratch, which
+        // flushing overwrites, so keep a copy.
+        int* copy = malloc(len * sizeof(int) + 1);
+        memcpy(copy, dfa->scratch, len * sizeof(int));
+
+        flush_regex_dfa(dfa);
+        next = dfa_state_for(dfa, copy, len);
+
+        free(copy);
+        return next;
+    }
+
+    dfa->transitions[state * 256 + byte] = next;
+    return next;
+}
+
+int dfa_next(regex_dfa* dfa, int state, unsigned char byte)
+{
+    int next = dfa->transitions[state * 256 + byte];
+    return next >= 0 ? next : compute_dfa_next(dfa, state, byte);
+}
+
+// Collect the bytes every match must start with. Returns true if node is
+// entirely literal, so whatever follows it can extend the prefix.
+bool find_regex_prefix(int node)
+{
+    regex_node* n = &regex_nodes[node];
+
+    if (n->type == RE_CONCAT)
+    {
+        return find_regex_prefix(n->left) && find_regex_prefix(n->right);
+    }
+
+    if (n->type != RE_CLASS || regex_prefix_len >= MAX_SEARCH_TERM_LEN)
+    {
+        return false;
+    }
+
+    int byte = class_single_byte(&regex_classes[n->cls]);
+
+    if (byte < 0)
+    {
+        return false;
+    }
+
+    regex_prefix[regex_prefix_len] = byte;
+    regex_prefix_mask[regex_prefix_len] = 0xff;
+    regex_prefix_len++;
+
+    return true;
+}
+
+bool set_search_regex(const char* text, int len)
+{
+    regex_ready = false;
+    regex_text = text;
+    regex_pos = 0;
+    regex_len = len;
+    regex_error = NULL;
+    regex_nodes_len = 0;
+    regex_classes_len = 0;
+
+    int root = parse_regex_alternation();
+
+    if (root >= 0 && regex_more())
+    {
+        regex_error = "Unmatched ) in regular expression";
+    }
+
+    if (root < 0 || regex_error ||
+        !compile_regex_program(&regex_forward, root, false) ||
+        !compile_regex_program(&regex_reverse, root, true))
+    {
+        set_error(regex_error ? regex_error : "Invalid regular expression");
+        return false;
+    }
+
+    init_regex_dfa(&forward_dfa, &regex_forward, true);
+    init_regex_dfa(&reverse_longest_dfa, &regex_reverse, false);
+    init_regex_dfa(&reverse_dfa, &regex_reverse, true);
+
+    if (forward_dfa.match[forward_dfa.anchored_start])
+    {
+        set_error("Regular expression matches empty input");
+        return false;
+    }
+
+    regex_prefix_len = 0;
+    find_regex_prefix(root);
+
+    if (regex_prefix_len > 0)
+    {
+        compile_search(&regex_prefix_plan, regex_prefix, regex_prefix_mask,
+                       regex_prefix_len);
+    }
+
+    regex_ready = true;
+    return true;
+}
+
+// DFA steps taken by regex_find_forward(), so callers can bound their work
+int64_t regex_steps = 0;
+
+// Find the leftmost match within [start, end). Returns false if none.
+bool regex_find_forward(int64_t start, int64_t end, int64_t* match_start,
+                        int64_t* match_end)
+{
+    regex_dfa* dfa = &forward_dfa;
+    int state = dfa->unanchored_start;
+    int64_t last_end = -1;
+    int64_t len = 0;
+    unsigned char* data = NULL;
+
+    for (int64_t i = start; i < end; i++, data++, len--)
+    {
+        if (!len)
+        {
+            data = contiguous(i, &len);
+            len = len < end - i ? len : end - i;
+        }
+
+        // Nothing in progress: skip straight to the next possible start
+        if (state == dfa->unanchored_start && regex_prefix_len > 0)
+        {
+            int64_t skip = find_in(data, len, &regex_prefix_plan, true);
+
+            if (skip < 0)
+            {
+                if (i + len == end)
+                {
+                    break;
+                }
+
+                // The prefix may begin in the last few bytes of this piece
+                // and carry on into the next
+                skip = len - regex_prefix_len;
+                skip = skip > 0 ? skip : 0;
+            }
+
+            i += skip;
+            data += skip;
+            len -= skip;
+        }
+
+        state = dfa_next(dfa, state, *data);
+        regex_steps++;
+
+        if (dfa->match[state])
+        {
+            last_end = i + 1;
+        }
+
+        if (!dfa->thread_len[state])
+        {
+            break;
+        }
+    }
+
+    if (last_end < 0)
+    {
+        return false;
+    }
+
+    // Walk back from the end to find where the match starts
+    dfa = &reverse_longest_dfa;
+    state = dfa->anchored_start;
+    *match_start = last_end;
+    len = 0;
+
+    for (int64_t i = last_end - 1; i >= start; i--, data--, len--)
+    {
+        if (!len)
+        {
+            data = contiguous_before(i + 1, &len) + len - 1;
+        }
+
+        state = dfa_next(dfa, state, *data);
+        regex_steps++;
+
+        if (dfa->match[state])
+        {
+            *match_start = i;
+        }
+
+        if (!dfa->thread_len[state])
+        {
+            break;
+        }
+    }
+
+    *match_end = last_end;
+    return true;
+}
+
+// Find the start of the match ending last within [start, end).
+// Returns -1 if none.
+int64_t regex_find_backward(int64_t start, int64_t end)
+{
+    regex_dfa* dfa = &reverse_dfa;
+    int state = dfa->unanchored_start;
+    int64_t found = -1;
+    int64_t len = 0;
+    unsigned char* data = NULL;
+
+    for (int64_t i = end - 1; i >= start; i--, data--, len--)
+    {
+        if (!len)
+        {
+            data = contiguous_before(i + 1, &len) + len - 1;
+        }
+
+        state = dfa_next(dfa, state, *data);
+
+        if (dfa->match[state])
+        {
+            found = i;
+        }
+
+        if (!dfa->thread_len[state])
+        {
+            break;
+        }
+    }
+
+    return found;
+}
+
+// The match n / N last moved to, for the detail pane
+int64_t regex_match_start = -1;
+int64_t regex_match_end = -1;
+
+void handle_regex_search(bool forward)
+{
+    if (!regex_ready)
+    {
+        return;
+    }
+
+    int64_t start;
+    int64_t end;
+    bool found;
+
+    advise_source(MADV_SEQUENTIAL);
+
+    if (forward)
+    {
+        // From just after the cursor to the end, then wrap around
+        found = regex_find_forward(cursor_byte + 1, source_len, &start, &end) ||
+                (regex_find_forward(0, source_len, &start, &end) &&
+                 start < cursor_byte);
+    }
+    else
+    {
+        // Matches ending before the cursor, then wrap around to the end
+        start = regex_find_backward(0, cursor_byte);
+
+        if (start < 0)
+        {
+            start = regex_find_backward(cursor_byte + 1, source_len);
+        }
+
+        found = start >= 0 && regex_find_forward(start, source_len, &start,
+                                                 &end);
+    }
+
+    advise_source(MADV_RANDOM);
+
+    if (!found)
+    {
+        set_error("Regular expression not found");
+        return;
+    }
+
+    regex_match_start = start;
+    regex_match_end = end;
+    jump_to_match(start);
+}
+
+
+// Called whenever removed bytes at offset are replaced by inserted new ones
+// (the same number when bytes are overwritten)
+void bytes_changed(int64_t offset, int64_t removed, int64_t inserted)
+{
+    repair_match_index(offset, removed, inserted);
+    repair_signature_hits(offset, removed, inserted);
+    repair_minimap(offset, removed, inserted);
+    diff_counted = false;
+}
+
+void handle_search_next()
+{
+    if (search_mode == SEARCH_REGEX)
+    {
+        handle_regex_search(true);
+        return;
+    }
+
+    if (search_mode == SEARCH_SIGNATURES)
+    {
+        if (!signature_hits_len)
+        {
+            set_error("No signature hits");
+            return;
+        }
+
+        int64_t next = first_hit_from(cursor_byte + 1);
+        jump_to_match(signature_hits[next < signature_hits_len ? next : 0]
+                      .offset);
+        return;
+    }
+
+    if (!search_term_len)
+    {
+        return;
+    }
+
+    if (match_index_ready)
+    {
+        int64_t next = lower_bound(&match_index, cursor_byte + 1);
+
+        if (next == match_index.len)
+        {
+            next = 0;
+        }
+
+        if (!match_index.len || match_index.offsets[next] == cursor_byte)
+        {
+            set_error("Search term not found");
+            return;
+        }
+
+        jump_to_match(match_index.offsets[next]);
+        return;
+    }
+
+    advise_source(MADV_SEQUENTIAL);
+
+    // Search from just after the cursor to the end, then wrap around
+    int64_t match = search_range(cursor_byte + 1, source_len, true);
+
+    if (match < 0)
+    {
+        match = search_range(0, cursor_byte, true);
+    }
+
+    advise_source(MADV_RANDOM);
+
+    if (match < 0)
+    {
+        set_error("Search term not found");
+        return;
+    }
+
+    jump_to_match(match);
+}
+
+void handle_search_previous()
+{
+    if (search_mode == SEARCH_REGEX)
+    {
+        handle_regex_search(false);
+        return;
+    }
+
+    if (search_mode == SEARCH_SIGNATURES)
+    {
+        if (!signature_hits_len)
+        {
+            set_error("No signature hits");
+            return;
+        }
+
+        int64_t previous = first_hit_from(cursor_byte) - 1;
+        jump_to_match(signature_hits[previous >= 0 ? previous :
+                                     signature_hits_len - 1].offset);
+        return;
+    }
+
+    if (!search_term_len)
+    {
+        return;
+    }
+
+    if (match_index_ready)
+    {
+        int64_t previous = lower_bound(&match_index, cursor_byte) - 1;
+
+        if (previous < 0)
+        {
+            previous = match_index.len - 1;
+        }
+
+        if (!match_index.len || match_index.offsets[previous] == cursor_byte)
+        {
+            set_error("Search term not found");
+            return;
+        }
+
+        jump_to_match(match_index.offsets[previous]);
+        return;
+    }
+
+    advise_source(MADV_SEQUENTIAL);
+
+    // Search back from just before the cursor, then wrap around to the end
+    int64_t match = search_range(0, cursor_byte, false);
+
+    if (match < 0)
+    {
+        match = search_range(cursor_byte + 1, source_len, false);
+    }
+
+    advise_source(MADV_RANDOM);
+
+    if (match < 0)
+    {
+        set_error("Search term not found");
+        return;
+    }
+
+    jump_to_match(match);
+}
+
+void handle_set_command()
+{
+    char* option = command + 5;
+
+    if (strncmp(option, "threads=", 8) == 0)
+    {
+        int threads = atoi(option + 8);
+
+        if (threads < 1)
+        {
+            set_error("Thread count must be at least 1");
+            return;
+        }
+
+        set_worker_threads(threads);
+    }
+    else if (strncmp(option, "scrolloff=", 10) == 0)
+    {
+        int lines = atoi(option + 10);
+
+        if (lines < 0)
+        {
+            set_error("Scroll offset can't be negative");
+            return;
+        }
+
+        scroll_off = lines;
+    }
+    else if (strcmp(option, "fsync") == 0)
+    {
+        fsync_on_write = true;
+    }
+    else if (strcmp(option, "nofsync") == 0)
+    {
+        fsync_on_write = false;
+    }
+    else if (strcmp(option, "inplace") == 0)
+    {
+        save_in_place = true;
+    }
+    else if (strcmp(option, "noinplace") == 0)
+    {
+        save_in_place = false;
+    }
+    else if (strcmp(option, "minimap") == 0)
+    {
+        show_minimap(true);
+    }
+    else if (strcmp(option, "nominimap") == 0)
+    {
+        show_minimap(false);
+    }
+    else
+    {
+        set_error("Unknown option");
+    }
+}
+
+bool handle_selection_command();
+
+void handle_submit_command()
+{
+    command[command_len] = 0;
+    command_entering = false;
+
+    if (strncmp(command, "/re:", 4) == 0)
+    {
+        search_mode = SEARCH_REGEX;
+        regex_match_start = -1;
+
+        if (set_search_regex(&command[4], command_len - 4))
+        {
+            handle_search_next();
+        }
+
+        return;
+    }
+
+    if (command[0] == '/')
+    {
+        search_mode = SEARCH_PATTERN;
+        stop_match_index();
+        set_search_term(&command[1], command_len - 1);
+        start_match_index();
+        handle_search_next();
+        return;
+    }
+
+    if (strncmp(command, ":q", MAX_COMMAND_LEN) == 0)
+    {
+        quit();
+        return;
+    }
+
+    if (strncmp(command, ":set ", 5) == 0)
+    {
+        handle_set_command();
+        return;
+    }
+
+    if (strncmp(command, ":sigscan ", 9) == 0)
+    {
+        handle_sigscan();
+        return;
+    }
+
+    if (strcmp(command, ":sigs") == 0)
+    {
+        handle_sig_list();
+        return;
+    }
+
+    if (strncmp(command, ":hash ", 6) == 0)
+    {
+        handle_hash();
+        return;
+    }
+
+    if (strcmp(command, ":stats") == 0)
+    {
+        show_stats(!stats_shown);
+        return;
+    }
+
+    if (handle_selection_command())
+    {
+        return;
+    }
+
+    if (command[1] == 'w')
+    {
+        handle_write();
+        return;
+    }
+
+    handle_jump_offset();
+}
+
+void handle_backspace_command()
+{
+    if (command_len == 1)
+    {
+        handle_cancel_command();
+        return;
+    }
+
+    command_len--;
+}
+
+void handle_add_to_command(int event)
+{
+    if (event < 32 || event > '~')
+    {
+        return;
+    }
+
+    if (command_len >= MAX_COMMAND_LEN)
+    {
+        return;
+    }
+
+    command[command_len++] = event;
+}
+
+void handle_command_event(int event)
+{
+    switch (event)
+    {
+        case KEY_ESC:    handle_cancel_command();      break;
+        case KEY_RETURN: handle_submit_command();      break;
+        case KEY_DELETE: handle_backspace_command();   break;
+        default:         handle_add_to_command(event); break;
+    }
+}
+
+void render_command()
+{
+    if (!command_entering)
+    {
+        return;
+    }
+
+    int start = 0;
+    int len = command_len;
+
+    // Scroll command horizontally
+    if (command_len >= max_x - 1)
+    {
+        start = command_len - max_x + 1;
+        len = max_x - 1;
+    }
+
+    move(max_y - 1, 0);
+
+    // Print command to screen
+    for (int i = 0; i < len; i++)
+    {
+        addch(command[start + i]);
+    }
+
+    // Clear the rest of the command line
+    for (int i = len; i < max_x; i++)
+    {
+        addch(' ');
+    }
+}
+
+void handle_key_left()
+{
+    if (cursor_nibble == 1)
+    {
+        cursor_nibble = 0;
+    }
+    else
+    {
+        cursor_nibble = 1;
+        cursor_byte--;
+    }
+}
+
+void handle_key_right()
+{
+    if (cursor_nibble == 0)
+    {
+        cursor_nibble = 1;
+    }
+    else
+    {
+        cursor_nibble = 0;
+        cursor_byte++;
+    }
+}
+
+void handle_key_up()
+{
+    int64_t temp = cursor_byte - bytes_per_line();
+
+    if (temp >= 0)
+    {
+        cursor_byte = temp;
+    }
+}
+
+void handle_key_down()
+{
+    int64_t temp = cursor_byte + bytes_per_line();
+
+    if (temp < source_len)
+    {
+        cursor_byte = temp;
+    }
+}
+
+void handle_previous_byte()
+{
+    cursor_byte--;
+}
+
+void handle_next_byte()
+{
+    cursor_byte++;
+}
+
+// Transforms (see TRANSFORM_*) are applied to the bytes where they're
+// stored, a span of the buffer at a time, by kernels that read the key from
+// a tile: the key repeated from the start of the range over a multiple of
+// its length and TRANSFORM_STEP of at least TRANSFORM_TILE_MIN bytes, plus
+// one more step, so a whole step of key can be read at any phase below the
+// tile's length. Fills copy the tile.
+
+#define TRANSFORM_STEP 64
+#define TRANSFORM_TILE_MIN 4096
+#define MAX_TRANSFORM_TILE (TRANSFORM_TILE_MIN + \
+                            (MAX_TRANSFORM_KEY + 1) * TRANSFORM_STEP)
+
+// Apply op to len bytes of data, starting at phase in the tile
+typedef void (*transform_kernel)(int op, unsigned char* data, int64_t len,
+                                 const unsigned char* tile, int64_t tile_len,
+                                 int64_t phase);
+
+// Reverse the bytes of count words of width bytes each
+typedef void (*swap_kernel)(unsigned char* data, int64_t count, int width);
+
+transform_kernel transform_span = NULL;
+swap_kernel swap_words = NULL;
+
+// Add bytes without carrying into the next one
+uint64_t add_bytes_scalar(uint64_t value, uint64_t key)
+{
+    uint64_t high = 0x8080808080808080ULL;
+    return ((value & ~high) + (key & ~high)) ^ ((value ^ key) & high);
+}
+
+// The loop of transform_scalar for one op, 8 bytes at a time
+#define TRANSFORM_LOOP_SCALAR(result) \
+    for (; i + 8 <= len; i += 8) \
+    { \
+        uint64_t value; \
+        uint64_t key; \
+        memcpy(&value, data + i, 8); \
+        memcpy(&key, tile + phase, 8); \
+        value = (result); \
+        memcpy(data + i, &value, 8); \
+        phase = phase + 8 < tile_len ? phase + 8 : phase + 8 - tile_len; \
+    }
+
+void transform_scalar(int op, unsigned char* data, int64_t len,
+                      const unsigned char* tile, int64_t tile_len,
+                      int64_t phase)
+{
+    int64_t i = 0;
+
+    switch (op)
+    {
+        case TRANSFORM_FILL:
+            while (i < len)
+            {
+                int64_t copied = tile_len - phase < len - i ?
+                                 tile_len - phase : len - i;
+                memcpy(data + i, tile + phase, copied);
+                i += copied;
+                phase = 0;
+            }
+            return;
+
+        case TRANSFORM_XOR:
+            TRANSFORM_LOOP_SCALAR(value ^ key);
+            break;
+
+        case TRANSFORM_AND:
+            TRANSFORM_LOOP_SCALAR(value & key);
+            break;
+
+        case TRANSFORM_OR:
+            TRANSFORM_LOOP_SCALAR(value | key);
+            break;
+
+        case TRANSFORM_ADD:
+            TRANSFORM_LOOP_SCALAR(add_bytes_scalar(value, key));
+            break;
+    }
+
+    for (; i < len; i++)
+    {
+        unsigned char key = tile[phase];
+
+        switch (op)
+        {
+            case TRANSFORM_FILL:
+                data[i] = key;
+                break;
+
+            case TRANSFORM_XOR:
+                data[i] ^= key;
+                break;
+
+            case TRANSFORM_AND:
+                data[i] &= key;
+                break;
+
+            case TRANSFORM_OR:
+                data[i] |= key;
+                break;
+
+            case TRANSFORM_ADD:
+                data[i] += key;
+                break;
+        }
+
+        phase = phase + 1 < tile_len ? phase + 1 : 0;
+    }
+}
+
+#undef TRANSFORM_LOOP_SCALAR
+
+void swap_words_scalar(unsigned char* data, int64_t count, int width)
+{
+    for (int64_t i = 0; i < count; i++, data += width)
+    {
+        for (int j = 0; j < width / 2; j++)
+        {
+            unsigned char byte = data[j];
+            data[j] = data[width - 1 - j];
+            data[width - 1 - j] = byte;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// The loop of transform_avx2 for one op (an intrinsic combining bytes with
+// the key), a step of two vectors at a time
+#define TRANSFORM_LOOP_AVX2(combine) \
+    for (; i + TRANSFORM_STEP <= len; i += TRANSFORM_STEP) \
+    { \
+        __m256i* low = (__m256i*)(data + i); \
+        __m256i* high = (__m256i*)(data + i + 32); \
+        _mm256_storeu_si256(low, combine(_mm256_loadu_si256(low), \
+                _mm256_loadu_si256((const __m256i*)(tile + phase)))); \
+        _mm256_storeu_si256(high, combine(_mm256_loadu_si256(high), \
+                _mm256_loadu_si256((const __m256i*)(tile + phase + 32)))); \
+        phase += TRANSFORM_STEP; \
+        phase = phase < tile_len ? phase : phase - tile_len; \
+    }
+
+__attribute__((target("avx2")))
+void transform_avx2(int op, unsigned char* data, int64_t len,
+                    const unsigned char* tile, int64_t tile_len,
+                    int64_t phase)
+{
+    int64_t i = 0;
+
+    // Fills are left to memcpy
+    switch (op)
+    {
+        case TRANSFORM_XOR:
+            TRANSFORM_LOOP_AVX2(_mm256_xor_si256);
+            break;
+
+        case TRANSFORM_AND:
+            TRANSFORM_LOOP_AVX2(_mm256_and_si256);
+            break;
+
+        case TRANSFORM_OR:
+            TRANSFORM_LOOP_AVX2(_mm256_or_si256);
+            break;
+
+        case TRANSFORM_ADD:
+            TRANSFORM_LOOP_AVX2(_mm256_add_epi8);
+            break;
+    }
+
+    transform_scalar(op, data + i, len - i, tile, tile_len, phase);
+}
+
+#undef TRANSFORM_LOOP_AVX2
+
+__attribute__((target("avx2")))
+void swap_words_avx2(unsigned char* data, int64_t count, int width)
+{
+    // Swapped words never cross the 16-byte lanes of the shuffle
+    unsigned char order[32];
+
+    for (int i = 0; i < 32; i++)
+    {
+        order[i] = i - i % width + width - 1 - i % width;
+    }
+
+    __m256i shuffle = _mm256_loadu_si256((const __m256i*)order);
+    int64_t len = count * width;
+    int64_t i = 0;
+
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i),
+                            _mm256_shuffle_epi8(value, shuffle));
+    }
+
+    swap_words_scalar(data + i, (len - i) / width, width);
+}
+
+#endif
+
+void select_transform_kernels()
+{
+    transform_span = transform_scalar;
+    swap_words = swap_words_scalar;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        transform_span = transform_avx2;
+        swap_words = swap_words_avx2;
+    }
+#endif
+}
+
+bool valid_transform(const transform* t, int64_t len)
+{
+    if (t->op == TRANSFORM_SWAP)
+    {
+        return (t->key_len == 2 || t->key_len == 4 || t->key_len == 8) &&
+               len % t->key_len == 0;
+    }
+
+    return t->op >= TRANSFORM_FILL && t->op <= TRANSFORM_ADD &&
+           t->key_len >= 1 && t->key_len <= MAX_TRANSFORM_KEY;
+}
+
+// Whether the bytes before t can be worked out from the bytes after
+bool transform_reversible(const transform* t)
+{
+    return t->op == TRANSFORM_XOR || t->op == TRANSFORM_ADD ||
+           t->op == TRANSFORM_SWAP;
+}
+
+// The transform undoing a reversible one
+transform inverse_transform(const transform* t)
+{
+    transform inverse = *t;
+
+    if (t->op == TRANSFORM_ADD)
+    {
+        for (int i = 0; i < t->key_len; i++)
+        {
+            inverse.key[i] = -t->key[i];
+        }
+    }
+
+    return inverse;
+}
+
+// Fill in the tile for t's key (see above), returning its length
+int64_t make_transform_tile(const transform* t, unsigned char* tile)
+{
+    int64_t tile_len = t->key_len;
+
+    while (tile_len % TRANSFORM_STEP || tile_len < TRANSFORM_TILE_MIN)
+    {
+        tile_len += t->key_len;
+    }
+
+    for (int64_t i = 0; i < tile_len + TRANSFORM_STEP; i++)
+    {
+        tile[i] = t->key[i % t->key_len];
+    }
+
+    return tile_len;
+}
+
+// Apply t to len bytes at offset without journaling it
+void apply_transform(int64_t offset, int64_t len, const transform* t)
+{
+    if (!transform_span)
+    {
+        select_transform_kernels();
+    }
+
+    unsigned char tile[MAX_TRANSFORM_TILE];
+    int64_t tile_len = t->op == TRANSFORM_SWAP ? 0 :
+                       make_transform_tile(t, tile);
+    int width = t->key_len;
+
+    stop_hash();
+    stop_minimap();
+
+    for (int64_t done = 0; done < len; )
+    {
+        int64_t available;
+        unsigned char* data = contiguous(offset + done, &available);
+
+        if (!available)
+        {
+            break;
+        }
+
+        if (available > len - done)
+        {
+            available = len - done;
+        }
+
+        if (!prepare_write(data, available))
+        {
+            return;
+        }
+
+        if (t->op != TRANSFORM_SWAP)
+        {
+            transform_span(t->op, data, available, tile, tile_len,
+                           done % tile_len);
+            done += available;
+            continue;
+        }
+
+        // Skip the rest of a word split between pieces, which was swapped
+        // through a copy along with its first part
+        int64_t skip = (width - done % width) % width;
+
+        if (skip < available)
+        {
+            int64_t count = (available - skip) / width;
+            int64_t split = done + skip + count * width;
+
+            swap_words(data + skip, count, width);
+
+            if (split < done + available)
+            {
+                unsigned char word[8];
+                read_bytes(offset + split, word, width);
+                swap_words(word, 1, width);
+                write_bytes(offset + split, word, width);
+            }
+        }
+
+        done += available;
+    }
+
+    log_transform(offset, len, t);
+    bytes_changed(offset, len, len);
+}
+
+// Undo journal. An overwrite record is a run of changed bytes; what they
+// held before and after the change is kept at the same index in
+// journal_old and journal_new. Consecutive typed (or pasted) nibbles extend
+// the same record, so memory grows with the number of bytes edited, not
+// with the file size. Insert and delete records keep the pieces they took
+// out of the buffer (deleted bytes, or inserted ones once undone) so they
+// can be put back without copying. A transform record keeps just the
+// transform, and the bytes before it only when it can't be reversed (fills,
+// ANDs and ORs). Records made between two end_edit_group() calls share a
+// group and are undone together.
+typedef struct
+{
+    int kind;
+    int64_t group;
+    int64_t offset;
+    int64_t len;
+    int64_t bytes;  // overwrites: index into journal_old / journal_new
+    piece* pieces;  // inserts and deletes: the bytes out of the buffer
+    transform transform;
+    unsigned char* saved;  // irreversible transforms: the bytes before
+} journal_record;
+
+journal_record* journal = NULL;
+int64_t journal_len = 0;    // records that can be undone
+int64_t journal_count = 0;  // including those that can be redone
+int64_t journal_cap = 0;
+
+unsigned char* journal_old = NULL;
+unsigned char* journal_new = NULL;
+int64_t journal_bytes_len = 0;
+int64_t journal_bytes_cap = 0;
+
+// Whether the next change may extend the last record
+bool journal_group_open = false;
+int64_t journal_group = 0;
+
+void end_edit_group()
+{
+    if (journal_group_open)
+    {
+        journal_group++;
+    }
+
+    journal_group_open = false;
+}
+
+// The last record, if the next change can be merged into it
+journal_record* open_record(int kind)
+{
+    journal_record* last = journal_len ? &journal[journal_len - 1] : NULL;
+
+    return journal_group_open && last && last->kind == kind &&
+           journal_count == journal_len ? last : NULL;
+}
+
+// Start a new record, discarding anything that could have been redone
+journal_record* add_record(int kind, int64_t offset)
+{
+    if (journal_count > journal_len)
+    {
+        for (int64_t i = journal_len; i < journal_count; i++)
+        {
+            free_pieces(journal[i].pieces);
+            free(journal[i].saved);
+        }
+
+        journal_count = journal_len;
+        journal_bytes_len = 0;
+
+        for (int64_t i = journal_len - 1; i >= 0; i--)
+        {
+            if (journal[i].kind == CHANGE_OVERWRITE)
+            {
+                journal_bytes_len = journal[i].bytes + journal[i].len;
+                break;
+            }
+        }
+    }
+
+    if (journal_len == journal_cap)
+    {
+        journal_cap = journal_cap ? journal_cap * 2 : 64;
+        journal = realloc(journal, journal_cap * sizeof(journal_record));
+    }
+
+    journal_record* record = &journal[journal_len++];
+    record->kind = kind;
+    record->group = journal_group;
+    record->offset = offset;
+    record->len = 0;
+    record->bytes = journal_bytes_len;
+    record->pieces = NULL;
+    record->saved = NULL;
+    journal_count = journal_len;
+    journal_group_open = true;
+
+    return record;
+}
+
+void record_change(int64_t offset, const unsigned char* bytes, int64_t len)
+{
+    journal_record* last = open_record(CHANGE_OVERWRITE);
+
+    if (!last || offset < last->offset || offset > last->offset + last->len)
+    {
+        last = add_record(CHANGE_OVERWRITE, offset);
+    }
+
+    if (journal_bytes_len + len > journal_bytes_cap)
+    {
+        journal_bytes_cap = (journal_bytes_len + len) * 2;
+        journal_old = realloc(journal_old, journal_bytes_cap);
+        journal_new = realloc(journal_new, journal_bytes_cap);
+    }
+
+    // Bytes already in the record only get their new value; the old
+    // values of the rest are read in one go
+    int64_t at = offset - last->offset;
+    int64_t added = at + len > last->len ? at + len - last->len : 0;
+
+    read_bytes(offset + len - added, &journal_old[last->bytes + last->len],
+               added);
+    memcpy(&journal_new[last->bytes + at], bytes, len);
+    last->len += added;
+    journal_bytes_len += added;
+}
+
+// Write bytes into the buffer without journaling them
+void apply_bytes(int64_t offset, const unsigned char* bytes, int64_t len)
+{
+    stop_hash();
+    stop_minimap();
+    write_bytes(offset, bytes, len);
+    log_change(CHANGE_OVERWRITE, offset, len);
+    bytes_changed(offset, len, len);
+}
+
+// Change bytes in the buffer (which must be writable), recording the change
+// so it can be undone
+void change_bytes(int64_t offset, const unsigned char* bytes, int64_t len)
+{
+    record_change(offset, bytes, len);
+    apply_bytes(offset, bytes, len);
+}
+
+// The match index builder reads the buffer from another thread, so it's
+// paused while pieces are rearranged, as are the minimap (which picks up
+// again afterwards) and a hash (stopped for good). Returns whether the
+// builder was running.
+bool begin_structure_change()
+{
+    bool building = match_index_building;
+    pause_match_index();
+    stop_minimap();
+    stop_hash();
+    return building;
+}
+
+void end_structure_change(bool building, int kind, int64_t offset,
+                          int64_t len)
+{
+    log_change(kind, offset, len);
+    bytes_changed(offset, kind == CHANGE_DELETE ? len : 0,
+                  kind == CHANGE_INSERT ? len : 0);
+
+    if (building)
+    {
+        resume_match_index();
+    }
+}
+
+// Put a tree of pieces into the buffer at offset without journaling it
+void apply_insert(int64_t offset, piece* inserted)
+{
+    bool building = begin_structure_change();
+    int64_t len = piece_total(inserted);
+
+    piece* before;
+    piece* after;
+    split_pieces(pieces, offset, &before, &after);
+    pieces = merge_pieces(merge_pieces(before, inserted), after);
+    source_len += len;
+
+    end_structure_change(building, CHANGE_INSERT, offset, len);
+}
+
+// Take len bytes at offset out of the buffer without journaling it.
+// Returns their pieces.
+piece* apply_delete(int64_t offset, int64_t len)
+{
+    bool building = begin_structure_change();
+
+    piece* before;
+    piece* rest;
+    piece* removed;
+    piece* after;
+    split_pieces(pieces, offset, &before, &rest);
+    split_pieces(rest, len, &removed, &after);
+    pieces = merge_pieces(before, after);
+    source_len -= len;
+
+    end_structure_change(building, CHANGE_DELETE, offset, len);
+    return removed;
+}
+
+// Insert bytes at offset, recording the change so it can be undone
+void insert_bytes(int64_t offset, const unsigned char* bytes, int64_t len)
+{
+    journal_record* last = open_record(CHANGE_INSERT);
+
+    if (!last || offset != last->offset + last->len)
+    {
+        last = add_record(CHANGE_INSERT, offset);
+    }
+
+    last->len += len;
+
+    bool building = begin_structure_change();
+
+    // Bytes typed one after another extend the same piece
+    unsigned char* data = append_bytes(bytes, len);
+    piece* before;
+    piece* after;
+    split_pieces(pieces, offset, &before, &after);
+
+    if (!extend_last_piece(before, data, len))
+    {
+        before = merge_pieces(before, new_piece(data, len));
+    }
+
+    pieces = merge_pieces(before, after);
+    source_len += len;
+
+    end_structure_change(building, CHANGE_INSERT, offset, len);
+}
+
+// Delete len bytes at offset, recording the change so it can be undone
+void delete_bytes(int64_t offset, int64_t len)
+{
+    if (len > source_len - offset)
+    {
+        len = source_len - offset;
+    }
+
+    if (offset < 0 || len <= 0)
+    {
+        return;
+    }
+
+    journal_record* record = add_record(CHANGE_DELETE, offset);
+    record->len = len;
+    record->pieces = apply_delete(offset, len);
+}
+
+// Apply t to len bytes at offset, recording it so it can be undone
+void transform_bytes(int64_t offset, int64_t len, const transform* t)
+{
+    unsigned char* saved = NULL;
+
+    if (!transform_reversible(t))
+    {
+        saved = malloc(len);
+
+        if (!saved)
+        {
+            set_error("Not enough memory to keep the change for undo");
+            return;
+        }
+
+        read_bytes(offset, saved, len);
+    }
+
+    journal_record* record = add_record(CHANGE_TRANSFORM, offset);
+    record->len = len;
+    record->transform = *t;
+    record->saved = saved;
+
+    apply_transform(offset, len, t);
+}
+
+void undo_record(journal_record* record)
+{
+    switch (record->kind)
+    {
+        case CHANGE_OVERWRITE:
+            apply_bytes(record->offset, journal_old + record->bytes,
+                        record->len);
+            break;
+
+        case CHANGE_INSERT:
+            record->pieces = apply_delete(record->offset, record->len);
+            break;
+
+        case CHANGE_DELETE:
+            apply_insert(record->offset, record->pieces);
+            record->pieces = NULL;
+            break;
+
+        case CHANGE_TRANSFORM:
+            if (record->saved)
+            {
+                apply_bytes(record->offset, record->saved, record->len);
+            }
+            else
+            {
+                transform inverse = inverse_transform(&record->transform);
+                apply_transform(record->offset, record->len, &inverse);
+            }
+            break;
+    }
+}
+
+void redo_record(journal_record* record)
+{
+    switch (record->kind)
+    {
+        case CHANGE_OVERWRITE:
+            apply_bytes(record->offset, journal_new + record->bytes,
+                        record->len);
+            break;
+
+        case CHANGE_INSERT:
+            apply_insert(record->offset, record->pieces);
+            record->pieces = NULL;
+            break;
+
+        case CHANGE_DELETE:
+            record->pieces = apply_delete(record->offset, record->len);
+            break;
+
+        case CHANGE_TRANSFORM:
+            apply_transform(record->offset, record->len, &record->transform);
+            break;
+    }
+}
+
+void handle_undo()
+{
+    end_edit_group();
+
+    if (!journal_len)
+    {
+        set_error("Already at oldest change");
+        return;
+    }
+
+    int64_t group = journal[journal_len - 1].group;
+
+    while (journal_len && journal[journal_len - 1].group == group)
+    {
+        undo_record(&journal[--journal_len]);
+    }
+
+    cursor_byte = journal[journal_len].offset;
+    cursor_nibble = 0;
+}
+
+void handle_redo()
+{
+    end_edit_group();
+
+    if (journal_len == journal_count)
+    {
+        set_error("Already at newest change");
+        return;
+    }
+
+    int64_t group = journal[journal_len].group;
+    journal_record* first = &journal[journal_len];
+
+    while (journal_len < journal_count && journal[journal_len].group == group)
+    {
+        redo_record(&journal[journal_len++]);
+    }
+
+    cursor_byte = first->offset;
+    cursor_nibble = 0;
+}
+
+// Open the recovery log for filename, first replaying it if an earlier
+// session left changes behind.
+void open_recovery_log(const char* filename)
+{
+    recovery_filename = malloc(strlen(filename) + 10);
+    sprintf(recovery_filename, "%s.recovery", filename);
+
+    int fd = open(recovery_filename, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    recovery_base base;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !find_recovery_base(filename, &base))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        set_error("Error opening recovery log");
+        return;
+    }
+
+    if (st.st_size == 0)
+    {
+        unsigned char header[RECOVERY_HEADER_LEN];
+        memcpy(header, RECOVERY_MAGIC, sizeof(RECOVERY_MAGIC) - 1);
+        memcpy(header + sizeof(RECOVERY_MAGIC) - 1, &base, sizeof(base));
+
+        if (!write_all(fd, header, RECOVERY_HEADER_LEN))
+        {
+            close(fd);
+            set_error("Error writing recovery log");
+            return;
+        }
+
+        recovery_fd = fd;
+        return;
+    }
+
+    unsigned char* log = malloc(st.st_size);
+    int64_t log_len = pread(fd, log, st.st_size, 0);
+
+    if (log_len < (int64_t)RECOVERY_HEADER_LEN ||
+        memcmp(log, RECOVERY_MAGIC, sizeof(RECOVERY_MAGIC) - 1) != 0 ||
+        memcmp(log + sizeof(RECOVERY_MAGIC) - 1, &base, sizeof(base)) != 0)
+    {
+        free(log);
+        close(fd);
+        set_error("Recovery log doesn't match this file; not using it");
+        return;
+    }
+
+    // Replay complete records. A record cut short by a crash is dropped.
+    int64_t position = RECOVERY_HEADER_LEN;
+    int64_t changes = 0;
+
+    while (position + 3 * (int64_t)sizeof(int64_t) <= log_len)
+    {
+        int64_t record[3];
+        memcpy(record, log + position, sizeof(record));
+
+        int64_t kind = record[0];
+        int64_t offset = record[1];
+        int64_t len = record[2];
+        int64_t data = position + sizeof(record);
+        int64_t data_len = kind == CHANGE_DELETE ? 0 :
+                           kind == CHANGE_TRANSFORM ? (int64_t)sizeof(transform) : len;
+
+        if (kind < CHANGE_OVERWRITE || kind > CHANGE_TRANSFORM || len < 0 ||
+            data_len > log_len - data || offset < 0 ||
+            offset > source_len - (kind == CHANGE_INSERT ? 0 : len) ||
+            !make_source_writable())
+        {
+            break;
+        }
+
+        transform t;
+
+        if (kind == CHANGE_TRANSFORM)
+        {
+            memcpy(&t, log + data, sizeof(transform));
+
+            if (!valid_transform(&t, len))
+            {
+                break;
+            }
+        }
+
+        switch (kind)
+        {
+            case CHANGE_OVERWRITE:
+                change_bytes(offset, log + data, len);
+                break;
+
+            case CHANGE_INSERT:
+                insert_bytes(offset, log + data, len);
+                break;
+
+            case CHANGE_DELETE:
+                delete_bytes(offset, len);
+                break;
+
+            case CHANGE_TRANSFORM:
+                transform_bytes(offset, len, &t);
+                break;
+        }
+
+        end_edit_group();
+
+        position = data + data_len;
+        changes++;
+    }
+
+    free(log);
+
+    if (ftruncate(fd, position) != 0 || lseek(fd, 0, SEEK_END) < 0)
+    {
+        close(fd);
+        set_error("Error opening recovery log");
+        return;
+    }
+
+    recovery_fd = fd;
+
+    if (changes)
+    {
+        char count[MAX_RENDERED_INT];
+        char message[MAX_ERROR_LEN];
+        format_count(changes, count);
+        snprintf(message, MAX_ERROR_LEN, "Recovered %s unsaved changes",
+                 count);
+        set_message(message);
+    }
+}
+
+void handle_overwrite(int event)
+{
+    // Convert A-F to lower case
+    if (event >= 'A' && event <= 'F')
+    {
+        event += 'a' - 'A';
+    }
+
+    // Only process 0-9 and a-f
+    if (!((event >= '0' && event <= '9') || (event >= 'a' && event <= 'f')))
+    {
+        return;
+    }
+
+    if (cursor_byte >= source_len || !make_source_writable())
+    {
+        return;
+    }
+
+    unsigned char current;
+    read_bytes(cursor_byte, &current, 1);
+
+    unsigned char first = first_nibble(current);
+    unsigned char second = second_nibble(current);
+
+    unsigned char* nibble = cursor_nibble ? &second : &first;
+    *nibble = hex_to_nibble(event);
+
+    unsigned char byte = nibbles_to_byte(first, second);
+    change_bytes(cursor_byte, &byte, 1);
+
+    handle_key_right();
+}
+
+// In insert mode the first hex digit typed on a byte inserts a new byte
+// before it and the second fills in the new byte's low nibble. Otherwise
+// digits overwrite the current nibble.
+void handle_hex_digit(int event)
+{
+    if (insert_mode && cursor_nibble == 0 && event <= 0xff &&
+        isxdigit(event))
+    {
+        unsigned char byte = hex_to_nibble(tolower(event)) << 4;
+        insert_bytes(cursor_byte, &byte, 1);
+        cursor_nibble = 1;
+        return;
+    }
+
+    handle_overwrite(event);
+}
+
+void handle_delete()
+{
+    delete_bytes(cursor_byte, 1);
+    cursor_nibble = 0;
+}
+
+// Delete the byte before the cursor, or the byte under it if the cursor is
+// on its second digit (such as a byte that's only had one digit typed)
+void handle_backspace()
+{
+    if (cursor_nibble == 0)
+    {
+        if (cursor_byte == 0)
+        {
+            return;
+        }
+
+        cursor_byte--;
+    }
+
+    handle_delete();
+}
+
+// Visual mode. The selection runs from the anchor to the cursor, whichever
+// comes first, and includes both.
+int64_t selection_start()
+{
+    return visual_anchor < cursor_byte ? visual_anchor : cursor_byte;
+}
+
+// Just past the selection
+int64_t selection_end()
+{
+    int64_t end = (visual_anchor > cursor_byte ? visual_anchor :
+                   cursor_byte) + 1;
+
+    return end < source_len ? end : source_len;
+}
+
+void handle_visual()
+{
+    if (source_len == 0)
+    {
+        set_error("Nothing to select");
+        return;
+    }
+
+    insert_mode = false;
+    visual_mode = true;
+    visual_anchor = cursor_byte < source_len ? cursor_byte : source_len - 1;
+}
+
+// Leave visual mode with the cursor at the start of what was selected
+void end_visual()
+{
+    cursor_byte = selection_start();
+    cursor_nibble = 0;
+    visual_mode = false;
+}
+
+// Bytes copied with y, for p and P
+unsigned char* yanked = NULL;
+int64_t yanked_len = 0;
+
+void handle_yank()
+{
+    int64_t len = selection_end() - selection_start();
+    unsigned char* bytes = len > 0 ? malloc(len) : NULL;
+
+    if (!bytes)
+    {
+        set_error("Not enough memory to copy the selection");
+        return;
+    }
+
+    read_bytes(selection_start(), bytes, len);
+    free(yanked);
+    yanked = bytes;
+    yanked_len = len;
+
+    char count[MAX_RENDERED_INT];
+    char message[MAX_ERROR_LEN];
+    format_count(len, count);
+    snprintf(message, sizeof(message), "%s bytes copied", count);
+    set_message(message);
+
+    end_visual();
+}
+
+// p overwrites bytes from the cursor with the copied ones, up to the end of
+// the buffer; P inserts them before the cursor
+void handle_put_yanked(bool insert)
+{
+    if (!yanked_len)
+    {
+        set_error("Nothing copied; select bytes with v and press y");
+        return;
+    }
+
+    if (insert)
+    {
+        insert_bytes(cursor_byte, yanked, yanked_len);
+    }
+    else if (cursor_byte < source_len && make_source_writable())
+    {
+        int64_t len = source_len - cursor_byte;
+        change_bytes(cursor_byte, yanked, len < yanked_len ? len : yanked_len);
+    }
+
+    cursor_nibble = 0;
+}
+
+void handle_delete_selection()
+{
+    delete_bytes(selection_start(), selection_end() - selection_start());
+    end_visual();
+}
+
+// Keys with a meaning of their own in visual mode. Returns whether event
+// was one of them.
+bool handle_visual_event(int event)
+{
+    switch (event)
+    {
+        case 'v':
+        case KEY_ESC:
+            visual_mode = false;
+            return true;
+
+        // Move to the other end of the selection
+        case 'o':
+        {
+            int64_t anchor = visual_anchor;
+            visual_anchor = cursor_byte;
+            cursor_byte = anchor;
+            cursor_nibble = 0;
+            return true;
+        }
+
+        case 'y':
+            handle_yank();
+            return true;
+
+        case 'd':
+        case 'x':
+        case KEY_DC:
+            handle_delete_selection();
+            return true;
+    }
+
+    // Typing over a selected byte is most likely a mistake
+    return event <= 0xff && isxdigit(event);
+}
+
+// :fill, :zero, :xor, :and, :or, :add and :swap16/32/64 on the selection.
+// Returns false if the command isn't one of them.
+bool handle_selection_command()
+{
+    static const struct
+    {
+        const char* name;
+        int op;
+        int width;  // swaps only
+    } commands[] = {
+        { ":fill ", TRANSFORM_FILL, 0 },
+        { ":zero", TRANSFORM_FILL, 0 },
+        { ":xor ", TRANSFORM_XOR, 0 },
+        { ":and ", TRANSFORM_AND, 0 },
+        { ":or ", TRANSFORM_OR, 0 },
+        { ":add ", TRANSFORM_ADD, 0 },
+        { ":swap16", TRANSFORM_SWAP, 2 },
+        { ":swap32", TRANSFORM_SWAP, 4 },
+        { ":swap64", TRANSFORM_SWAP, 8 },
+    };
+
+    int found = -1;
+
+    for (int i = 0; i < (int)(sizeof(commands) / sizeof(commands[0])); i++)
+    {
+        int len = strlen(commands[i].name);
+
+        if (strncmp(command, commands[i].name, len) == 0 &&
+            (command[len] == 0 || commands[i].name[len - 1] == ' '))
+        {
+            found = i;
+            break;
+        }
+    }
+
+    if (found < 0)
+    {
+        return false;
+    }
+
+    if (!visual_mode)
+    {
+        set_error("No selection; press v to select bytes");
+        return true;
+    }
+
+    transform t = { .op = commands[found].op };
+    const char* key = command + strlen(commands[found].name);
+
+    if (t.op == TRANSFORM_SWAP)
+    {
+        t.key_len = commands[found].width;
+    }
+    else if (strcmp(commands[found].name, ":zero") == 0)
+    {
+        t.key_len = 1;
+    }
+    else
+    {
+        t.key_len = parse_hex_bytes(key, t.key, MAX_TRANSFORM_KEY);
+    }
+
+    int64_t start = selection_start();
+    int64_t len = selection_end() - start;
+
+    if (len <= 0)
+    {
+        set_error("Nothing selected");
+        return true;
+    }
+
+    if (t.key_len <= 0)
+    {
+        set_error("Expected up to 32 hex bytes");
+        return true;
+    }
+
+    if (!valid_transform(&t, len))
+    {
+        char error[MAX_ERROR_LEN];
+        snprintf(error, sizeof(error),
+                 "Selection isn't a whole number of %d-bit words",
+                 t.key_len * 8);
+        set_error(error);
+        return true;
+    }
+
+    if (!make_source_writable())
+    {
+        return true;
+    }
+
+    transform_bytes(start, len, &t);
+    end_edit_group();
+    end_visual();
+    return true;
+}
+
+// Paging moves the view and the cursor together by a screenful
+void handle_page_up()
+{
+    cursor_byte -= panes[PANE_HEX].height * bytes_per_line();
+    scroll_start -= panes[PANE_HEX].height;
+}
+
+void handle_page_down()
+{
+    cursor_byte += panes[PANE_HEX].height * bytes_per_line();
+    scroll_start += panes[PANE_HEX].height;
+}
+
+void handle_end_of_buffer()
+{
+    cursor_byte = source_len - 1;
+    cursor_nibble = 1;
+}
+
+// Handle compound commands that start with g (ex: gg).
+// Returns true if the event was handled.
+bool handle_g_chord(int event)
+{
+    static bool g_pressed = false;
+
+    if (!g_pressed)
+    {
+        // If g was pressed, remember that for next key in the chord.
+        // Otherwise, don't consume the event.
+        g_pressed = event == 'g';
+        return g_pressed;
+    }
+
+    // Handle second key in the chord.
+    switch (event)
+    {
+        case 'g':
+            // Chord 'gg' - move to beginning of buffer
+            cursor_byte = 0;
+            cursor_nibble = 0;
+            break;
+    }
+
+    g_pressed = false;
+    return true;
+}
+
+// Offset of the start of the next (or previous) region of data that comes
+// after a hole, or -1 if there isn't one
+int64_t find_data_region(bool forward)
+{
+    int64_t position = cursor_byte;
+
+    while (forward ? position < source_len : position > 0)
+    {
+        int64_t len;
+        unsigned char* data = forward ? contiguous(position, &len) :
+                                        contiguous_before(position, &len);
+
+        if (!len)
+        {
+            break;
+        }
+
+        // The chunk's first offset in the buffer
+        int64_t first = forward ? position : position - len;
+
+        if (in_file_data(data))
+        {
+            int64_t start = data - file_data;
+
+            // The first hole ending after the chunk's start, or the last one
+            // ending in the chunk before the cursor
+            int64_t i = find_hole(start);
+
+            if (!forward)
+            {
+                i = find_hole(start + len) - 1;
+
+                while (i >= 0 && first + holes[i].end - start >= cursor_byte)
+                {
+                    i--;
+                }
+            }
+
+            if (i >= 0 && i < holes_len && holes[i].end > start &&
+                holes[i].end <= start + len &&
+                first + holes[i].end - start < source_len)
+            {
+                return first + holes[i].end - start;
+            }
+        }
+
+        position = forward ? position + len : position - len;
+    }
+
+    return -1;
+}
+
+void handle_next_data_region(bool forward)
+{
+    int64_t found = find_data_region(forward);
+
+    if (found < 0)
+    {
+        set_error(forward ? "No more data after a hole" :
+                            "No earlier data after a hole");
+        return;
+    }
+
+    jump_to_match(found);
+}
+
+// Handle compound commands that start with ] or [ (ex: ]d).
+// Returns true if the event was handled.
+bool handle_bracket_chord(int event)
+{
+    static int bracket = 0;
+
+    if (!bracket)
+    {
+        bracket = event == ']' || event == '[' ? event : 0;
+        return bracket != 0;
+    }
+
+    switch (event)
+    {
+        case 'd':
+            // Chords ']d' and '[d' - next / previous difference
+            handle_next_difference(bracket == ']');
+            break;
+
+        case 'h':
+            // Chords ']h' and '[h' - next / previous data after a hole
+            handle_next_data_region(bracket == ']');
+            break;
+    }
+
+    bracket = 0;
+    return true;
+}
+
+// Given an x,y location, find the pane at that position.
+// Return -1 if there is no pane at that position.
+int get_pane_under_coords(int x, int y)
+{
+    for (int pane = 0; pane < PANES_LEN; pane++)
+    {
+        if (panes[pane].window &&
+            x >= panes[pane].left && x <= right(panes[pane]) &&
+            y >= panes[pane].top && y <= bottom(panes[pane]))
+        {
+            return pane;
+        }
+    }
+
+    return -1;
+}
+
+// Convert screen-space coords to pane-space coords
+int64_t minimap_row_start(int row);
+
+point screen_to_pane(pane* pane, int x, int y)
+{
+    point ret;
+
+    ret.x = x - pane->left;
+    ret.y = y - pane->top;
+
+    return ret;
+}
+
+void handle_mouse_pressed(MEVENT mouse_event)
+{
+    int pane = get_pane_under_coords(mouse_event.x, mouse_event.y);
+
+    if (pane == PANE_MINIMAP)
+    {
+        point coords = screen_to_pane(&panes[pane], mouse_event.x,
+                                      mouse_event.y);
+        jump_to_match(minimap_row_start(coords.y));
+        return;
+    }
+
+    if (pane != PANE_HEX && pane != PANE_ASCII &&
+        pane != PANE_DIFF_HEX && pane != PANE_DIFF_ASCII)
+    {
+        return;
+    }
+
+    point coords = screen_to_pane(&panes[pane], mouse_event.x, mouse_event.y);
+
+    if (pane == PANE_HEX || pane == PANE_DIFF_HEX)
+    {
+        if (coords.x >= bytes_per_line() * CHARS_PER_BYTE - 1)
+        {
+            return;
+        }
+
+        cursor_byte = first_byte_in_line(coords.y + scroll_start) +
+                      coords.x / CHARS_PER_BYTE;
+
+        cursor_nibble = coords.x % CHARS_PER_BYTE;
+
+        if (cursor_nibble == 2)
+        {
+            cursor_byte++;
+            cursor_nibble = 0;
+        }
+    }
+    else
+    {
+        if (coords.x >= bytes_per_line())
+        {
+            return;
+        }
+
+        cursor_byte = first_byte_in_line(coords.y + scroll_start) + coords.x;
+        cursor_nibble = 0;
+    }
+}
+
+void handle_key_home()
+{
+    cursor_byte = first_byte_in_line(byte_in_line(cursor_byte));
+    cursor_nibble = 0;
+}
+
+void handle_key_end()
+{
+    cursor_byte = last_byte_in_line(byte_in_line(cursor_byte));
+    cursor_nibble = 1;
+}
+
+// Read the next input event, waiting up to wait_ms (-1 to block). Returns
+// ERR if nothing arrived. Escape sequences ncurses doesn't translate itself
+// are parsed here: ESC [ <parameters> <final byte>, whose bytes arrive
+// together. Unrecognized sequences are dropped.
+int read_event(int wait_ms)
+{
+    timeout(wait_ms);
+
+    int event = getch();
+
+    if (event != KEY_ESC)
+    {
+        return event;
+    }
+
+    timeout(ESCAPE_SEQUENCE_MAX_TIME_MS);
+
+    int next = getch();
+
+    if (next != '[')
+    {
+        // A lone escape key
+        if (next != ERR)
+        {
+            ungetch(next);
+        }
+
+        return KEY_ESC;
+    }
+
+    char parameters[MAX_ESCAPE_SEQUENCE_LEN + 1];
+    int len = 0;
+
+    while ((next = getch()) != ERR && (next < 0x40 || next > 0x7e))
+    {
+        if (len < MAX_ESCAPE_SEQUENCE_LEN)
+        {
+            parameters[len++] = next;
+        }
+    }
+
+    parameters[len] = 0;
+
+    if (next == 'H' || (next == '~' && (strcmp(parameters, "1") == 0 ||
+                                        strcmp(parameters, "7") == 0)))
+    {
+        return KEY_HOME;
+    }
+
+    if (next == 'F' || (next == '~' && (strcmp(parameters, "4") == 0 ||
+                                        strcmp(parameters, "8") == 0)))
+    {
+        return KEY_END;
+    }
+
+    if (next == '~' && strcmp(parameters, "200") == 0)
+    {
+        return KEY_PASTE_START;
+    }
+
+    if (next == '~' && strcmp(parameters, "201") == 0)
+    {
+        return KEY_PASTE_END;
+    }
+
+    return ERR;
+}
+
+// Pasted text is taken literally: into the command if one is being typed,
+// otherwise its hex digits overwrite (or in insert mode, insert) bytes
+// (spaces, newlines and anything else are skipped, so "7f 45 4c 46" can be
+// pasted as is).
+void handle_paste(int event)
+{
+    if (command_entering)
+    {
+        if (isprint(event))
+        {
+            handle_add_to_command(event);
+        }
+
+        return;
+    }
+
+    handle_hex_digit(event);
+}
+
+void handle_event(int event)
+{
+    if (event == KEY_PASTE_START || event == KEY_PASTE_END)
+    {
+        pasting = event == KEY_PASTE_START;
+        return;
+    }
+
+    if (pasting)
+    {
+        handle_paste(event);
+        return;
+    }
+
+    // Anything but typing hex digits ends the current undo record
+    if (command_entering || event > 0xff || !isxdigit(event))
+    {
+        end_edit_group();
+    }
+
+    if (command_entering)
+    {
+        handle_command_event(event);
+        return;
+    }
+
+    if (sig_list_shown)
+    {
+        handle_sig_list_event(event);
+        return;
+    }
+
+    if (handle_g_chord(event) || handle_bracket_chord(event))
+    {
+        return;
+    }
+
+    if (visual_mode && handle_visual_event(event))
+    {
+        return;
+    }
+
+    switch (event)
+    {
+        case 'h':
+        case 'H':
+        case KEY_LEFT:
+            handle_key_left();
+            break;
+
+        case 'l':
         case 'L':
         case KEY_RIGHT:
             handle_key_right();
             break;
 
-        case 'k':
-        case 'K':
-        case KEY_UP:
-            handle_key_up();
-            break;
+        case 'k':
+        case 'K':
+        case KEY_UP:
+            handle_key_up();
+            break;
+
+        case 'j':
+        case 'J':
+        case KEY_DOWN:
+            handle_key_down();
+            break;
+
+        case 'q':
+        case 'Q':
+            handle_previous_byte();
+            break;
+
+        case 'w':
+        case 'W':
+            handle_next_byte();
+            break;
+
+        case 'G':
+            handle_end_of_buffer();
+            break;
+
+        case KEY_HOME:
+            handle_key_home();
+            break;
+
+        case KEY_END:
+            handle_key_end();
+            break;
+
+        case KEY_PPAGE:
+            handle_page_up();
+            break;
+
+        case KEY_NPAGE:
+            handle_page_down();
+            break;
+
+        case ':':
+        case '/':
+            handle_start_command(event);
+            break;
+
+        case 'n':
+            handle_search_next();
+            break;
+
+        case 'u':
+            handle_undo();
+            break;
+
+        case KEY_CTRL_R:
+            handle_redo();
+            break;
+
+        case 'i':
+        case KEY_IC:
+            insert_mode = true;
+            visual_mode = false;
+            break;
+
+        case KEY_ESC:
+            insert_mode = false;
+            break;
+
+        case 'x':
+        case KEY_DC:
+            handle_delete();
+            break;
+
+        case 'v':
+            handle_visual();
+            break;
+
+        case 'p':
+            handle_put_yanked(false);
+            break;
+
+        case 'P':
+            handle_put_yanked(true);
+            break;
+
+        case KEY_BACKSPACE:
+        case KEY_DELETE:
+            if (insert_mode)
+            {
+                handle_backspace();
+            }
+            break;
+
+        case 'N':
+            handle_search_previous();
+            break;
+
+        default:
+            handle_hex_digit(event);
+            break;
+    }
+
+    MEVENT mouse_event;
+    if (getmouse(&mouse_event) == OK)
+    {
+        if (mouse_event.bstate & BUTTON1_PRESSED)
+        {
+            handle_mouse_pressed(mouse_event);
+            return;
+        }
+    }
+}
+
+void clamp_scrolling()
+{
+    // Clamp to start of buffer
+    if (cursor_byte < 0)
+    {
+        cursor_byte = 0;
+        cursor_nibble = 0;
+    }
+
+    // Clamp to end of buffer. Insert mode can also append after the last
+    // byte, and a diff can show the other file's extra bytes from there.
+    if ((insert_mode || diff_tail_in_other()) && cursor_byte >= source_len)
+    {
+        cursor_byte = source_len;
+        cursor_nibble = 0;
+    }
+    else if (cursor_byte >= source_len)
+    {
+        cursor_byte = source_len - 1;
+        cursor_nibble = 1;
+    }
+
+    int64_t height = panes[PANE_HEX].height > 0 ? panes[PANE_HEX].height : 1;
+    int64_t line = byte_in_line(cursor_byte);
+    int64_t margin = scroll_off < (height - 1) / 2 ? scroll_off :
+                     (height - 1) / 2;
+
+    if (cursor_jumped && (line < scroll_start || line >= scroll_start + height))
+    {
+        // Center on a cursor that jumped off screen
+        scroll_start = line - height / 2;
+    }
+    else if (line < scroll_start + margin)
+    {
+        scroll_start = line - margin;
+    }
+    else if (line > scroll_start + height - 1 - margin)
+    {
+        scroll_start = line - (height - 1 - margin);
+    }
+
+    cursor_jumped = false;
+
+    // Don't scroll past the last line or before the first
+    int64_t last = source_len > cursor_byte ? source_len - 1 : cursor_byte;
+    int64_t last_start = byte_in_line(last > 0 ? last : 0) - height + 1;
+
+    if (scroll_start > last_start)
+    {
+        scroll_start = last_start;
+    }
+
+    if (scroll_start < 0)
+    {
+        scroll_start = 0;
+    }
+}
+
+// For each visible byte, whether it is part of a search match
+bool* visible_matches = NULL;
+int visible_matches_cap = 0;
+
+void find_visible_matches()
+{
+    int64_t first = first_visible_byte();
+    int64_t last = last_visible_byte();
+    int64_t len = last - first + 1;
+
+    if (len <= 0)
+    {
+        return;
+    }
+
+    if (len > visible_matches_cap)
+    {
+        visible_matches_cap = len;
+        visible_matches = realloc(visible_matches, len * sizeof(bool));
+    }
+
+    memset(visible_matches, 0, len * sizeof(bool));
+
+    if (search_mode == SEARCH_SIGNATURES)
+    {
+        for (int64_t hit = first_hit_from(first - longest_signature + 1);
+             hit < signature_hits_len && signature_hits[hit].offset <= last;
+             hit++)
+        {
+            int64_t start = signature_hits[hit].offset;
+            int64_t end = start + signatures[signature_hits[hit].signature].len;
+
+            for (int64_t i = start; i < end && i <= last; i++)
+            {
+                if (i >= first)
+                {
+                    visible_matches[i - first] = true;
+                }
+            }
+        }
+
+        return;
+    }
+
+    if (search_mode == SEARCH_REGEX)
+    {
+        if (!regex_ready)
+        {
+            return;
+        }
+
+        // Look a little beyond the viewport for matches reaching into it
+        int64_t start = first - REGEX_HIGHLIGHT_MARGIN;
+        int64_t end = last + 1 + REGEX_HIGHLIGHT_MARGIN;
+        int64_t match_start;
+        int64_t match_end;
+
+        start = start < 0 ? 0 : start;
+        end = end > source_len ? source_len : end;
+        regex_steps = 0;
+
+        // Carry on after each match, so the bytes are scanned about once.
+        // Expressions that still take too long are only partly highlighted.
+        while (start < end && regex_steps < REGEX_HIGHLIGHT_MAX_STEPS &&
+               regex_find_forward(start, end, &match_start, &match_end))
+        {
+            for (int64_t i = match_start; i < match_end && i <= last; i++)
+            {
+                if (i >= first)
+                {
+                    visible_matches[i - first] = true;
+                }
+            }
+
+            start = match_end > match_start ? match_end : match_start + 1;
+        }
+
+        return;
+    }
+
+    if (!search_term_len)
+    {
+        return;
+    }
+
+    // Include matches that start above the viewport but reach into it
+    int64_t match = first - search_term_len + 1;
+
+    if (match < 0)
+    {
+        match = 0;
+    }
+
+    while ((match = search_range_serial(match, last + 1, true)) >= 0)
+    {
+        for (int64_t i = match; i < match + search_term_len && i <= last; i++)
+        {
+            if (i >= first)
+            {
+                visible_matches[i - first] = true;
+            }
+        }
+
+        match++;
+    }
+}
+
+// What each row of the hex and ASCII panes currently shows. A row is only
+// redrawn when its line, bytes, highlighting or cursor changed, and a scroll
+// shifts the rows already on screen instead of redrawing them.
+int64_t* row_lines = NULL;        // -1 if the row needs drawing
+int* row_cursors = NULL;          // cursor column within the row, or -1
+int* row_lens = NULL;             // bytes shown in the row
+int* row_selected_from = NULL;    // columns of the row selected, if any
+int* row_selected_to = NULL;
+unsigned char* row_bytes = NULL;  // bytes_per_line() per row
+bool* row_matches = NULL;         // bytes_per_line() per row
+bool* row_holes = NULL;           // bytes_per_line() per row
+bool* hole_scratch = NULL;        // which of a row's bytes are in holes
+char* row_text = NULL;            // formatting space for one row
+unsigned char* row_scratch = NULL; // a row's bytes read from the buffer
+bool* row_differs = NULL;         // with --diff, which bytes of the row differ
+int* row_styles = NULL;           // style of each of a row's bytes
+int rows_len = 0;
+int row_width = 0;
+int64_t rows_scroll_start = 0;
+
+void invalidate_rows()
+{
+    rows_len = panes[PANE_HEX].height;
+    row_width = bytes_per_line();
+    rows_scroll_start = scroll_start;
+
+    row_lines = realloc(row_lines, rows_len * sizeof(int64_t));
+    row_cursors = realloc(row_cursors, rows_len * sizeof(int));
+    row_lens = realloc(row_lens, rows_len * sizeof(int));
+    row_selected_from = realloc(row_selected_from, rows_len * sizeof(int));
+    row_selected_to = realloc(row_selected_to, rows_len * sizeof(int));
+    row_bytes = realloc(row_bytes, rows_len * row_width);
+    row_matches = realloc(row_matches, rows_len * row_width * sizeof(bool));
+    row_holes = realloc(row_holes, rows_len * row_width * sizeof(bool));
+    hole_scratch = realloc(hole_scratch, row_width * sizeof(bool));
+    row_text = realloc(row_text, row_width * CHARS_PER_BYTE + 1);
+    row_scratch = realloc(row_scratch, row_width);
+    row_differs = realloc(row_differs, row_width * sizeof(bool));
+    row_styles = realloc(row_styles, row_width * sizeof(int));
+
+    for (int row = 0; row < rows_len; row++)
+    {
+        row_lines[row] = -1;
+    }
+
+    panes_invalid = false;
+}
+
+void scroll_window(WINDOW* w, int lines)
+{
+    scrollok(w, TRUE);
+    wscrl(w, lines);
+    scrollok(w, FALSE);
+}
+
+// Shift the rows on screen to follow scroll_start
+void scroll_rows()
+{
+    int64_t lines = scroll_start - rows_scroll_start;
+    rows_scroll_start = scroll_start;
+
+    if (!lines)
+    {
+        return;
+    }
+
+    if (lines >= rows_len || lines <= -rows_len)
+    {
+        for (int row = 0; row < rows_len; row++)
+        {
+            row_lines[row] = -1;
+        }
+
+        return;
+    }
+
+    scroll_window(panes[PANE_HEX].window, lines);
+    scroll_window(panes[PANE_ASCII].window, lines);
+
+    if (diff_filename)
+    {
+        scroll_window(panes[PANE_DIFF_HEX].window, lines);
+        scroll_window(panes[PANE_DIFF_ASCII].window, lines);
+    }
+
+    int kept = rows_len - llabs(lines);
+    int from = lines > 0 ? lines : 0;
+    int to = lines > 0 ? 0 : -lines;
+
+    memmove(&row_lines[to], &row_lines[from], kept * sizeof(int64_t));
+    memmove(&row_cursors[to], &row_cursors[from], kept * sizeof(int));
+    memmove(&row_lens[to], &row_lens[from], kept * sizeof(int));
+    memmove(&row_selected_from[to], &row_selected_from[from],
+            kept * sizeof(int));
+    memmove(&row_selected_to[to], &row_selected_to[from], kept * sizeof(int));
+    memmove(&row_bytes[to * row_width], &row_bytes[from * row_width],
+            kept * row_width);
+    memmove(&row_matches[to * row_width], &row_matches[from * row_width],
+            kept * row_width * sizeof(bool));
+    memmove(&row_holes[to * row_width], &row_holes[from * row_width],
+            kept * row_width * sizeof(bool));
+
+    // The rows scrolled in are blank
+    for (int row = lines > 0 ? kept : 0;
+         row < (lines > 0 ? rows_len : -lines); row++)
+    {
+        row_lines[row] = -1;
+    }
+}
+
+// Length of the run of styles from the first (at most len) that are the same
+int style_run(const int* styles, int len)
+{
+    int run = 1;
+
+    while (run < len && styles[run] == styles[0])
+    {
+        run++;
+    }
+
+    return run;
+}
+
+// Style a row's len bytes for the hex pane from what was found for the whole
+// row, lowest priority first: holes, differences, match spans and then the
+// selected columns. Nothing is looked up byte by byte.
+void find_hex_styles(int len, const bool* matches, int selected_from,
+                     int selected_to, int* styles)
+{
+    for (int i = 0; i < len; i++)
+    {
+        styles[i] = hole_scratch[i] ? COLOR_PAIR(STYLE_HOLE) : 0;
+    }
+
+    if (diff_filename)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            if (row_differs[i])
+            {
+                styles[i] = COLOR_PAIR(STYLE_DIFF);
+            }
+        }
+    }
+
+    for (int i = 0; i < len; )
+    {
+        if (!matches[i])
+        {
+            i++;
+            continue;
+        }
+
+        int span = i;
+
+        while (i < len && matches[i])
+        {
+            i++;
+        }
+
+        for (int j = span; j < i; j++)
+        {
+            styles[j] = COLOR_PAIR(STYLE_MATCH);
+        }
+    }
+
+    for (int i = selected_from; i < selected_to; i++)
+    {
+        styles[i] = COLOR_PAIR(STYLE_SELECTION);
+    }
+}
+
+// The other file's panes show differences, and the cursor in both of them
+void find_other_styles(int len, int cursor, int* styles)
+{
+    for (int i = 0; i < len; i++)
+    {
+        styles[i] = row_differs[i] ? COLOR_PAIR(STYLE_DIFF) : 0;
+    }
+
+    if (cursor >= 0 && cursor < len)
+    {
+        styles[cursor] = COLOR_PAIR(STYLE_CURSOR);
+    }
+}
+
+// Draw a row with one waddnstr() per run of bytes in the same style.
+// Highlighted runs cover the spaces between their bytes but not the one
+// after the last byte.
+void render_hex(WINDOW* w, int row, const unsigned char* bytes, int len,
+                const int* styles)
+{
+    format_hex_row(bytes, len, row_text);
+
+    // Leave off the trailing space so the last column is never written
+    int text_len = len * CHARS_PER_BYTE - 1;
+    int done = 0;
+
+    wmove(w, row, 0);
+
+    for (int i = 0; i < len; )
+    {
+        int style = styles[i];
+        i += style_run(styles + i, len - i);
+
+        int end = i * CHARS_PER_BYTE - (style ? 1 : 0);
+
+        if (end > text_len)
+        {
+            end = text_len;
+        }
+
+        wattrset(w, style);
+        waddnstr(w, row_text + done, end - done);
+        done = end;
+    }
+
+    wattrset(w, 0);
+    wclrtoeol(w);
+}
+
+void render_ascii(WINDOW* w, int row, const unsigned char* bytes, int len,
+                  const int* styles)
+{
+    format_ascii_row(bytes, len, row_text);
+
+    wmove(w, row, 0);
+
+    for (int i = 0; i < len; )
+    {
+        int style = styles[i];
+        int run = style_run(styles + i, len - i);
+
+        wattrset(w, style);
+        waddnstr(w, row_text + i, run);
+        i += run;
+    }
+
+    wattrset(w, 0);
+
+    // A full row leaves the cursor on the next one, which mustn't be cleared
+    if (len < getmaxx(w))
+    {
+        wclrtoeol(w);
+    }
+}
+
+// Find which of len bytes from offset lie in holes of the mapped file
+void find_hole_bytes(int64_t offset, int64_t len, bool* in_hole)
+{
+    memset(in_hole, 0, len * sizeof(bool));
+
+    for (int64_t done = 0; holes_len && done < len; )
+    {
+        int64_t available;
+        unsigned char* data = contiguous(offset + done, &available);
+
+        if (!available)
+        {
+            break;
+        }
+
+        available = available < len - done ? available : len - done;
+
+        if (in_file_data(data))
+        {
+            int64_t start = data - file_data;
+            int64_t end = start + available;
+
+            for (int64_t i = find_hole(start);
+                 i < holes_len && holes[i].start < end; i++)
+            {
+                int64_t from = holes[i].start > start ? holes[i].start : start;
+                int64_t to = holes[i].end < end ? holes[i].end : end;
+
+                memset(in_hole + done + from - start, true, to - from);
+            }
+        }
+
+        done += available;
+    }
+}
+
+// Redraw the rows of the hex and ASCII panes that changed
+void render_rows()
+{
+    if (panes_invalid || rows_len != panes[PANE_HEX].height ||
+        row_width != bytes_per_line())
+    {
+        invalidate_rows();
+    }
+
+    scroll_rows();
+
+    int64_t first_visible = first_visible_byte();
+
+    for (int row = 0; row < rows_len; row++)
+    {
+        int64_t line = scroll_start + row;
+        int64_t first = first_byte_in_line(line);
+        int64_t len = source_len - first;
+
+        if (len > row_width)
+        {
+            len = row_width;
+        }
+        else if (len < 0)
+        {
+            len = 0;
+        }
+
+        // The other file's part of the row, which may be longer
+        int64_t other_len = diff_len - first;
+
+        if (other_len > row_width)
+        {
+            other_len = row_width;
+        }
+        else if (other_len < 0)
+        {
+            other_len = 0;
+        }
+
+        // The cursor may be in the other file's extra bytes
+        int64_t shown = len > other_len ? len : other_len;
+        int cursor = cursor_byte >= first && cursor_byte < first + shown ?
+                     cursor_byte - first : -1;
+
+        int selected_from = 0;
+        int selected_to = 0;
+
+        if (visual_mode)
+        {
+            int64_t from = selection_start() - first;
+            int64_t to = selection_end() - first;
+
+            selected_from = from < 0 ? 0 : from > len ? len : from;
+            selected_to = to < 0 ? 0 : to > len ? len : to;
+        }
+
+        unsigned char* bytes = &row_bytes[row * row_width];
+        bool* matches = &row_matches[row * row_width];
+        bool* visible = &visible_matches[first - first_visible];
+        bool* in_hole = &row_holes[row * row_width];
+
+        read_bytes(first, row_scratch, len);
+        find_hole_bytes(first, len, hole_scratch);
+
+        // The other file never changes, so the row's bytes, line and
+        // length still decide whether it needs redrawing
+        if (row_lines[row] == line && row_cursors[row] == cursor &&
+            row_lens[row] == len && row_selected_from[row] == selected_from &&
+            row_selected_to[row] == selected_to &&
+            memcmp(bytes, row_scratch, len) == 0 &&
+            memcmp(matches, visible, len * sizeof(bool)) == 0 &&
+            memcmp(in_hole, hole_scratch, len * sizeof(bool)) == 0)
+        {
+            continue;
+        }
+
+        row_lines[row] = line;
+        row_cursors[row] = cursor;
+        row_lens[row] = len;
+        row_selected_from[row] = selected_from;
+        row_selected_to[row] = selected_to;
+        memcpy(bytes, row_scratch, len);
+        memcpy(matches, visible, len * sizeof(bool));
+        memcpy(in_hole, hole_scratch, len * sizeof(bool));
+        if (diff_filename)
+        {
+
+            for (int i = 0; i < row_width; i++)
+            {
+                row_differs[i] = i >= len || i >= other_len ||
+                                 bytes[i] != diff_data[first + i];
+            }
+        }
+
+        find_hex_styles(len, matches, selected_from, selected_to, row_styles);
+        render_hex(panes[PANE_HEX].window, row, bytes, len, row_styles);
+
+        // The ASCII pane also shows the cursor
+        if (cursor >= 0 && cursor < len)
+        {
+            row_styles[cursor] = COLOR_PAIR(STYLE_CURSOR);
+        }
+
+        render_ascii(panes[PANE_ASCII].window, row, bytes, len, row_styles);
+
+        if (diff_filename)
+        {
+            unsigned char* other = diff_data + first;
+
+            find_other_styles(other_len, cursor, row_styles);
+            render_hex(panes[PANE_DIFF_HEX].window, row, other, other_len,
+                       row_styles);
+            render_ascii(panes[PANE_DIFF_ASCII].window, row, other,
+                         other_len, row_styles);
+        }
+    }
+}
+
+void byte_to_binary_string(unsigned char src, char* output)
+{
+    char* out = output + 8;
+    *out = 0;
+
+    while (src != 0)
+    {
+        *--out = src & 1 ? '1' : '0';
+        src >>= 1;
+    }
+
+    while (output != out)
+    {
+        *--out = '0';
+    }
+}
+
+// Bytes under the cursor, zero-padded past the end of the buffer so reading
+// a wide integer near the end never touches memory outside the mapping.
+unsigned char cursor_bytes[sizeof(uint64_t)];
+
+#define render_int(y, x, label, cast, format) ({ \
+    char rendered_int[MAX_RENDERED_INT]; \
+    cast value; \
+    memcpy(&value, cursor_bytes, sizeof(cast)); \
+    int len = snprintf(rendered_int, MAX_RENDERED_INT, format, value); \
+    add_commas(rendered_int, len); \
+    mvwprintw(panes[PANE_DETAIL].window, y, x, "%s %s", label, \
+              rendered_int); \
+    }) \
+
+void render_search_status(WINDOW* w, int y, int x)
+{
+    char total[MAX_RENDERED_INT];
+
+    if (search_mode == SEARCH_SIGNATURES)
+    {
+        format_count(signature_hits_len, total);
+
+        int64_t hit = first_hit_from(cursor_byte);
+
+        if (hit < signature_hits_len &&
+            signature_hits[hit].offset == cursor_byte)
+        {
+            char current[MAX_RENDERED_INT];
+            format_count(hit + 1, current);
+            mvwprintw(w, y, x, "Signature: hit %s of %s", current, total);
+            mvwprintw(w, y + 1, x, "%.*s", panes[PANE_DETAIL].width - x - 1,
+                      signatures[signature_hits[hit].signature].name);
+        }
+        else
+        {
+            mvwprintw(w, y, x, "Signature: %s hits", total);
+        }
+
+        return;
+    }
+
+    if (search_mode == SEARCH_REGEX)
+    {
+        if (regex_ready && cursor_byte == regex_match_start)
+        {
+            format_count(regex_match_end - regex_match_start, total);
+            mvwprintw(w, y, x, "Regex: %s byte match", total);
+        }
+
+        return;
+    }
+
+    if (!search_term_len)
+    {
+        return;
+    }
+
+    if (match_index_building)
+    {
+        int percent = match_index_end ?
+                atomic_load(&match_index_scanned) * 100 / match_index_end : 0;
+        mvwprintw(w, y, x, "Search: counting matches (%d%%)", percent);
+    }
+    else if (match_index_overflow)
+    {
+        format_count(MAX_INDEXED_MATCHES, total);
+        mvwprintw(w, y, x, "Search: more than %s matches", total);
+    }
+    else if (match_index_ready)
+    {
+        format_count(match_index.len, total);
+
+        int64_t k = lower_bound(&match_index, cursor_byte);
+
+        if (k < match_index.len && match_index.offsets[k] == cursor_byte)
+        {
+            char current[MAX_RENDERED_INT];
+            format_count(k + 1, current);
+            mvwprintw(w, y, x, "Search: match %s of %s", current, total);
+        }
+        else
+        {
+            mvwprintw(w, y, x, "Search: %s matches", total);
+        }
+    }
+}
+
+// First byte covered by a row of the minimap
+int64_t minimap_row_start(int row)
+{
+    int height = panes[PANE_MINIMAP].height;
+
+    if (row >= height)
+    {
+        row = height - 1;
+    }
+
+    return height > 0 ? source_len * row / height : 0;
+}
+
+// One cell per row: the average entropy as a digit (0-8 bits per byte) on
+// a color for the most common kind of bytes. Rows covering the view are
+// shown reversed; rows not summarized yet are blank.
+void render_minimap()
+{
+    if (!minimap_shown)
+    {
+        return;
+    }
+
+    WINDOW* w = panes[PANE_MINIMAP].window;
+    int64_t first_visible = first_visible_byte();
+    int64_t last_visible = last_visible_byte();
+
+    werase(w);
+
+    for (int row = 0; row < panes[PANE_MINIMAP].height; row++)
+    {
+        int64_t start = minimap_row_start(row);
+        int64_t end = minimap_row_start(row + 1);
+
+        if (row == panes[PANE_MINIMAP].height - 1)
+        {
+            end = source_len;
+        }
+
+        int64_t first = start / MINIMAP_BLOCK_SIZE;
+        int64_t last = end > start ? (end - 1) / MINIMAP_BLOCK_SIZE + 1 :
+                                     first + 1;
+
+        int attributes = end > first_visible && start <= last_visible ?
+                         A_REVERSE : 0;
+
+        if (source_len == 0 || last > minimap_merged)
+        {
+            wattrset(w, attributes);
+            mvwaddnstr(w, row, 0, "  ", MINIMAP_WIDTH);
+            continue;
+        }
+
+        block_summary summary = summarize_blocks(first, last);
+        int style = STYLE_MAP_BINARY;
+
+        if (summary.entropy >= 7.5)
+        {
+            style = STYLE_MAP_RANDOM;
+        }
+        else if (summary.zeros * 2 > summary.len)
+        {
+            style = STYLE_MAP_ZEROS;
+        }
+        else if (summary.text * 4 > summary.len * 3)
+        {
+            style = STYLE_MAP_TEXT;
+        }
+
+        wattrset(w, COLOR_PAIR(style) | attributes);
+        mvwprintw(w, row, 0, " %d", (int)(summary.entropy + 0.5));
+    }
+
+    wattrset(w, 0);
+}
+
+void render_hash_status(WINDOW* w, int y, int x)
+{
+    const char* name = hash_names[hash_current.algorithm];
+
+    if (hash_running)
+    {
+        int64_t len = hash_end - hash_start;
+        int percent = len ? atomic_load(&hash_hashed) * 100 / len : 0;
+        mvwprintw(w, y, x, "Hash: %s (%d%%)", name, percent);
+    }
+    else if (hash_digest[0])
+    {
+        char start[MAX_RENDERED_INT];
+        char end[MAX_RENDERED_INT];
+        format_count(hash_start, start);
+        format_count(hash_end, end);
+        mvwprintw(w, y, x, "Hash: %s of %s-%s", name, start, end);
+        mvwprintw(w, y + 1, x, "%.*s", panes[PANE_DETAIL].width - x - 1,
+                  hash_digest);
+    }
+}
+
+void render_diff_status(WINDOW* w, int y, int x)
+{
+    if (!diff_filename)
+    {
+        return;
+    }
+
+    if (!diff_counted && source_len <= DIFF_RECOUNT_MAX)
+    {
+        count_differences();
+    }
+
+    if (!diff_counted)
+    {
+        mvwprintw(w, y, x, "Diff: not counted since the last edit");
+        return;
+    }
+
+    char bytes[MAX_RENDERED_INT];
+    char ranges[MAX_RENDERED_INT];
+    format_count(diff_bytes, bytes);
+    format_count(diff_ranges, ranges);
+
+    if (diff_bytes)
+    {
+        mvwprintw(w, y, x, "Diff: %s bytes in %s ranges", bytes, ranges);
+    }
+    else
+    {
+        mvwprintw(w, y, x, "Diff: files are identical");
+    }
+
+    if (source_len != diff_len)
+    {
+        char difference[MAX_RENDERED_INT];
+        format_count(llabs(diff_len - source_len), difference);
+        wprintw(w, ", other file %c%s bytes",
+                diff_len > source_len ? '+' : '-', difference);
+    }
+}
+
+// Frame times in the detail pane, in place of the cursor's values: the
+// last, average and 99th percentile milliseconds for each stage and the
+// whole frame, the bytes sent to the terminal and the last search's speed
+void render_sig_list(WINDOW* w)
+{
+    char current[MAX_RENDERED_INT];
+    char total[MAX_RENDERED_INT];
+    format_count(sig_list_selected + 1, current);
+    format_count(signature_hits_len, total);
+    mvwprintw(w, 1, 1, "Signature hit %s of %s (j/k: move, Enter: jump, "
+              "Esc: close)", current, total);
+
+    for (int row = 0; row < SIG_LIST_ROWS &&
+         sig_list_top + row < signature_hits_len; row++)
+    {
+        signature_hit* hit = &signature_hits[sig_list_top + row];
+
+        wattrset(w, sig_list_top + row == sig_list_selected ? A_REVERSE : 0);
+        mvwprintw(w, 2 + row, 1, "0x%012" PRIx64 "  %.*s", hit->offset,
+                  panes[PANE_DETAIL].width - 19,
+                  signatures[hit->signature].name);
+    }
+
+    wattrset(w, 0);
+}
+
+void render_stats(WINDOW* w)
+{
+    // Finished frames, newest first. The slot of the frame being timed is
+    // left out.
+    int frames = frames_timed < STATS_FRAMES - 1 ? frames_timed :
+                 STATS_FRAMES - 1;
+    int slots[STATS_FRAMES];
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        slots[frame] = (frames_timed - 1 - frame) % STATS_FRAMES;
+    }
+
+    double samples[STATS_FRAMES];
+    double totals[STATS_FRAMES] = {0};
+
+    for (int column = 0; column < 3; column++)
+    {
+        mvwprintw(w, 1, 1 + column * 38, "%-8s %8s %8s %8s", "ms", "last",
+                  "avg", "p99");
+    }
+
+    if (!frames)
+    {
+        return;
+    }
+
+    for (int stage = 0; stage <= STAGES_LEN; stage++)
+    {
+        double sum = 0;
+
+        for (int frame = 0; frame < frames; frame++)
+        {
+            if (stage < STAGES_LEN)
+            {
+                samples[frame] = stage_ms[slots[frame]][stage];
+                totals[frame] += samples[frame];
+            }
+            else
+            {
+                samples[frame] = totals[frame];
+            }
+
+            sum += samples[frame];
+        }
+
+        double latest = samples[0];
+        qsort(samples, frames, sizeof(double), compare_doubles);
+
+        int y = stage < STAGES_LEN ? 2 + stage % 3 : 5;
+        int x = stage < STAGES_LEN ? 1 + stage / 3 * 38 : 1;
+
+        mvwprintw(w, y, x, "%-8s %8.3f %8.3f %8.3f",
+                  stage < STAGES_LEN ? stage_labels[stage] : "frame", latest,
+                  sum / frames, samples[(frames * 99 + 99) / 100 - 1]);
+    }
+
+    int64_t bytes = 0;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        bytes += output_bytes[slots[frame]];
+    }
+
+    char latest[MAX_RENDERED_INT];
+    char average[MAX_RENDERED_INT];
+    format_count(output_bytes[slots[0]], latest);
+    format_count(bytes / frames, average);
+    mvwprintw(w, 5, 39, "Output: %s bytes (avg %s)", latest, average);
+
+    if (search_scanned)
+    {
+        mvwprintw(w, 5, 77, "Search: %.0f MB/s",
+                  search_scanned / 1e3 / (search_ms > 0 ? search_ms : 1e-6));
+    }
+}
+
+void render_details()
+{
+    WINDOW* w = panes[PANE_DETAIL].window;
+    werase(w);
+
+    if (stats_shown)
+    {
+        render_stats(w);
+        box(w, 0, 0);
+        return;
+    }
+
+    if (sig_list_shown)
+    {
+        render_sig_list(w);
+        box(w, 0, 0);
+        return;
+    }
+
+    int64_t available = source_len - cursor_byte;
+
+    if (available > (int64_t)sizeof(cursor_bytes))
+    {
+        available = sizeof(cursor_bytes);
+    }
+    else if (available < 0)
+    {
+        available = 0;
+    }
+
+    memset(cursor_bytes, 0, sizeof(cursor_bytes));
+    read_bytes(cursor_byte, cursor_bytes, available);
+
+    char offset[MAX_RENDERED_INT];
+    int offset_len = snprintf(offset, MAX_RENDERED_INT, "%" PRId64,
+                              cursor_byte);
+    add_commas(offset, offset_len);
+    mvwprintw(w, 1, 1, "Offset: %s", offset);
+
+    char binary[9];
+    byte_to_binary_string(cursor_bytes[0], binary);
+    mvwprintw(w, 1, 30, "Binary: %s", binary);
+
+    render_int(2, 1, "Int8:  ", int8_t, "%d");
+    render_int(3, 1, "UInt8: ", uint8_t, "%d");
+    render_int(4, 1, "Int16: ", int16_t, "%d");
+    render_int(5, 1, "UInt16:", uint16_t, "%d");
+
+    render_int(2, 30, "Int32: ", int32_t, "%d");
+    render_int(3, 30, "UInt32:", uint32_t, "%u");
+    render_int(4, 30, "Int64: ", int64_t, "%" PRId64);
+    render_int(5, 30, "UInt64:", uint64_t, "%" PRIu64);
+
+    render_search_status(w, 1, 60);
+    render_diff_status(w, 3, 60);
+    render_hash_status(w, 4, 66);
+
+    box(w, 0, 0);
+}
+
+void render_mode()
+{
+    if (command_entering || error_displayed)
+    {
+        return;
+    }
+
+    if (insert_mode)
+    {
+        mvprintw(max_y - 1, 0, "-- INSERT --");
+    }
+    else if (visual_mode)
+    {
+        char count[MAX_RENDERED_INT];
+        format_count(selection_end() - selection_start(), count);
+        mvprintw(max_y - 1, 0, "-- VISUAL -- %s bytes", count);
+    }
+}
+
+void render_error()
+{
+    if (!error_displayed)
+    {
+        return;
+    }
+
+    int style = error_is_message ? 0 : COLOR_PAIR(STYLE_ERROR);
+
+    attron(style);
+    mvprintw(max_y - 1, 0, "%s", error_text);
+    attroff(style);
+}
+
+void place_cursor()
+{
+    int render_cursor_x;
+    int render_cursor_y;
+
+    if (command_entering)
+    {
+        render_cursor_y = max_y - 1;
+        render_cursor_x = command_len >= max_x ? max_x : command_len;
+    }
+    else
+    {
+        render_cursor_x = panes[PANE_HEX].left + byte_in_column(cursor_byte) +
+                          cursor_nibble;
+        render_cursor_y = panes[PANE_HEX].top + byte_in_line(cursor_byte) -
+                          scroll_start;
+    }
+
+    move(render_cursor_y, render_cursor_x);
+}
+
+void flush_output()
+{
+    wnoutrefresh(panes[PANE_HEX].window);
+    wnoutrefresh(panes[PANE_ASCII].window);
+
+    if (diff_filename)
+    {
+        wnoutrefresh(panes[PANE_DIFF_HEX].window);
+        wnoutrefresh(panes[PANE_DIFF_ASCII].window);
+    }
+
+    if (minimap_shown)
+    {
+        wnoutrefresh(panes[PANE_MINIMAP].window);
+    }
+
+    wnoutrefresh(panes[PANE_DETAIL].window);
+
+    // The command/error line is drawn over the bottom of the detail pane in
+    // the same update, so it isn't repainted twice.
+    wnoutrefresh(stdscr);
+
+    doupdate();
+}
+
+// Apply one input event
+void handle_input(int event)
+{
+    error_displayed = false;
+
+    handle_sizing();
+
+    start_stage();
+    handle_event(event);
+    end_stage(STAGE_INPUT);
+
+    clamp_scrolling();
+    end_stage(STAGE_CLAMP);
+}
+
+// Bring the screen up to date
+void render()
+{
+    start_frame();
+
+    poll_match_index();
+    poll_hash();
+    poll_minimap();
+    handle_sizing();
+    end_stage(STAGE_POLL);
+
+    clamp_scrolling();
+    end_stage(STAGE_CLAMP);
+    find_visible_matches();
+    end_stage(STAGE_MATCHES);
+    render_rows();
+    end_stage(STAGE_ROWS);
+    render_minimap();
+    end_stage(STAGE_MINIMAP);
+    render_details();
+    end_stage(STAGE_DETAILS);
+    render_command();
+    render_mode();
+    render_error();
+    place_cursor();
+    end_stage(STAGE_COMMAND);
+
+    int64_t written = bytes_written_total();
+    flush_output();
+    written = bytes_written_total() - written;
+    end_stage(STAGE_FLUSH);
+
+    end_frame(written);
+}
+
+// Add input that has been read to the end of the buffer. It's part of the
+// file rather than an edit, so it isn't journaled.
+void append_input(unsigned char* data, int64_t len)
+{
+    int64_t offset = source_len;
+
+    pthread_rwlock_wrlock(&pieces_lock);
+
+    if (!extend_last_piece(pieces, data, len))
+    {
+        pieces = merge_pieces(pieces, new_piece(data, len));
+    }
+
+    source_len += len;
+
+    pthread_rwlock_unlock(&pieces_lock);
+
+    bytes_changed(offset, 0, len);
+}
+
+void stop_stream()
+{
+    close(stream_fd);
+    stream_fd = -1;
+}
+
+// Read whatever input is available without blocking. If the cursor was on
+// the last byte it stays there, so the view scrolls along like tail -f.
+void read_stream()
+{
+    if (stream_fd < 0)
+    {
+        return;
+    }
+
+    bool at_end = source_len > 0 && cursor_byte == source_len - 1;
+    int64_t total = 0;
+
+    while (total < STREAM_READ_MAX)
+    {
+        unsigned char* data = reserve_add(STREAM_READ_MIN);
+        ssize_t len = read(stream_fd, data, add_chunk_cap - add_chunk_len);
+
+        if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            break;
+        }
+
+        if (len == 0 && follow)
+        {
+            // Nothing new yet. Keep waiting unless the file was truncated,
+            // which leaves nothing sensible to follow.
+            struct stat st;
+
+            if (fstat(stream_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                st.st_size < lseek(stream_fd, 0, SEEK_CUR))
+            {
+                set_error("File was truncated; no longer following it");
+                stop_stream();
+            }
+
+            break;
+        }
+
+        if (len <= 0)
+        {
+            if (len < 0)
+            {
+                set_error("Error reading input");
+            }
+
+            stop_stream();
+            break;
+        }
+
+        add_chunk_len += len;
+        append_input(data, len);
+        total += len;
+    }
+
+    if (at_end && total > 0)
+    {
+        cursor_byte = source_len - 1;
+        cursor_nibble = 0;
+    }
+}
+
+void open_file(char* filename)
+{
+    bool from_stdin = strcmp(filename, "-") == 0;
+
+    if (from_stdin && isatty(STDIN_FILENO))
+    {
+        printf("Nothing to read: pipe data into hexitor - or give a file.\n");
+        exit(2);
+    }
+
+    int fd = from_stdin ? dup(STDIN_FILENO) : open(filename, O_RDONLY);
+
+    if (fd < 0)
+    {
+        printf("Error opening file. File not found / permissions problem?\n");
+        exit(2);
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0)
+    {
+        printf("Error reading file information.\n");
+        exit(2);
+    }
+
+    // Names like /dev/stdin open the input itself, so it's read the same
+    // way as - and the keyboard has to come from the terminal instead
+    struct stat input;
+
+    if (!from_stdin && !isatty(STDIN_FILENO) &&
+        fstat(STDIN_FILENO, &input) == 0 && input.st_dev == st.st_dev &&
+        input.st_ino == st.st_ino)
+    {
+        from_stdin = true;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    source_dev = st.st_dev;
+    source_ino = st.st_ino;
+
+    // Map regular files so opening is independent of file size: pages are
+    // only read in when the viewport, a search or a save touches them.
+    void* mapping = MAP_FAILED;
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    if (mapping != MAP_FAILED)
+    {
+        file_data = mapping;
+        file_data_len = st.st_size;
+        source_mapped = true;
+        source_writable = false;
+
+        load_holes(fd);
+
+        // Viewing jumps around; searches switch to sequential readahead.
+        advise_source(MADV_RANDOM);
+    }
+    else
+    {
+        // Nothing mapped, so there's nothing to protect either
+        source_writable = true;
+    }
+
+    // The buffer starts out as a single piece covering the whole file
+    source_len = file_data_len;
+
+    if (source_len > 0)
+    {
+        pieces = new_piece(file_data, source_len);
+    }
+
+    if (mapping == MAP_FAILED || follow)
+    {
+        // Read the rest of the input into the add buffer as it arrives,
+        // starting after whatever was mapped
+        lseek(fd, file_data_len, SEEK_SET);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        stream_fd = fd;
+    }
+    else
+    {
+        close(fd);
+    }
+
+    // Regular files that can't be mapped (empty files, /proc) are short
+    // and don't grow, so just read them in now
+    if (S_ISREG(st.st_mode) && !follow)
+    {
+        while (stream_fd >= 0)
+        {
+            read_stream();
+        }
+    }
+
+    // Pipes and terminals can't be saved back to
+    original_filename = S_ISREG(st.st_mode) && !from_stdin ? filename : NULL;
+
+    if (from_stdin && !batch_mode && !freopen("/dev/tty", "r", stdin))
+    {
+        printf("Error opening the terminal for keyboard input.\n");
+        exit(2);
+    }
+}
+
+// Batch mode (--batch <script> <filename>...): run a script against each
+// file without the UI. Script lines are the commands typed after : or / in
+// the editor, plus n and N, :put <hex> to overwrite bytes at the cursor and
+// :assert <hex> to check them. Blank lines and lines starting with # are
+// skipped. Each file is handled by its own worker process.
+
+char** batch_lines = NULL;
+int batch_lines_len = 0;
+
+void load_batch_script(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+
+    if (!file)
+    {
+        printf("Error opening script %s\n", filename);
+        exit(2);
+    }
+
+    char* line = NULL;
+    size_t capacity = 0;
+
+    while (getline(&line, &capacity, file) >= 0)
+    {
+        line[strcspn(line, "\r\n")] = 0;
+
+        batch_lines = realloc(batch_lines,
+                              (batch_lines_len + 1) * sizeof(char*));
+        batch_lines[batch_lines_len++] = strdup(line);
+    }
+
+    free(line);
+    fclose(file);
+}
 
-        case 'j':
-        case 'J':
-        case KEY_DOWN:
-            handle_key_down();
-            break;
+// :put <hex> and :assert <hex>
+void handle_put_or_assert(const char* text, bool put)
+{
+    unsigned char bytes[MAX_COMMAND_LEN];
+    int len = parse_hex_bytes(text, bytes, sizeof(bytes));
 
-        case 'q':
-        case 'Q':
-            handle_previous_byte();
-            break;
+    if (len <= 0)
+    {
+        set_error("Expected hex bytes");
+        return;
+    }
 
-        case 'w':
-        case 'W':
-            handle_next_byte();
-            break;
+    if (cursor_byte < 0 || cursor_byte + len > source_len)
+    {
+        set_error("Past the end of the file");
+        return;
+    }
 
-        case 'G':
-            handle_end_of_buffer();
-            break;
+    if (put)
+    {
+        if (make_source_writable())
+        {
+            change_bytes(cursor_byte, bytes, len);
+        }
 
-        case KEY_PPAGE:
-            handle_page_up();
+        return;
+    }
+
+    unsigned char actual[MAX_COMMAND_LEN];
+    read_bytes(cursor_byte, actual, len);
+
+    if (memcmp(actual, bytes, len) != 0)
+    {
+        char error[MAX_ERROR_LEN];
+        snprintf(error, sizeof(error), "Assertion failed at 0x%" PRIx64,
+                 cursor_byte);
+        set_error(error);
+    }
+}
+
+// Run one script line, returning false if it failed (see error_text)
+bool run_batch_command(const char* line)
+{
+    int len = strlen(line);
+    error_displayed = false;
+
+    if (len >= MAX_COMMAND_LEN)
+    {
+        set_error("Command too long");
+    }
+    else if (strncmp(line, ":put ", 5) == 0)
+    {
+        handle_put_or_assert(line + 5, true);
+    }
+    else if (strncmp(line, ":assert ", 8) == 0)
+    {
+        handle_put_or_assert(line + 8, false);
+    }
+    else if (strcmp(line, "n") == 0)
+    {
+        handle_search_next();
+    }
+    else if (strcmp(line, "N") == 0)
+    {
+        handle_search_previous();
+    }
+    else if (strcmp(line, "v") == 0)
+    {
+        handle_visual();
+    }
+    else if (line[0] == ':' || line[0] == '/')
+    {
+        memcpy(command, line, len);
+        command_len = len;
+        handle_submit_command();
+    }
+    else
+    {
+        set_error("Unknown command");
+    }
+
+    return !error_displayed || error_is_message;
+}
+
+// Runs in a worker process. Returns its exit status.
+int run_batch_file(char* filename)
+{
+    open_file(filename);
+
+    for (int i = 0; i < batch_lines_len; i++)
+    {
+        char* line = batch_lines[i];
+
+        if (!line[strspn(line, " \t")] || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (!run_batch_command(line))
+        {
+            fprintf(stderr, "%s: line %d: %s\n", filename, i + 1, error_text);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Run the script over every file, up to worker_threads at a time. Exits 0
+// if it succeeded on all of them.
+int run_batch(const char* script, char** filenames, int filenames_len)
+{
+    load_batch_script(script);
+
+    int workers = worker_threads < filenames_len ? worker_threads :
+                                                   filenames_len;
+    pid_t* pids = calloc(filenames_len, sizeof(pid_t));
+    int64_t total_bytes = 0;
+    int running = 0;
+    int next = 0;
+    int failed = 0;
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (next < filenames_len || running > 0)
+    {
+        if (next < filenames_len && running < workers)
+        {
+            struct stat st;
+
+            if (stat(filenames[next], &st) == 0 && S_ISREG(st.st_mode))
+            {
+                total_bytes += st.st_size;
+            }
+
+            fflush(NULL);
+            pid_t pid = fork();
+
+            if (pid == 0)
+            {
+                // Leftover CPUs go to searching within each file
+                worker_threads /= workers;
+                exit(run_batch_file(filenames[next]));
+            }
+
+            if (pid < 0)
+            {
+                fprintf(stderr, "%s: error starting worker\n",
+                        filenames[next]);
+                failed++;
+            }
+
+            pids[next++] = pid;
+            running += pid > 0;
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+
+        if (pid < 0)
+        {
             break;
+        }
 
-        case KEY_NPAGE:
-            handle_page_down();
+        running--;
+
+        int i = 0;
+        while (pids[i] != pid)
+        {
+            i++;
+        }
+
+        if (WIFSIGNALED(status))
+        {
+            fprintf(stderr, "%s: FAILED (signal %d)\n", filenames[i],
+                    WTERMSIG(status));
+            failed++;
+        }
+        else if (WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "%s: FAILED (exit status %d)\n", filenames[i],
+                    WEXITSTATUS(status));
+            failed++;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (seconds <= 0)
+    {
+        seconds = 1e-9;
+    }
+
+    fprintf(stderr, "%d files, %d failed, %.2f s: %.1f files/s, %.1f MB/s\n",
+            filenames_len, failed, seconds, filenames_len / seconds,
+            total_bytes / 1e6 / seconds);
+
+    free(pids);
+    return failed ? 1 : 0;
+}
+
+// Benchmarks (--bench <directory>): time common operations on synthetic
+// files without a terminal and print the results as JSON, so they can be
+// compared between commits. The files are made on the first run and kept
+// in the directory for later ones.
+
+#define BENCH_FILE_SIZE (256LL << 20)
+#define BENCH_SPARSE_SIZE (5LL << 30)
+#define BENCH_HUGE_SIZE (100LL << 30)
+#define BENCH_BLOCK_SIZE (1 << 20)
+#define BENCH_RUNS 5
+#define BENCH_VIEWS 200
+
+// The viewport rendered: a 200 column terminal, and for rendering also an
+// 80 column one and an ultra-wide one
+#define BENCH_LINE_BYTES 48
+#define BENCH_NARROW_LINE_BYTES 16
+#define BENCH_WIDE_LINE_BYTES 512
+#define BENCH_ROWS 60
+
+#define CORPUS_RANDOM 0
+#define CORPUS_ZEROS 1
+#define CORPUS_TEXT 2
+#define CORPUS_REPEATED 3
+#define CORPUS_SPARSE 4
+#define CORPORA_LEN 5
+
+const char* corpus_names[CORPORA_LEN] =
+{
+    "random", "zeros", "text", "repeated", "sparse"
+};
+
+// Search terms. The forward ones are planted near the end of each file and
+// the backward ones near the start, so each search crosses the whole file.
+#define BENCH_TERMS_LEN 4
+#define BENCH_SHORT_TERM_LEN 4
+#define BENCH_LONG_TERM_LEN 32
+
+const char* bench_term_names[BENCH_TERMS_LEN] =
+{
+    "search_forward_short", "search_forward_long",
+    "search_backward_short", "search_backward_long"
+};
+
+unsigned char bench_terms[BENCH_TERMS_LEN][BENCH_LONG_TERM_LEN];
+
+int bench_term_len(int term)
+{
+    return term % 2 ? BENCH_LONG_TERM_LEN : BENCH_SHORT_TERM_LEN;
+}
+
+int64_t bench_term_offset(int term, int64_t size)
+{
+    int64_t offsets[BENCH_TERMS_LEN] = { size - 8192, size - 4096, 4096,
+                                         8192 };
+    return offsets[term];
+}
+
+uint64_t bench_random(uint64_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Fill a block of a corpus. Blocks depend only on state, which each corpus
+// seeds the same way, so the files are the same on every machine.
+void make_corpus_block(int corpus, unsigned char* block, int len,
+                       uint64_t* state)
+{
+    static const char* words[] =
+    {
+        "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+        "hexitor", "buffer", "offset", "search", "piece", "table", "of",
+        "a", "and", "to", "in", "is"
+    };
+
+    int i = 0;
+
+    switch (corpus)
+    {
+        case CORPUS_RANDOM:
+        case CORPUS_SPARSE:
+            for (; i + 8 <= len; i += 8)
+            {
+                uint64_t value = bench_random(state);
+                memcpy(block + i, &value, 8);
+            }
             break;
 
-        case ':':
-        case '/':
-            handle_start_command(event);
+        case CORPUS_ZEROS:
+            memset(block, 0, len);
+            i = len;
             break;
 
-        case 'n':
-            handle_search_next();
+        case CORPUS_TEXT:
+            while (i < len)
+            {
+                uint64_t value = bench_random(state);
+                const char* word = words[value % 20];
+                int word_len = strlen(word);
+
+                for (int j = 0; j < word_len && i < len; j++)
+                {
+                    block[i++] = word[j];
+                }
+
+                if (i < len)
+                {
+                    block[i++] = value % 11 == 0 ? '\n' : ' ';
+                }
+            }
             break;
 
-        case 'N':
-            handle_search_previous();
+        case CORPUS_REPEATED:
+            for (; i < len; i++)
+            {
+                block[i] = "0123456789abcdef struct record { int id; }\n"
+                           [i % 43];
+            }
             break;
+    }
 
-        default:
-            handle_overwrite(event);
+    for (; i < len; i++)
+    {
+        block[i] = bench_random(state);
+    }
+}
+
+// Write the corpus to filename unless it's already there. Returns false on
+// errors.
+bool make_corpus(int corpus, const char* filename)
+{
+    int64_t size = corpus == CORPUS_SPARSE ? BENCH_SPARSE_SIZE :
+                   BENCH_FILE_SIZE;
+    struct stat st;
+
+    if (stat(filename, &st) == 0 && st.st_size == size)
+    {
+        return true;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    unsigned char* block = malloc(BENCH_BLOCK_SIZE);
+    uint64_t state = 0x9e3779b97f4a7c15ULL + corpus;
+    bool ok = ftruncate(fd, size) == 0;
+
+    // The sparse file only has data at the start, in the middle and at the
+    // end; the rest is holes
+    for (int64_t offset = 0; ok && offset < size; offset += BENCH_BLOCK_SIZE)
+    {
+        if (corpus == CORPUS_SPARSE && offset != 0 &&
+            offset != size / 2 / BENCH_BLOCK_SIZE * BENCH_BLOCK_SIZE &&
+            offset + BENCH_BLOCK_SIZE < size)
+        {
+            continue;
+        }
+
+        int64_t len = size - offset < BENCH_BLOCK_SIZE ? size - offset :
+                      BENCH_BLOCK_SIZE;
+        make_corpus_block(corpus, block, len, &state);
+        ok = pwrite(fd, block, len, offset) == len;
+    }
+
+    for (int term = 0; ok && term < BENCH_TERMS_LEN; term++)
+    {
+        int len = bench_term_len(term);
+        ok = pwrite(fd, bench_terms[term], len,
+                    bench_term_offset(term, size)) == len;
+    }
+
+    free(block);
+    close(fd);
+
+    if (!ok)
+    {
+        unlink(filename);
+    }
+
+    return ok;
+}
+
+// Let go of the file and the buffer made from it
+void close_file()
+{
+    if (source_mapped)
+    {
+        munmap(file_data, file_data_len);
+    }
+    else
+    {
+        free(file_data);
+    }
+
+    free_pieces(pieces);
+    pieces = NULL;
+    file_data = NULL;
+    file_data_len = 0;
+    source_len = 0;
+    source_mapped = false;
+    dirty_pages_len = 0;
+    holes_len = 0;
+}
+
+bool bench_reported = false;
+
+// Print one result: latency percentiles over the runs and, for operations
+// that scan the file (bytes > 0, the bytes each run covered), the throughput
+// at the median. A percentile is only given when there are enough runs for
+// it to differ from the maximum.
+void report_bench(const char* corpus, const char* operation, int64_t bytes,
+                  double* samples, int runs)
+{
+    qsort(samples, runs, sizeof(double), compare_doubles);
+
+    int percentiles[3] = { 50, 90, 99 };
+
+    printf("%s    {\"corpus\": \"%s\", \"operation\": \"%s\", ",
+           bench_reported ? ",\n" : "", corpus, operation);
+
+    if (bytes > 0)
+    {
+        printf("\"bytes\": %" PRId64 ", ", bytes);
+    }
+
+    printf("\"runs\": %d, \"min_ms\": %.3f, ", runs, samples[0]);
+
+    double median = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        int rank = (int)ceil(percentiles[i] / 100.0 * runs) - 1;
+        double at = samples[rank > 0 ? rank : 0];
+
+        if (i == 0)
+        {
+            median = at;
+        }
+
+        if (runs * (100 - percentiles[i]) >= 100)
+        {
+            printf("\"p%d_ms\": %.3f, ", percentiles[i], at);
+        }
+    }
+
+    printf("\"max_ms\": %.3f", samples[runs - 1]);
+
+    if (bytes > 0)
+    {
+        printf(", \"mb_per_s\": %.1f", median > 0 ? bytes / median / 1e3 : 0);
+    }
+
+    printf("}");
+    fflush(stdout);
+
+    bench_reported = true;
+}
+
+// Lay out the panes for lines of bytes_per_line bytes
+void set_bench_width(int bytes_per_line)
+{
+    panes[PANE_HEX].width = bytes_per_line * CHARS_PER_BYTE;
+    panes[PANE_HEX].height = BENCH_ROWS;
+    invalidate_rows();
+}
+
+// Everything render_rows() works out for the viewport at scroll_start short
+// of drawing it: each row's bytes, their hex and ASCII text and their styles
+void format_viewport()
+{
+    find_visible_matches();
+
+    int64_t first_visible = first_visible_byte();
+
+    for (int row = 0; row < rows_len; row++)
+    {
+        int64_t first = first_byte_in_line(scroll_start + row);
+        int64_t len = source_len - first;
+
+        if (len > row_width)
+        {
+            len = row_width;
+        }
+
+        if (len <= 0)
+        {
             break;
+        }
+
+        read_bytes(first, row_scratch, len);
+        find_hole_bytes(first, len, hole_scratch);
+        find_hex_styles(len, &visible_matches[first - first_visible], 0, 0,
+                        row_styles);
+        format_hex_row(row_scratch, len, row_text);
+        format_ascii_row(row_scratch, len, row_text);
+    }
+}
+
+// Whether a saved copy has the right size, the search terms planted at both
+// ends and the byte changed in the middle
+bool check_saved(const char* filename, int64_t size, unsigned char middle)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    bool ok = fd >= 0 && fstat(fd, &st) == 0 && st.st_size == size;
+
+    for (int term = 0; ok && term < BENCH_TERMS_LEN; term++)
+    {
+        unsigned char found[BENCH_LONG_TERM_LEN];
+        int len = bench_term_len(term);
+
+        ok = pread(fd, found, len, bench_term_offset(term, size)) == len &&
+             memcmp(found, bench_terms[term], len) == 0;
+    }
+
+    unsigned char byte;
+    ok = ok && pread(fd, &byte, 1, size / 2) == 1 && byte == middle;
+
+    if (fd >= 0)
+    {
+        close(fd);
     }
 
-    MEVENT mouse_event;
-    if (getmouse(&mouse_event) == OK)
+    return ok;
+}
+
+// The byte-at-a-time loop n used before search_range(), so the bench can
+// show what the search kernels gained. Reads file_data directly, so it's
+// only right for an unedited buffer.
+int64_t naive_search_forward(int64_t start, const unsigned char* term,
+                             int len)
+{
+    for (int64_t cur = start; cur + len <= source_len; cur++)
     {
-        if (mouse_event.bstate & BUTTON1_PRESSED)
+        int i = 0;
+
+        while (i < len && file_data[cur + i] == term[i])
         {
-            handle_mouse_pressed(mouse_event);
-            return;
+            i++;
+        }
+
+        if (i == len)
+        {
+            return cur;
         }
     }
+
+    return -1;
 }
 
-void clamp_scrolling()
+bool bench_file(int corpus, char* filename)
 {
-    // Clamp to start of buffer
-    if (cursor_byte < 0)
-    {
-        cursor_byte = 0;
-        cursor_nibble = 0;
-    }
+    const char* name = corpus_names[corpus];
+    double samples[BENCH_VIEWS];
+    struct timespec start;
 
-    // Clamp to end of buffer
-    if (cursor_byte >= source_len)
+    // Opening includes showing the first screen
+    for (int run = 0; run < BENCH_RUNS; run++)
     {
-        cursor_byte = source_len - 1;
-        cursor_nibble = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        open_file(filename);
+        scroll_start = 0;
+        format_viewport();
+        samples[run] = ms_since(start);
+        close_file();
     }
 
-    // Scroll up if cursor has left viewport
-    while (cursor_byte < first_visible_byte())
-    {
-        scroll_start--;
-    }
+    open_file(filename);
+    report_bench(name, "open", 0, samples, BENCH_RUNS);
 
-    // Scroll down if cursor has left viewport
-    while (cursor_byte > last_visible_byte())
+    for (int term = 0; term < BENCH_TERMS_LEN; term++)
     {
-        scroll_start++;
-    }
+        char text[BENCH_LONG_TERM_LEN * CHARS_PER_BYTE + 1];
+        int len = bench_term_len(term);
+        bool forward = term < 2;
+        int64_t expected = bench_term_offset(term, source_len);
 
-    // Clamp scroll start to beginning of buffer
-    if (scroll_start < 0)
-    {
-        scroll_start = 0;
-    }
-}
+        for (int i = 0; i < len; i++)
+        {
+            sprintf(text + i * CHARS_PER_BYTE, "%02x ", bench_terms[term][i]);
+        }
 
-void render_hex()
-{
-    wclear(panes[PANE_HEX].window);
+        search_mode = SEARCH_PATTERN;
+        set_search_term(text, len * CHARS_PER_BYTE);
 
-    char hex[2];
+        for (int run = 0; run < BENCH_RUNS; run++)
+        {
+            cursor_byte = forward ? 0 : source_len - 1;
 
-    for (int i = first_visible_byte(); i <= last_visible_byte(); i++)
-    {
-        byte_to_hex(source[i], hex);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            forward ? handle_search_next() : handle_search_previous();
+            samples[run] = ms_since(start);
 
-        int out_y = byte_in_line(i) - scroll_start;
-        int out_x = byte_in_column(i);
+            if (cursor_byte != expected)
+            {
+                fprintf(stderr, "%s: %s found 0x%" PRIx64 ", not 0x%" PRIx64
+                        "\n", name, bench_term_names[term], cursor_byte,
+                        expected);
+                return false;
+            }
+        }
 
-        mvwprintw(panes[PANE_HEX].window, out_y, out_x, "%c%c ", hex[0],
-                  hex[1]);
+        // Searches skip holes, so only the data they read counts
+        report_bench(name, bench_term_names[term],
+                     forward ? data_bytes(0, expected) :
+                               data_bytes(expected, source_len),
+                     samples, BENCH_RUNS);
     }
-}
 
-void render_ascii()
-{
-    wclear(panes[PANE_ASCII].window);
+    // The short forward search again with the old loop, for comparison
+    int64_t expected = bench_term_offset(0, source_len);
 
-    for (int i = first_visible_byte(); i <= last_visible_byte(); i++)
+    for (int run = 0; run < BENCH_RUNS; run++)
     {
-        int out_y = byte_in_line(i) - scroll_start;
-        int out_x = i % bytes_per_line();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int64_t found = naive_search_forward(1, bench_terms[0],
+                                             bench_term_len(0));
+        samples[run] = ms_since(start);
 
-        char output = '.';
-
-        if (source[i] >= ' ' && source[i] <= '~')
+        if (found != expected)
         {
-            output = source[i];
+            fprintf(stderr, "%s: search_forward_naive found 0x%" PRIx64
+                    ", not 0x%" PRIx64 "\n", name, found, expected);
+            return false;
         }
+    }
+
+    report_bench(name, "search_forward_naive", expected, samples,
+                 BENCH_RUNS);
+
+    // Views at random places, with the last search term highlighted, at each
+    // terminal width
+    int widths[] = { BENCH_NARROW_LINE_BYTES, BENCH_LINE_BYTES,
+                     BENCH_WIDE_LINE_BYTES };
+    const char* width_names[] = { "render_narrow", "render", "render_wide" };
+
+    for (int width = 0; width < 3; width++)
+    {
+        uint64_t state = 0x2545f4914f6cdd1dULL;
+
+        set_bench_width(widths[width]);
 
-        if (i == cursor_byte)
+        int64_t lines = byte_in_line(source_len - 1) + 1;
+
+        for (int view = 0; view < BENCH_VIEWS; view++)
         {
-            wattron(panes[PANE_ASCII].window, COLOR_PAIR(STYLE_CURSOR));
+            scroll_start = bench_random(&state) % lines;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            format_viewport();
+            samples[view] = ms_since(start);
         }
 
-        mvwprintw(panes[PANE_ASCII].window, out_y, out_x, "%c", output);
+        report_bench(name, width_names[width], 0, samples, BENCH_VIEWS);
+    }
+
+    set_bench_width(BENCH_LINE_BYTES);
+
+    int64_t lines = byte_in_line(source_len - 1) + 1;
+    int64_t last_start = lines - BENCH_ROWS > 0 ? lines - BENCH_ROWS : 0;
+
+    for (int view = 0; view < BENCH_VIEWS; view++)
+    {
+        cursor_byte = 0;
+        scroll_start = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        handle_end_of_buffer();
+        cursor_jumped = true;
+        clamp_scrolling();
+        format_viewport();
+        samples[view] = ms_since(start);
 
-        if (i == cursor_byte)
+        if (cursor_byte != source_len - 1 || scroll_start != last_start)
         {
-            wattroff(panes[PANE_ASCII].window, COLOR_PAIR(STYLE_CURSOR));
+            fprintf(stderr, "%s: jump_to_end left the cursor at 0x%" PRIx64
+                    " and the view at line %" PRId64 "\n", name, cursor_byte,
+                    scroll_start);
+            return false;
         }
     }
-}
 
-// Turn something like "1234" to "1,234". str must have enough space to add
-// the commas (plus one for null termination): (len - 1) / 3 + 1
-void add_commas(char* str, int len)
-{
-    // Skip dash if negative integer
-    if (str[0] == '-')
+    report_bench(name, "jump_to_end", 0, samples, BENCH_VIEWS);
+
+    // Saving a copy, with one byte changed so it isn't just the file
+    char saved[PATH_MAX];
+    snprintf(saved, sizeof(saved), "%s.saved", filename);
+
+    unsigned char byte = 0x5a;
+
+    if (make_source_writable())
     {
-        str++;
-        len--;
+        change_bytes(source_len / 2, &byte, 1);
     }
 
-    int commas = (len - 1) / 3;
+    read_bytes(source_len / 2, &byte, 1);
 
-    int source = len - 1;
-    int target = source + commas;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool saved_ok = save_file(saved);
+        samples[run] = ms_since(start);
 
-    str[target + 1] = 0;
+        if (!saved_ok)
+        {
+            fprintf(stderr, "%s: %s\n", name, error_text);
+            return false;
+        }
 
-    while (source >= 0)
-    {
-        int digits_processed = len - source - 1;
+        saved_ok = check_saved(saved, source_len, byte);
+        unlink(saved);
 
-        if (digits_processed && digits_processed % 3 == 0)
+        if (!saved_ok)
         {
-            str[target--] = ',';
+            fprintf(stderr, "%s: saved copy differs from the buffer\n",
+                    name);
+            return false;
         }
+    }
 
-        str[target--] = str[source--];
+    report_bench(name, "save", data_bytes(0, source_len), samples,
+                 BENCH_RUNS);
+
+    close_file();
+    return true;
+}
+
+// Press keys as if typed in the editor, then settle the view as a frame
+// would
+void bench_keys(const int* keys, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        handle_event(keys[i]);
     }
+
+    clamp_scrolling();
 }
 
-void byte_to_binary_string(unsigned char src, char* output)
+typedef struct
 {
-    char* out = output + 8;
-    *out = 0;
+    const char* name;
+    int keys[16];
+    int keys_len;
+
+    // Where the cursor and the view start and must end up
+    int64_t cursor_before;
+    int64_t scroll_before;
+    int64_t cursor_after;
+    int64_t scroll_after;
+} bench_move;
+
+// Jumps, G, gg and paging across a 100 GiB sparse file. Each has to leave
+// the cursor and the view exactly where expected, and take the same time
+// however far it goes.
+bool bench_navigation(const char* filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT, 0644);
+    bool ok = fd >= 0 && ftruncate(fd, BENCH_HUGE_SIZE) == 0 &&
+              pwrite(fd, "end", 3, BENCH_HUGE_SIZE - 3) == 3;
 
-    while (src != 0)
+    if (fd >= 0)
     {
-        *--out = src & 1 ? '1' : '0';
-        src >>= 1;
+        close(fd);
     }
 
-    while (output != out)
+    if (!ok)
     {
-        *--out = '0';
+        fprintf(stderr, "Error writing %s\n", filename);
+        return false;
     }
-}
 
-// Max value of uint64 with commas and null char
-#define MAX_RENDERED_INT 27
+    open_file((char*)filename);
 
-#define render_int(y, x, label, cast, format) ({ \
-    char rendered_int[MAX_RENDERED_INT]; \
-    int len = snprintf(rendered_int, MAX_RENDERED_INT, format, \
-                       *(cast*)(source + cursor_byte)); \
-    add_commas(rendered_int, len); \
-    mvwprintw(panes[PANE_DETAIL].window, y, x, "%s %s", label, \
-              rendered_int); \
-    }) \
+    // Jumps off screen center the view on the cursor, paging moves both by
+    // a screenful and the view stops at the last line
+    int64_t far = 0x1700000000LL;
+    int64_t far_line = far / BENCH_LINE_BYTES;
+    int64_t end = BENCH_HUGE_SIZE - 1;
+    int64_t last_start = end / BENCH_LINE_BYTES - BENCH_ROWS + 1;
+    int64_t page = BENCH_ROWS * BENCH_LINE_BYTES;
 
-void render_details()
-{
-    WINDOW* w = panes[PANE_DETAIL].window;
-    wclear(w);
+    bench_move moves[] =
+    {
+        { "jump_offset", { ':', '0', 'x', '1', '7', '0', '0', '0', '0', '0',
+                           '0', '0', '0', KEY_RETURN }, 14,
+          0, 0, far, far_line - BENCH_ROWS / 2 },
+        { "jump_to_end", { 'G' }, 1, 0, 0, end, last_start },
+        { "jump_to_start", { 'g', 'g' }, 2, end, last_start, 0, 0 },
+        { "page_down", { KEY_NPAGE }, 1, far, far_line - BENCH_ROWS / 2,
+          far + page, far_line + BENCH_ROWS / 2 },
+        { "page_up", { KEY_PPAGE }, 1, far, far_line - BENCH_ROWS / 2,
+          far - page, far_line - BENCH_ROWS * 3 / 2 },
+    };
+
+    double samples[BENCH_VIEWS];
+    struct timespec start;
+
+    for (int move = 0; move < (int)(sizeof(moves) / sizeof(moves[0]));
+         move++)
+    {
+        bench_move* m = &moves[move];
 
-    mvwprintw(w, 1, 1, "Offset: %d", cursor_byte);
+        for (int run = 0; run < BENCH_VIEWS; run++)
+        {
+            cursor_byte = m->cursor_before;
+            scroll_start = m->scroll_before;
 
-    char binary[9];
-    byte_to_binary_string(*(int8_t*)(source + cursor_byte), binary);
-    mvwprintw(w, 1, 30, "Binary: %s", binary);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            bench_keys(m->keys, m->keys_len);
+            samples[run] = ms_since(start);
 
-    render_int(2, 1, "Int8:  ", int8_t, "%d");
-    render_int(3, 1, "UInt8: ", uint8_t, "%d");
-    render_int(4, 1, "Int16: ", int16_t, "%d");
-    render_int(5, 1, "UInt16:", uint16_t, "%d");
+            if (cursor_byte != m->cursor_after ||
+                scroll_start != m->scroll_after)
+            {
+                fprintf(stderr, "huge: %s left the cursor at 0x%" PRIx64
+                        " and the view at line %" PRId64 ", not 0x%" PRIx64
+                        " and line %" PRId64 "\n", m->name, cursor_byte,
+                        scroll_start, m->cursor_after, m->scroll_after);
+                close_file();
+                return false;
+            }
+        }
 
-    render_int(2, 30, "Int32: ", int32_t, "%d");
-    render_int(3, 30, "UInt32:", uint32_t, "%d");
-    render_int(4, 30, "Int64: ", int64_t, "%ld");
-    render_int(5, 30, "UInt64:", uint64_t, "%ld");
+        report_bench("huge", m->name, 0, samples, BENCH_VIEWS);
+    }
 
-    box(w, 0, 0);
+    close_file();
+    return true;
 }
 
-void render_error()
+int run_bench(const char* directory)
 {
-    if (!error_displayed)
+    batch_mode = true;
+    init_format_tables();
+
+    set_bench_width(BENCH_LINE_BYTES);
+
+    uint64_t state = 0x5851f42d4c957f2dULL;
+
+    for (int term = 0; term < BENCH_TERMS_LEN; term++)
     {
-        return;
+        for (int i = 0; i < BENCH_LONG_TERM_LEN; i++)
+        {
+            // High bytes never show up in the text corpora
+            bench_terms[term][i] = bench_random(&state) | 0x80;
+        }
     }
 
-    attron(COLOR_PAIR(STYLE_ERROR));
-    mvprintw(max_y - 1, 0, "%s", error_text);
-    attroff(COLOR_PAIR(STYLE_ERROR));
-}
+    mkdir(directory, 0755);
 
-void place_cursor()
-{
-    int render_cursor_x;
-    int render_cursor_y;
+    printf("{\n  \"threads\": %d,\n  \"results\": [\n", worker_threads);
 
-    if (command_entering)
+    for (int corpus = 0; corpus < CORPORA_LEN; corpus++)
     {
-        render_cursor_y = max_y - 1;
-        render_cursor_x = command_len >= max_x ? max_x : command_len;
+        char filename[PATH_MAX];
+        snprintf(filename, sizeof(filename), "%s/%s.bin", directory,
+                 corpus_names[corpus]);
+
+        if (!make_corpus(corpus, filename))
+        {
+            fprintf(stderr, "Error writing %s\n", filename);
+            return 1;
+        }
+
+        if (!bench_file(corpus, filename))
+        {
+            return 1;
+        }
     }
-    else
+
+    char huge[PATH_MAX];
+    snprintf(huge, sizeof(huge), "%s/huge.bin", directory);
+
+    if (!bench_navigation(huge))
     {
-        render_cursor_x = panes[PANE_HEX].left + byte_in_column(cursor_byte) +
-                          cursor_nibble;
-        render_cursor_y = panes[PANE_HEX].top + byte_in_line(cursor_byte) -
-                          scroll_start;
+        return 1;
     }
 
-    move(render_cursor_y, render_cursor_x);
+    printf("\n  ]\n}\n");
+    return 0;
 }
 
-void flush_output()
+void usage()
 {
-    wnoutrefresh(panes[PANE_HEX].window);
-    wnoutrefresh(panes[PANE_ASCII].window);
-    wnoutrefresh(panes[PANE_DETAIL].window);
-
-    doupdate();
+    printf("Usage: hexitor [--threads N] [--recovery] [--follow] "
+           "[--trace <file>] <filename>|-\n"
+           "       hexitor --diff <filename> <other_filename>\n"
+           "       hexitor --batch <script> [--threads N] <filename>...\n"
+           "       hexitor --bench <directory> [--threads N]\n");
+    exit(1);
 }
 
-void update(int event)
+int main(int argc, char* argv[])
 {
-    error_displayed = false;
+    static struct option long_options[] =
+    {
+        {"threads", required_argument, NULL, 't'},
+        {"recovery", no_argument, NULL, 'r'},
+        {"follow", no_argument, NULL, 'f'},
+        {"batch", required_argument, NULL, 'b'},
+        {"diff", no_argument, NULL, 'd'},
+        {"bench", required_argument, NULL, 'B'},
+        {"trace", required_argument, NULL, 'T'},
+        {0, 0, 0, 0},
+    };
+
+    worker_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    bool recovery = false;
+    char* batch_script = NULL;
+    char* bench_directory = NULL;
+    char* trace_filename = NULL;
+    bool diff = false;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "t:rfb:dB:T:", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 't':
+                worker_threads = atoi(optarg);
 
-    handle_sizing();
-    handle_event(event);
-    clamp_scrolling();
-    render_hex();
-    render_ascii();
-    render_details();
-    render_command();
-    render_error();
-    place_cursor();
-    flush_output();
-}
+                if (worker_threads < 1)
+                {
+                    usage();
+                }
 
-void open_file(char* filename)
-{
-    // Get filesize
-    struct stat st;
-    stat(filename, &st);
-    source_len = st.st_size;
-    int count = st.st_size * sizeof(unsigned char);
+                break;
 
-    // Allocate or reallocate memory
-    if (source == NULL)
-    {
-        source = malloc(count);
+            case 'r':
+                recovery = true;
+                break;
+
+            case 'f':
+                follow = true;
+                break;
+
+            case 'b':
+                batch_mode = true;
+                batch_script = optarg;
+                break;
+
+            case 'd':
+                diff = true;
+                break;
+
+            case 'B':
+                bench_directory = optarg;
+                break;
+
+            case 'T':
+                trace_filename = optarg;
+                break;
+
+            default:
+                usage();
+        }
     }
-    else
+
+    if (bench_directory)
     {
-        source = realloc(source, count);
+        if (optind != argc)
+        {
+            usage();
+        }
+
+        return run_bench(bench_directory);
     }
 
-    // Read file into memory
-    FILE* file = fopen(filename, "r");
+    if (batch_mode)
+    {
+        if (optind == argc)
+        {
+            usage();
+        }
 
-    if (!file)
+        return run_batch(batch_script, argv + optind, argc - optind);
+    }
+
+    if (optind != argc - 1 - diff)
     {
-        printf("Error opening file. File not found / permissions problem?\n");
-        exit(2);
+        usage();
     }
 
-    unsigned char* target = source;
-    size_t bytes_read;
+    open_file(argv[optind]);
 
-    while ((bytes_read = fread(target, 1, BUFFER_SIZE, file)) > 0)
+    if (diff)
     {
-        target += bytes_read;
+        open_diff_file(argv[optind + 1]);
+        count_differences();
     }
 
-    fclose(file);
-
-    original_filename = filename;
-}
+    init_format_tables();
 
-int main(int argc, char* argv[])
-{
-    if (argc != 2)
+    if (recovery)
     {
-        printf("Usage: hexitor <filename>\n");
-        return 1;
+        if (!original_filename)
+        {
+            printf("--recovery needs a regular file.\n");
+            exit(1);
+        }
+
+        open_recovery_log(argv[optind]);
     }
 
-    open_file(argv[1]);
+    if (trace_filename && !open_trace(trace_filename))
+    {
+        printf("Error opening %s: %s\n", trace_filename, strerror(errno));
+        exit(1);
+    }
 
     initscr();
     use_default_colors();
     start_color();
     cbreak();
+    noecho();
     keypad(stdscr, TRUE);
 
+    // Escape leaves insert mode, so don't hold it back for a whole second
+    // waiting for the rest of an escape sequence
+    set_escdelay(ESCAPE_SEQUENCE_MAX_TIME_MS);
+
     mouseinterval(0);
     mousemask(ALL_MOUSE_EVENTS, NULL);
 
     init_pair(STYLE_ERROR, COLOR_BLACK, COLOR_RED);
     init_pair(STYLE_CURSOR, COLOR_BLACK, COLOR_WHITE);
+    init_pair(STYLE_MATCH, COLOR_BLACK, COLOR_YELLOW);
+    init_pair(STYLE_DIFF, COLOR_RED, -1);
+    init_pair(STYLE_SELECTION, COLOR_BLACK, COLOR_CYAN);
+    init_pair(STYLE_HOLE, COLOR_BLUE, -1);
+    init_pair(STYLE_MAP_ZEROS, COLOR_WHITE, COLOR_BLACK);
+    init_pair(STYLE_MAP_TEXT, COLOR_BLACK, COLOR_GREEN);
+    init_pair(STYLE_MAP_BINARY, COLOR_WHITE, COLOR_BLUE);
+    init_pair(STYLE_MAP_RANDOM, COLOR_BLACK, COLOR_RED);
 
     refresh();
 
-    update(-1);
+    // Have the terminal mark pasted text so it can be applied in one go
+    printf("\033[?2004h");
+    fflush(stdout);
+
+    read_stream();
+    render();
 
-    int event;
+    int frame_ms = 1000 / MAX_FRAMES_PER_SECOND;
+    struct timespec last_frame;
+    struct timespec now;
 
-    while ((event = getch()) != KEY_F(1))
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
+    while (true)
     {
-        update(event);
+        // Poll while the match index, a hash or the minimap is being worked
+        // on so progress and results show up without waiting for a
+        // keypress, and wake up to commit the recovery log and to read more
+        // input.
+        int wait = match_index_building || hash_running || minimap_running ?
+                   100 : -1;
+        int commit_wait = recovery_commit_wait();
+
+        if (commit_wait >= 0 && (wait < 0 || commit_wait < wait))
+        {
+            wait = commit_wait;
+        }
+
+        if (stream_fd >= 0 && (wait < 0 || wait > STREAM_POLL_MS))
+        {
+            wait = STREAM_POLL_MS;
+        }
+
+        int event = read_event(wait);
+
+        // Apply input as a batch: everything already waiting and anything
+        // that arrives before the next frame is due, then draw once.
+        while (event != ERR)
+        {
+            if (event == KEY_F(1))
+            {
+                quit();
+            }
+
+            handle_input(event);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int elapsed = ms_taken(last_frame, now);
+
+            if (elapsed >= frame_ms)
+            {
+                break;
+            }
+
+            event = read_event(frame_ms - elapsed);
+        }
+
+        read_stream();
+        render();
+        clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
+        if (recovery_commit_wait() == 0)
+        {
+            commit_recovery_log();
+        }
     }
 }